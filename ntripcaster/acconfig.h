@@ -4,6 +4,9 @@
 /* Whether to use tcp_wrappers */
 #undef HAVE_LIBWRAP
 
+/* Whether to build the TLS listeners */
+#undef HAVE_OPENSSL
+
 /* User want readline */
 #undef HAVE_LIBREADLINE
 
@@ -60,6 +60,9 @@
 /* Whether to use tcp_wrappers */
 /* #undef HAVE_LIBWRAP */
 
+/* Whether to build the TLS listeners */
+/* #undef HAVE_OPENSSL */
+
 /* Some systems have sys/syslog.h */
 /* #undef NEED_SYS_SYSLOG_H */
 
@@ -112,6 +112,7 @@
 #include "utility.h"
 #include "ntrip_string.h"
 #include "connection.h"
+#define LOG_MODULE LOG_MOD_AVL
 #include "log.h"
 #include "threads.h"
 #include "client.h"
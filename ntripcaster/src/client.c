@@ -86,9 +86,12 @@
 #include "ntrip_string.h"
 #include "client.h"
 #include "connection.h"
+#define LOG_MODULE LOG_MOD_CLIENT
 #include "log.h"
 #include "source.h"
 #include "sock.h"
+#include "timer.h"
+#include "metrics.h"
 
 /* basic.c. ajd ****************************************************/
 
@@ -119,10 +122,9 @@ time_t lastrehash = 0;
 
 void client_login(connection_t *con, char *expr)
 {
-	char line[BUFSIZE];
-	int go_on = 1;
 	connection_t *source;
 	request_t req;
+	const char *host;
 
 
 	xa_debug(3, "Client login...\n");
@@ -134,23 +136,13 @@ void client_login(connection_t *con, char *expr)
 
 	zero_request(&req);
 
-	con->headervars = create_header_vars ();
+	header_parse (con, expr);
 
-	do {
-		if (splitc(line, expr, '\n') == NULL) {
-			strncpy(line, expr, BUFSIZE);
-			go_on = 0;
-		}
+	if (con->headers.request_line)
+		build_request (con->headers.request_line, &req);
 
-		if (ice_strncmp(line, "GET", 3) == 0) {
-			build_request(line, &req);
-		} else {
-      			if (ice_strncmp(line, "Host:", 5) == 0 || (ice_strncmp(line, "HOST:", 5) == 0))
-      				build_request(line, &req);
-			else
-				extract_header_vars (line, con->headervars);
-		}
-	} while (go_on);
+	if ((host = header_get (con, HDR_HOST)))
+		build_request_host (host, &req);
 
 	if (!authenticate_user_request (con, &req))
 	{
@@ -165,6 +157,12 @@ void client_login(connection_t *con, char *expr)
 		return;
 	}
 	
+	if (ice_strcmp (req.path, "/metrics") == 0) {
+		metrics_serve (con);
+		kick_not_connected (con, "Metrics transferred");
+		return;
+	}
+
 	if (strncasecmp(get_user_agent(con), "ntrip", 5) != 0) {
 		write_401 (con, req.path);
 		kick_not_connected (con, "No NTRIP client");
@@ -173,37 +171,28 @@ void client_login(connection_t *con, char *expr)
 
 	xa_debug (1, "Looking for mount [%s:%d%s]", req.host, req.port, req.path);
 
-	thread_mutex_lock (&info.double_mutex);
 //	thread_mutex_lock (&info.mount_mutex);
 	thread_mutex_lock (&info.source_mutex);
 
 	source = find_mount_with_req (&req);
 
+	/* Another worker may have it */
+	if (source == NULL)
+		source = bus_mirror (req.path);
+
 //	thread_mutex_unlock (&info.mount_mutex);
-//	thread_mutex_unlock (&info.double_mutex);
 
 	if (source == NULL)  {
 	
 		thread_mutex_unlock (&info.source_mutex);
-		thread_mutex_unlock (&info.double_mutex);
 
 		send_sourcetable(con);
 		kick_not_connected (con, "Transfer Sourcetable");
 		return;
 	} else {
-		if ((info.num_clients >= info.max_clients) 
-		|| (source->food.source->num_clients >= info.max_clients_per_source))
+		if (!util_increase_total_clients (source->food.source))
 		{
 			thread_mutex_unlock (&info.source_mutex);
-			thread_mutex_unlock (&info.double_mutex);
-
-			if (info.num_clients >= info.max_clients)
-				xa_debug (2, "DEBUG: inc > imc: %lu %lu", info.num_clients, info.max_clients);
-			else if (source->food.source->num_clients >= info.max_clients_per_source)
-				xa_debug (2, "DEBUG: snc > smc: %lu %lu", source->food.source->num_clients, info.max_clients_per_source);
-			else 
-				xa_debug (1, "ERROR: Erroneous number of clients, what the hell is going on?");
-	
 			kick_not_connected (con, "Server Full (too many listeners)");
 			return;
 		}
@@ -214,7 +203,7 @@ void client_login(connection_t *con, char *expr)
 		source->food.source->stats.client_connections++;
 		if (req.user[0] != '\0') con->user = strdup(req.user);
 		{
-			const char *ref = get_con_variable (con, "Referer");
+			const char *ref = header_get (con, HDR_REFERER);
 			if (ref && ice_strcmp (ref, "RELAY") == 0)
 				con->food.client->type = pulling_client_e;
 		}
@@ -224,9 +213,9 @@ void client_login(connection_t *con, char *expr)
 	}
 
 	thread_mutex_unlock (&info.source_mutex);
-	thread_mutex_unlock (&info.double_mutex);
 
-	util_increase_total_clients ();
+	stats_count (client_connections, 1);
+	metrics_login_done (con);
 /*
 	// Change the sockaddr_in for the client to point to the port the client specified
 	if (con->sin)
@@ -250,7 +239,7 @@ void client_login(connection_t *con, char *expr)
 client_t *
 create_client()
 {
-	client_t *client = (client_t *)nmalloc(sizeof(client_t));
+	client_t *client = (client_t *) slab_alloc (&client_slab);
 	client->type = unknown_client_e;
 	return client;
 }
@@ -262,28 +251,43 @@ void put_client(connection_t *con)
 	cli->errors = 0;
 	cli->type = unknown_client_e;
 	cli->write_bytes = 0;
+	cli->idle_bytes = 0;
+	cli->idle_source_bytes = 0;
+	cli->idle_since = get_time ();
+	cli->acked_bytes = 0;
+	cli->acked_since = cli->idle_since;
 	cli->virgin = -1;
 	cli->source = NULL;
-	cli->cid = -1;
-	cli->offset = 0;
+	cli->slot = -1;
 	cli->alive = CLIENT_ALIVE;
 	con->type = client_e;
 }
 
-void util_increase_total_clients ()
+/* Admit a client to source, against max_clients and max_clients_per_source.
+   Returns 0 when either is full. */
+int
+util_increase_total_clients (source_t *source)
 {
-	internal_lock_mutex (&info.misc_mutex);
-	info.num_clients++;
-	info.hourly_stats.client_connections++;
-	internal_unlock_mutex (&info.misc_mutex);
+	if (!util_reserve (&info.num_clients, info.max_clients)) {
+		xa_debug (2, "DEBUG: inc >= imc: %lu %lu", info.num_clients, info.max_clients);
+		return 0;
+	}
+
+	if (!util_reserve (&source->admitted_clients, info.max_clients_per_source)) {
+		xa_debug (2, "DEBUG: snc >= smc: %lu %lu", source->admitted_clients, info.max_clients_per_source);
+		util_release (&info.num_clients);
+		return 0;
+	}
+
+	return 1;
 }
 
 void
-util_decrease_total_clients ()
+util_decrease_total_clients (source_t *source)
 {
-	internal_lock_mutex (&info.misc_mutex);
-	info.num_clients--;
-	internal_unlock_mutex (&info.misc_mutex);
+	if (source)
+		util_release (&source->admitted_clients);
+	util_release (&info.num_clients);
 }
 
 void 
@@ -300,16 +304,12 @@ del_client(connection_t *client, source_t *source)
 		else
 			source->num_clients--;
 	}
-	util_decrease_total_clients ();
+	util_decrease_total_clients (source);
 }
 
 void 
 greet_client(connection_t *con, source_t *source)
 {
-#ifdef _WIN32
-	int bufsize = 16384;
-#endif
-	
 //	char *time;
 
 	if (!con) {
@@ -326,10 +326,7 @@ greet_client(connection_t *con, source_t *source)
 //	free (time);
 
 	sock_set_blocking(con->sock, SOCK_NONBLOCK);
-
-#ifdef _WIN32
-	setsockopt(con->sock, SOL_SOCKET, SO_SNDBUF, (char *)&bufsize, sizeof(int));
-#endif
+	sock_apply_policy (con->sock, con->food.client->type == pulling_client_e ? SOCK_ROLE_RELAY : SOCK_ROLE_CLIENT);
 
 	con->food.client->virgin = 1;
 
@@ -357,10 +354,10 @@ client_type (const connection_t *clicon)
 int
 client_errors (const client_t *client)
 {
-	if (!client || !client->source)
+	if (!client || !client->source || client->slot < 0)
 		return 0;
 	
-	return (CHUNKLEN - (client->cid - client->source->cid)) % CHUNKLEN;
+	return client_slot_errors (client->source, &client->source->clients.slot[client->slot]);
 }
 
 /* Check if the user agent indicates a web browser */
@@ -700,7 +697,7 @@ send_sourcetable (connection_t *con) {
 	
 	xa_debug(2, "DEBUG: send_sourcetable() User-Agent: [%s]", user_agent ? user_agent : "(null)");
 
-	ifp = fopen("../conf/sourcetable.dat","r");
+	ifp = sourcetable_open ();
 	
 	/* Check if this is a browser request */
 	if (is_browser(user_agent)) {
@@ -887,7 +884,7 @@ con_get_user(connection_t * con, ice_user_t * outuser)
 	outuser->name = NULL;
 	outuser->pass = NULL;
 
-	cauth = get_con_variable(con, "Authorization");
+	cauth = header_get (con, HDR_AUTHORIZATION);
 
 	if (!cauth)
 		return NULL;
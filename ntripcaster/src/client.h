@@ -45,8 +45,8 @@
 void client_login(connection_t *con, char *line);
 void put_client(connection_t *con);
 client_t *create_client();
-void util_increase_total_clients ();
-void util_decrease_total_clients ();
+int util_increase_total_clients (source_t *source);
+void util_decrease_total_clients (source_t *source);
 void del_client(connection_t *client, source_t *source);
 int client_errors (const client_t *client);
 void greet_client(connection_t *con, source_t *source);
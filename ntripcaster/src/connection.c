@@ -70,6 +70,7 @@
 #ifndef _WIN32
 #include <sys/socket.h> 
 #include <sys/wait.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <sys/time.h>
 #else
@@ -82,10 +83,12 @@
 #include "utility.h"
 #include "ntrip_string.h"
 #include "connection.h"
+#define LOG_MODULE LOG_MOD_CONNECTION
 #include "log.h"
 #include "sock.h"
 #include "client.h"
 #include "source.h"
+#include "timer.h"
 
 
 /* pool.c. ajd *************************************/
@@ -133,14 +136,12 @@ extern struct in_addr localaddr;
 
 /*
  * This is called to handle a brand new connection, in it's own thread.
- * Nothing is know about the type of the connection.
+ * The login thread has read its request into con->request already.
  * Assert Class: 3
  */
 void *handle_connection(void *arg)
 {
 	connection_t *con = (connection_t *)arg;
-	char line[BUFSIZE] = "";
-	int res;
 
 	thread_init(); 
 
@@ -149,22 +150,17 @@ void *handle_connection(void *arg)
 		thread_exit(0);
 	}
 
-	if (info.reverse_lookups)
-		con->hostname = reverse(con->host);
+	/* Don't wait for the name, con_host() picks it up once it's resolved */
+	resolv_hostname (con);
 
 	sock_set_blocking(con->sock, SOCK_BLOCK);
-	
-	/* Fill line[] with the user header, ends with \n\n */
-	if ((res = sock_read_lines(con->sock, line, BUFSIZE)) <= 0) {
-		write_log(LOG_DEFAULT, "Socket error on connection %d", con->id);
-		kick_not_connected(con, "Socket error");
-		thread_exit(0);
-	}
 
-	if (ice_strncmp(line, "GET", 3) == 0) {
-		client_login(con, line);
-	} else if (ice_strncmp(line, "SOURCE", 6) == 0) {
-		source_login (con, line);
+	if (ice_strncmp(con->request, "GET", 3) == 0) {
+		client_login(con, con->request);
+	} else if (ice_strncmp(con->request, "SOURCE", 6) == 0) {
+		source_login (con, con->request);
+	} else if (ice_strncmp(con->request, "REPLICATE", 9) == 0) {
+		replica_login (con, con->request);
 	} else {
 		write_400 (con);
 		kick_not_connected(con, "Invalid header");
@@ -174,39 +170,350 @@ void *handle_connection(void *arg)
 	return NULL;
 }
 
+/* login.c. ajd *********************************************************************/
+
+/*
+ * New connections wait in the login thread until their request headers
+ * are in, all of them in one poll() set. A connection costs a slot and
+ * the request buffer it has anyway, and gets login_timeout seconds for
+ * the whole request and BUFSIZE bytes for it, TLS handshake included.
+ * Only complete requests get a Connection Handler thread.
+ */
+#define LOGIN_POLL 1000		/* Longest poll() in milliseconds */
+
+#define LOGIN_WAIT 0
+#define LOGIN_DONE 1
+#define LOGIN_TIMEOUT 2
+#define LOGIN_TOO_LONG 3
+#define LOGIN_CLOSED 4
+#define LOGIN_TLS_FAILED 5
+
+typedef struct login_slot_St
+{
+	connection_t *con;
+	int len;		/* Bytes in con->request */
+	int more;		/* Got a SOURCE line on its own, read the headers after it */
+	int handshake;		/* TLS handshake still going on */
+	short events;		/* To poll() for */
+	long long deadline;	/* get_mono_usec(), 0 for none */
+} login_slot_t;
+
+static mutex_t login_mutex;	/* Leaf lock, protects login_new */
+static connection_t **login_new = NULL;	/* Accepted, not seen by the login thread yet */
+static int login_new_count = 0, login_new_size = 0;
+static int login_wake[2] = { -1, -1 };
+
+/* Hand a new connection to the login thread */
+void
+login_queue (connection_t *con)
+{
+	internal_lock_mutex (&login_mutex);
+
+	if (login_new_count == login_new_size) {
+		connection_t **grown;
+
+		login_new_size = login_new_size ? login_new_size * 2 : 64;
+		grown = (connection_t **) nmalloc (login_new_size * sizeof (connection_t *));
+		if (login_new_count > 0)
+			memcpy (grown, login_new, login_new_count * sizeof (connection_t *));
+		if (login_new) {
+			nfree (login_new);
+		}
+		login_new = grown;
+	}
+
+	login_new[login_new_count++] = con;
+
+	internal_unlock_mutex (&login_mutex);
+
+	if (write (login_wake[1], "", 1) < 0)
+		xa_debug (4, "DEBUG: Login thread wakeup pending already");
+}
+
+/* Did con send a SOURCE line without headers so far? */
+static int
+login_source_line_only (connection_t *con, int len)
+{
+	return ice_strncmp (con->request, "SOURCE", 6) == 0 && strchr (con->request, '\n') == con->request + len - 2;
+}
+
+/*
+ * Read what slot's connection has sent. Only the request is taken off
+ * the socket, whatever follows it is left for the login handler.
+ */
+static int
+login_read (login_slot_t *slot)
+{
+	connection_t *con = slot->con;
+	char buf[BUFSIZE], c;
+	int got, used = 0, done = 0;
+
+	if (slot->len >= BUFSIZE - 1)
+		return LOGIN_TOO_LONG;
+
+	got = sock_recv (con->sock, buf, BUFSIZE - 1 - slot->len, MSG_PEEK);
+
+	if (got == 0)
+		return LOGIN_CLOSED;
+	if (got < 0)
+		return is_recoverable (errno) ? LOGIN_WAIT : LOGIN_CLOSED;
+
+	while (used < got && !done) {
+		c = buf[used++];
+		if (c == '\r')
+			continue;
+
+		con->request[slot->len++] = c;
+
+		if (c == '\n' && slot->len > 1 && con->request[slot->len - 2] == '\n') {
+			con->request[slot->len] = '\0';
+			if (!slot->more && login_source_line_only (con, slot->len))
+				slot->more = 1;
+			else
+				done = 1;
+		}
+	}
+
+	con->request[slot->len] = '\0';
+
+	/* Peeked at already, so this doesn't block */
+	if (sock_recv (con->sock, buf, used, 0) != used)
+		return LOGIN_CLOSED;
+
+	if (done)
+		return LOGIN_DONE;
+	if (slot->len >= BUFSIZE - 1)
+		return LOGIN_TOO_LONG;
+	return LOGIN_WAIT;
+}
+
+/* Go on with the TLS handshake, and on to the request once it's done */
+static int
+login_handshake (login_slot_t *slot)
+{
+	switch (tls_handshake (slot->con->sock, &slot->events)) {
+		case 0:
+			return LOGIN_WAIT;
+		case 1:
+			slot->handshake = 0;
+			slot->events = POLLIN;
+			/* The request may have come along with the last flight */
+			return login_read (slot);
+		default:
+			return LOGIN_TLS_FAILED;
+	}
+}
+
+static void
+login_start (login_slot_t *slot, connection_t *con)
+{
+	slot->con = con;
+	slot->len = 0;
+	slot->more = 0;
+	slot->handshake = con->tls;
+	slot->events = POLLIN;
+	slot->deadline = info.login_timeout > 0 ? get_mono_usec () + info.login_timeout * 1000000LL : 0;
+	con->request[0] = '\0';
+
+	sock_set_blocking (con->sock, SOCK_NONBLOCK);
+
+	/* Without a session the first handshake step fails it */
+	if (con->tls)
+		tls_start (con->sock);
+}
+
+static void
+login_finish (login_slot_t *slot, int res)
+{
+	connection_t *con = slot->con;
+
+	switch (res) {
+		case LOGIN_DONE:
+			thread_create ("Connection Handler", handle_connection, (void *) con);
+			break;
+		case LOGIN_TIMEOUT:
+			write_log (LOG_DEFAULT, "Login timeout on connection %d", con->id);
+			kick_not_connected (con, "Login timeout");
+			break;
+		case LOGIN_TOO_LONG:
+			write_log (LOG_DEFAULT, "Request too long on connection %d", con->id);
+			write_400 (con);
+			kick_not_connected (con, "Request too long");
+			break;
+		case LOGIN_TLS_FAILED:
+			write_log (LOG_DEFAULT, "TLS handshake failed on connection %d", con->id);
+			kick_not_connected (con, "TLS handshake failed");
+			break;
+		default:
+			write_log (LOG_DEFAULT, "Socket error on connection %d", con->id);
+			kick_not_connected (con, "Socket error");
+			break;
+	}
+}
+
+void *
+login_thread (void *arg)
+{
+	mythread_t *mt;
+	login_slot_t *slot = NULL;
+	struct pollfd *pfd = NULL;
+	int count = 0, size = 0, i, n, res;
+	long long now, next;
+	char drain[64];
+
+	thread_init ();
+
+	mt = thread_get_mythread ();
+
+	while (thread_alive (mt) && running == SERVER_RUNNING) {
+		/* Take over the connections accepted since the last round */
+		internal_lock_mutex (&login_mutex);
+		if (count + login_new_count > size) {
+			login_slot_t *grown_slot;
+			struct pollfd *grown_pfd;
+
+			size = (count + login_new_count) * 2;
+			grown_slot = (login_slot_t *) nmalloc (size * sizeof (login_slot_t));
+			grown_pfd = (struct pollfd *) nmalloc ((size + 1) * sizeof (struct pollfd));
+			if (count > 0)
+				memcpy (grown_slot, slot, count * sizeof (login_slot_t));
+			if (slot) {
+				nfree (slot);
+				nfree (pfd);
+			}
+			slot = grown_slot;
+			pfd = grown_pfd;
+		}
+		for (i = 0; i < login_new_count; i++)
+			login_start (&slot[count++], login_new[i]);
+		login_new_count = 0;
+		internal_unlock_mutex (&login_mutex);
+
+		if (!pfd) {
+			size = 16;
+			slot = (login_slot_t *) nmalloc (size * sizeof (login_slot_t));
+			pfd = (struct pollfd *) nmalloc ((size + 1) * sizeof (struct pollfd));
+		}
+
+		now = get_mono_usec ();
+		next = now + LOGIN_POLL * 1000LL;
+
+		pfd[0].fd = login_wake[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		for (i = 0; i < count; i++) {
+			pfd[i + 1].fd = slot[i].con->sock;
+			pfd[i + 1].events = slot[i].events;
+			pfd[i + 1].revents = 0;
+			if (slot[i].deadline && slot[i].deadline < next)
+				next = slot[i].deadline;
+		}
+
+		n = poll (pfd, count + 1, next > now ? (int) ((next - now + 999) / 1000) : 0);
+
+		if (mt->ping == 1)
+			mt->ping = 0;
+
+		if (n < 0) {
+			if (!is_recoverable (errno))
+				xa_debug (1, "WARNING: poll() failed in the login thread [%d:%s]", errno, strerror (errno));
+			continue;
+		}
+
+		if (pfd[0].revents & POLLIN)
+			while (read (login_wake[0], drain, sizeof (drain)) > 0)
+				;
+
+		now = get_mono_usec ();
+
+		for (i = 0; i < count; ) {
+			res = LOGIN_WAIT;
+
+			if (pfd[i + 1].revents)
+				res = slot[i].handshake ? login_handshake (&slot[i]) : login_read (&slot[i]);
+			if (res == LOGIN_WAIT && slot[i].deadline && now >= slot[i].deadline)
+				res = LOGIN_TIMEOUT;
+
+			if (res == LOGIN_WAIT) {
+				i++;
+				continue;
+			}
+
+			login_finish (&slot[i], res);
+
+			/* Keep the set dense, the last one moves in with its revents */
+			count--;
+			slot[i] = slot[count];
+			pfd[i + 1] = pfd[count + 1];
+		}
+	}
+
+	/* Nobody is going to finish logging in now */
+	internal_lock_mutex (&login_mutex);
+	for (i = 0; i < login_new_count; i++)
+		kick_not_connected (login_new[i], "Server shutting down");
+	login_new_count = 0;
+	internal_unlock_mutex (&login_mutex);
+
+	for (i = 0; i < count; i++)
+		kick_not_connected (slot[i].con, "Server shutting down");
+
+	if (slot) {
+		nfree (slot);
+		nfree (pfd);
+	}
+
+	thread_exit (0);
+	return NULL;
+}
+
+void
+login_start_thread ()
+{
+	thread_create_mutex (&login_mutex);
+
+	if (pipe (login_wake) < 0) {
+		write_log (LOG_DEFAULT, "ERROR: Cannot create the login thread wakeup pipe [%d:%s]", errno, strerror (errno));
+		login_wake[0] = login_wake[1] = -1;
+	} else {
+		fcntl (login_wake[0], F_SETFL, O_NONBLOCK);
+		fcntl (login_wake[1], F_SETFL, O_NONBLOCK);
+	}
+
+	thread_create ("Login Thread", login_thread, NULL);
+}
+
 connection_t *
 create_connection()
 {
-	connection_t *con = (connection_t *) nmalloc (sizeof (connection_t));
+	connection_t *con = (connection_t *) slab_alloc (&connection_slab);
+
+	if (!con)
+		return NULL;
 	con->type = unknown_connection_e;
 	con->sin = NULL;
 	con->hostname = NULL;
-	con->headervars = NULL;
 	con->food.source = NULL;
 	con->user = NULL;
+	con->tls = 0;
+	con->admitted = 0;
 	return con;
 }
 
 connection_t *
-get_connection (sock_t *sock)
+get_connection (sock_t *sock, sock_t *tls_sock)
 {
-	int sockfd;
+	int sockfd, tls = 0, admitted;
 	mysocklen_t sin_len;
 	connection_t *con;
 	fd_set rfds;
 	struct timeval tv;
 	int i, maxport = 0;
-	struct sockaddr_in *sin = (struct sockaddr_in *)nmalloc(sizeof(struct sockaddr_in));
-
-	if (!sin)
-	{
-		write_log (LOG_DEFAULT, "WARNING: Weird stuff in get_connection. nmalloc returned NULL sin");
-		return NULL;
-	}
+	struct sockaddr_in sa, *sin;
 
 	/* setup sockaddr structure */
 	sin_len = sizeof(struct sockaddr_in);
-	memset(sin, 0, sin_len);
+	memset(&sa, 0, sin_len);
   
 	/* try to accept a connection */
 	FD_ZERO(&rfds);
@@ -217,6 +524,11 @@ get_connection (sock_t *sock)
 			if (sock[i] > maxport) 
 				maxport = sock[i];
 		}
+		if (sock_valid (tls_sock[i])) {
+			FD_SET(tls_sock[i], &rfds);
+			if (tls_sock[i] > maxport) 
+				maxport = tls_sock[i];
+		}
 	}
 	maxport += 1;
 
@@ -227,31 +539,52 @@ get_connection (sock_t *sock)
 		for (i = 0; i < MAXLISTEN; i++) {
 			if (sock_valid (sock[i]) && FD_ISSET(sock[i], &rfds)) 
 				break;
+			if (sock_valid (tls_sock[i]) && FD_ISSET(tls_sock[i], &rfds)) {
+				tls = 1;
+				break;
+			}
 		}
 	} else {
-		nfree(sin);
 		return NULL;
 	}
+
+	if (tls)
+		sock = tls_sock;
 	
-	sockfd = sock_accept(sock[i], (struct sockaddr *)sin, &sin_len);
+	sockfd = sock_accept(sock[i], (struct sockaddr *)&sa, &sin_len);
   
 	if (sockfd >= 0) {
-		con = create_connection();
-		if (!sin)
-		{
-			xa_debug (1, "ERROR: NULL sockaddr struct, wft???");
+		/* Turn floods away before anything is allocated for them */
+		if (!admit_connection (sa.sin_addr, &admitted)) {
+			sock_close (sockfd);
 			return NULL;
 		}
 
+		sin = (struct sockaddr_in *) slab_alloc (&sockaddr_slab);
+		con = sin ? create_connection () : NULL;
+		if (!con) {
+			write_log (LOG_DEFAULT, "WARNING: No memory for a new connection, closing it");
+			if (sin) {
+				slab_free (&sockaddr_slab, sin);
+			}
+			if (admitted)
+				admit_release (sa.sin_addr);
+			sock_close (sockfd);
+			return NULL;
+		}
+		memcpy (sin, &sa, sizeof (struct sockaddr_in));
+
+		con->admitted = admitted;
 		con->host = create_malloced_ascii_host(&(sin->sin_addr));
 		con->sock = sockfd;
+		con->tls = tls;
 		con->sin = sin;
 		con->sinlen = sin_len;
 		xa_debug (2, "DEBUG: Getting new connection on socket %d from host %s", sockfd, con->host ? con->host : "(null)");
 		con->hostname = NULL;
-		con->headervars = NULL;
 		con->id = new_id ();
 		con->connect_time = get_time ();
+		con->connect_usec = get_mono_usec ();
 #ifdef HAVE_LIBWRAP
 		if (!sock_check_libwrap(sockfd, unknown_connection_e))
 		{
@@ -266,7 +599,6 @@ get_connection (sock_t *sock)
 	if (!is_recoverable (errno))
 		xa_debug (1, "WARNING: accept() failed with on socket %d, max: %d, [%d:%s]", sock[i], maxport, 
 			  errno, strerror(errno));
-	nfree (sin);
 	return NULL;
 }
 
@@ -278,20 +610,228 @@ get_user_agent (connection_t *con)
 	if (!con)
 		return cnull;
 
-	res = get_con_variable (con, "User-Agent");
-
-	if (!res)
-		res = get_con_variable (con, "User-agent");
+	res = header_get (con, HDR_USER_AGENT);
 
 	if (!res)
-		res = get_con_variable (con, "user-agent");
-
-        if (!res)
 		return cnull;
 	else
 		return res;
 }
 
+/* admit.c. ajd *********************************************************************/
+
+/*
+ * Per address admission control, checked right after accept(). Every
+ * address gets a slot in an open addressed table, with its open
+ * connections and a token bucket for its connect rate. Rejected attempts
+ * while the bucket is empty count as strikes, connect_burst strikes get
+ * the address banned for connect_ban_time seconds. Slots of addresses
+ * with nothing open, a full bucket and no ban are taken over by others,
+ * but stay in their probe chain until then.
+ */
+#define ADMIT_SLOTS 8192	/* A power of two */
+#define ADMIT_PROBE 32
+
+typedef struct admit_slot_St
+{
+	unsigned long int addr;		/* Network order, 0 for never used */
+	int open;
+	int strikes;
+	double tokens;
+	long long stamp;		/* get_mono_usec() tokens were refilled at */
+	time_t banned_until;
+} admit_slot_t;
+
+static admit_slot_t admit_table[ADMIT_SLOTS];
+static mutex_t admit_mutex;		/* Leaf lock */
+static admit_stats_t admit_stats;
+
+void
+admit_init ()
+{
+	thread_create_mutex (&admit_mutex);
+	memset (admit_table, 0, sizeof (admit_table));
+	memset (&admit_stats, 0, sizeof (admit_stats));
+}
+
+static unsigned int
+admit_hash (unsigned long int addr)
+{
+	return (unsigned int) ((addr * 2654435761UL) >> 7) & (ADMIT_SLOTS - 1);
+}
+
+/* Refill the bucket of slot up to now */
+static void
+admit_refill (admit_slot_t *slot, long long now)
+{
+	if (info.connect_rate > 0) {
+		slot->tokens += (now - slot->stamp) * (info.connect_rate / 60000000.0);
+		if (slot->tokens >= info.connect_burst) {
+			slot->tokens = info.connect_burst;
+			slot->strikes = 0;
+		}
+	}
+	slot->stamp = now;
+}
+
+static int
+admit_idle (admit_slot_t *slot, long long now, time_t stime)
+{
+	if (slot->open > 0 || slot->banned_until > stime)
+		return 0;
+	admit_refill (slot, now);
+	return info.connect_rate <= 0 || slot->tokens >= info.connect_burst;
+}
+
+/*
+ * Find the slot of addr, must have admit_mutex. With claim set an idle
+ * slot on the way is taken over if addr has none. Returns NULL if
+ * there is none to be had.
+ */
+static admit_slot_t *
+admit_find (unsigned long int addr, int claim, long long now, time_t stime)
+{
+	admit_slot_t *slot, *idle = NULL;
+	unsigned int h = admit_hash (addr);
+	int i;
+
+	for (i = 0; i < ADMIT_PROBE; i++) {
+		slot = &admit_table[(h + i) & (ADMIT_SLOTS - 1)];
+
+		if (slot->addr == addr)
+			return slot;
+		if (slot->addr == 0) {
+			if (!idle)
+				idle = slot;
+			break;
+		}
+		if (claim && !idle && admit_idle (slot, now, stime))
+			idle = slot;
+	}
+
+	if (!claim || !idle)
+		return NULL;
+
+	if (idle->addr == 0)
+		admit_stats.tracked++;
+	idle->addr = addr;
+	idle->open = 0;
+	idle->strikes = 0;
+	idle->tokens = info.connect_burst;
+	idle->stamp = now;
+	idle->banned_until = 0;
+	return idle;
+}
+
+/*
+ * Count a new connection from addr against its limits.
+ * Returns 0 if it should be closed right away. counted is set if it
+ * was counted, and must be given back with admit_release().
+ */
+int
+admit_connection (struct in_addr in, int *counted)
+{
+	admit_slot_t *slot;
+	long long now;
+	time_t stime;
+	int ret = 1;
+	char host[20];
+
+	*counted = 0;
+
+	if (info.max_connections_per_ip <= 0 && info.connect_rate <= 0)
+		return 1;
+
+	now = get_mono_usec ();
+	stime = get_time ();
+
+	internal_lock_mutex (&admit_mutex);
+
+	slot = admit_find (in.s_addr, 1, now, stime);
+
+	if (!slot) {
+		/* Let it through rather than guess */
+		admit_stats.table_full++;
+		internal_unlock_mutex (&admit_mutex);
+		return 1;
+	}
+
+	if (slot->banned_until > stime) {
+		admit_stats.rejected_banned++;
+		ret = 0;
+	} else if (info.max_connections_per_ip > 0 && slot->open >= info.max_connections_per_ip) {
+		admit_stats.rejected_open++;
+		ret = 0;
+	} else if (info.connect_rate > 0) {
+		admit_refill (slot, now);
+		if (slot->tokens >= 1.0) {
+			slot->tokens -= 1.0;
+		} else {
+			admit_stats.rejected_rate++;
+			ret = 0;
+			if (++slot->strikes >= info.connect_burst && info.connect_ban_time > 0) {
+				slot->banned_until = stime + info.connect_ban_time;
+				slot->strikes = 0;
+				admit_stats.bans++;
+				makeasciihost (&in, host);
+				write_log (LOG_DEFAULT, "Banning %s for %d seconds, too many connects", host, info.connect_ban_time);
+			}
+		}
+	}
+
+	if (ret) {
+		slot->open++;
+		*counted = 1;
+	}
+
+	internal_unlock_mutex (&admit_mutex);
+
+	return ret;
+}
+
+/* A connection admitted from addr is gone */
+void
+admit_release (struct in_addr in)
+{
+	admit_slot_t *slot;
+
+	internal_lock_mutex (&admit_mutex);
+
+	slot = admit_find (in.s_addr, 0, 0, 0);
+	if (slot && slot->open > 0)
+		slot->open--;
+
+	internal_unlock_mutex (&admit_mutex);
+}
+
+/* Count a connection from addr that was admitted by another process. Returns 1 if counted */
+int
+admit_adopt (struct in_addr in)
+{
+	admit_slot_t *slot;
+
+	if (info.max_connections_per_ip <= 0 && info.connect_rate <= 0)
+		return 0;
+
+	internal_lock_mutex (&admit_mutex);
+
+	slot = admit_find (in.s_addr, 1, get_mono_usec (), get_time ());
+	if (slot)
+		slot->open++;
+
+	internal_unlock_mutex (&admit_mutex);
+
+	return slot != NULL;
+}
+
+void
+admit_get_stats (admit_stats_t *stats)
+{
+	internal_lock_mutex (&admit_mutex);
+	*stats = admit_stats;
+	internal_unlock_mutex (&admit_mutex);
+}
+
 /* pool.c. ajd *********************************************************************/
 
 /* Initialize the connection pool.
@@ -315,7 +855,11 @@ pool_shutdown ()
 {
 	xa_debug (1, "DEBUG: Closing the pool.");
 	pool_cleaner ();
+	/* Source threads may still be on their way out */
+	pool_lock_write ();
 	avl_destroy (pool, NULL);
+	pool = NULL;
+	pool_unlock_write ();
 	xa_debug (1, "DEBUG: Pool closed.");
 }
 
@@ -371,7 +915,7 @@ pool_get_my_clients (const source_t *source)
 	pool_lock_write ();
 	
 	/* Search for clients for this source */
-	while ((clicon = avl_traverse (pool, &trav)))
+	while (pool && (clicon = avl_traverse (pool, &trav)))
 		if (clicon->food.client->source == source)
 			break;
 	
@@ -609,4 +1153,241 @@ forward (const char *name, char *target)
 	return target;
 }
 
+/*
+ * Async resolver. Answers, failures included, are kept in a cache for
+ * dns_cache_ttl (dns_negative_ttl) seconds. A lookup that misses it is
+ * queued for the resolver thread and the caller goes on without an answer,
+ * a later lookup finds it. Pending entries are never evicted.
+ */
+#define RESOLV_BUCKETS 256
+
+typedef struct resolv_entry_St
+{
+	char *key;			/* Address for reverse, name for forward lookups */
+	int forward;
+	char *answer;			/* NULL if the lookup failed */
+	time_t expires;			/* 0 while queued */
+	struct resolv_entry_St *next;	/* In the bucket */
+	struct resolv_entry_St *older, *newer;	/* Age list, oldest is evicted first */
+	struct resolv_entry_St *queue_next;
+} resolv_entry_t;
+
+static mutex_t resolv_mutex;		/* Leaf lock */
+static thread_cond_t resolv_cond;
+static resolv_entry_t *resolv_table[RESOLV_BUCKETS];
+static resolv_entry_t *resolv_oldest = NULL, *resolv_newest = NULL;
+static resolv_entry_t *resolv_queue = NULL, *resolv_queue_tail = NULL;
+static int resolv_entries = 0;
+static int resolv_running = 0;
+
+static unsigned int
+resolv_hash (const char *key, int fwd)
+{
+	unsigned int h = fwd;
+
+	while (*key)
+		h = h * 31 + (unsigned char) tolower ((int) *key++);
+	return h % RESOLV_BUCKETS;
+}
+
+static void
+resolv_unlink_age (resolv_entry_t *e)
+{
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		resolv_oldest = e->newer;
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		resolv_newest = e->older;
+	e->older = e->newer = NULL;
+}
+
+static void
+resolv_link_age (resolv_entry_t *e)
+{
+	e->older = resolv_newest;
+	e->newer = NULL;
+	if (resolv_newest)
+		resolv_newest->newer = e;
+	else
+		resolv_oldest = e;
+	resolv_newest = e;
+}
+
+static void
+resolv_enqueue (resolv_entry_t *e)
+{
+	e->expires = 0;
+	e->queue_next = NULL;
+	if (resolv_queue_tail)
+		resolv_queue_tail->queue_next = e;
+	else
+		resolv_queue = e;
+	resolv_queue_tail = e;
+	thread_cond_broadcast (&resolv_cond);
+}
+
+/* Make room for one more entry, must have resolv_mutex */
+static int
+resolv_evict ()
+{
+	resolv_entry_t *e, **pe;
+
+	for (e = resolv_oldest; e && e->expires == 0; e = e->newer)
+		;
+	if (!e)
+		return 0;
+
+	for (pe = &resolv_table[resolv_hash (e->key, e->forward)]; *pe != e; pe = &(*pe)->next)
+		;
+	*pe = e->next;
+
+	resolv_unlink_age (e);
+	resolv_entries--;
+
+	nfree (e->key);
+	if (e->answer) {
+		nfree (e->answer);
+	}
+	nfree (e);
+	return 1;
+}
+
+/*
+ * Look key up in the cache. Returns 1 with the answer in buf, or 0 if
+ * the lookup failed or isn't answered yet, in which case it is queued.
+ */
+int
+resolv_cached (const char *key, int fwd, char *buf, int len)
+{
+	resolv_entry_t *e;
+	unsigned int h;
+	int ret = 0;
+
+	if (!key || !key[0] || !ice_atomic_load (&resolv_running))
+		return 0;
+
+	h = resolv_hash (key, fwd);
+
+	internal_lock_mutex (&resolv_mutex);
+
+	for (e = resolv_table[h]; e; e = e->next)
+		if (e->forward == fwd && ice_strcasecmp (e->key, key) == 0)
+			break;
+
+	if (e) {
+		if (e->expires != 0 && e->expires < get_time ()) {
+			if (e->answer) {
+				nfree (e->answer);
+			}
+			resolv_enqueue (e);
+		} else if (e->answer) {
+			strncpy (buf, e->answer, len - 1);
+			buf[len - 1] = '\0';
+			ret = 1;
+		}
+	} else if (resolv_entries < info.dns_cache_size || resolv_evict ()) {
+		e = (resolv_entry_t *) nmalloc (sizeof (resolv_entry_t));
+		e->key = nstrdup (key);
+		e->forward = fwd;
+		e->answer = NULL;
+		e->next = resolv_table[h];
+		resolv_table[h] = e;
+		resolv_link_age (e);
+		resolv_entries++;
+		resolv_enqueue (e);
+	} else {
+		xa_debug (2, "DEBUG: Resolver cache full of pending lookups, not resolving %s", key);
+	}
+
+	internal_unlock_mutex (&resolv_mutex);
+
+	return ret;
+}
+
+/* Fill in con->hostname once the resolver has an answer */
+void
+resolv_hostname (connection_t *con)
+{
+	char buf[BUFSIZE], *name, *none = NULL;
+
+	if (con->hostname || !con->host || !info.reverse_lookups)
+		return;
+
+	if (!resolv_cached (con->host, 0, buf, BUFSIZE))
+		return;
+
+	name = nstrdup (buf);
+	if (!ice_atomic_cas (&con->hostname, &none, name)) {
+		nfree (name);
+	}
+}
+
+void *
+resolv_thread (void *arg)
+{
+	mythread_t *mt;
+	resolv_entry_t *e;
+	char buf[BUFSIZE], *key = NULL, *answer;
+	int fwd = 0;
+
+	thread_init ();
+
+	mt = thread_get_mythread ();
+
+	while (thread_alive (mt) && running == SERVER_RUNNING) {
+		internal_lock_mutex (&resolv_mutex);
+		if (!resolv_queue)
+			thread_cond_timedwait (&resolv_cond, &resolv_mutex, 1000);
+		e = resolv_queue;
+		if (e) {
+			resolv_queue = e->queue_next;
+			if (!resolv_queue)
+				resolv_queue_tail = NULL;
+			key = nstrdup (e->key);
+			fwd = e->forward;
+		}
+		internal_unlock_mutex (&resolv_mutex);
 
+		if (mt->ping == 1)
+			mt->ping = 0;
+
+		if (!e)
+			continue;
+
+		/* Queued entries stay put, so e is still there afterwards */
+		if (fwd)
+			answer = forward (key, buf) ? nstrdup (buf) : NULL;
+		else
+			answer = reverse (key);
+
+		xa_debug (2, "DEBUG: Resolved %s to %s", key, answer ? answer : "nothing");
+
+		internal_lock_mutex (&resolv_mutex);
+		e->answer = answer;
+		e->expires = get_time () + (answer ? info.dns_cache_ttl : info.dns_negative_ttl);
+		resolv_unlink_age (e);
+		resolv_link_age (e);
+		internal_unlock_mutex (&resolv_mutex);
+
+		nfree (key);
+	}
+
+	ice_atomic_store (&resolv_running, 0);
+
+	thread_exit (0);
+	return NULL;
+}
+
+void
+resolv_start ()
+{
+	thread_create_mutex (&resolv_mutex);
+	thread_cond_create (&resolv_cond);
+
+	ice_atomic_store (&resolv_running, 1);
+
+	thread_create ("Resolver Thread", resolv_thread, NULL);
+}
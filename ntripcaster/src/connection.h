@@ -42,12 +42,38 @@
 #define __ICECAST_CONNECTION_H
 
 void *handle_connection(void *data);
-connection_t *get_connection(int *sock);
+void login_queue (connection_t *con);
+void *login_thread (void *arg);
+void login_start_thread ();
+connection_t *get_connection(int *sock, int *tls_sock);
 connection_t *create_connection();
 const char *get_user_agent (connection_t *con);
 
 #endif
 
+/* admit.h. ajd **************************************************/
+
+#ifndef __ICECAST_ADMIT_H
+#define __ICECAST_ADMIT_H
+
+typedef struct admit_stats_St
+{
+	unsigned long int tracked;		/* Table slots ever used */
+	unsigned long int rejected_open;	/* max_connections_per_ip reached */
+	unsigned long int rejected_rate;	/* Over connect_rate */
+	unsigned long int rejected_banned;
+	unsigned long int bans;
+	unsigned long int table_full;		/* Let through for want of a slot */
+} admit_stats_t;
+
+void admit_init ();
+int admit_connection (struct in_addr in, int *counted);
+void admit_release (struct in_addr in);
+int admit_adopt (struct in_addr in);
+void admit_get_stats (admit_stats_t *stats);
+
+#endif
+
 /* pool.h. ajd **************************************************/
 
 #ifndef __ICECAST_POOL_H
@@ -84,6 +110,11 @@ void ice_clean_hostent();
 char *reverse (const char *hostname);
 char *forward (const char *name, char *buf);
 
+int resolv_cached (const char *key, int fwd, char *buf, int len);
+void resolv_hostname (connection_t *con);
+void *resolv_thread (void *arg);
+void resolv_start ();
+
 struct hostent *standard_gethostbyname(const char *hostname, struct hostent *res, char *buffer, int buflen, int *error);
 struct hostent *standard_gethostbyaddr(const char *host, int hostlen, struct hostent *he, char *buffer, int buflen, int *error);
 
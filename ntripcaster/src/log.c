@@ -66,6 +66,7 @@
 #define close _close
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #endif
 
@@ -74,6 +75,7 @@
 #include "avl.h"
 #include "threads.h"
 #include "ntripcaster.h"
+#define LOG_MODULE LOG_MOD_LOG
 #include "log.h"
 #include "sock.h"
 #include "utility.h"
@@ -82,6 +84,8 @@
 #include "main.h"
 #include "connection.h"
 #include "client.h"
+#include "source.h"
+#include "sessionlog.h"
 
 /* logtime.c. ajd **********************************************************/
 
@@ -99,6 +103,36 @@
 extern int errno, running;
 extern server_info_t info;
 
+/* The log pipeline. Every thread formats its lines into a ring of its own,
+ * and the log writer thread drains all rings with batched writev() calls.
+ * Before the log writer is started, and after it is gone, lines are written
+ * directly by the calling thread. */
+static log_ring_t *log_rings = NULL;		/* Rings in use, newest first */
+static log_ring_t *log_free_rings = NULL;	/* Drained rings of dead threads */
+static mutex_t log_ring_mutex = {MUTEX_STATE_UNINIT};
+static mutex_t log_drain_mutex = {MUTEX_STATE_UNINIT};
+static mutex_t log_wake_mutex = {MUTEX_STATE_UNINIT};
+static thread_cond_t log_wake_cond;		/* Wakes the idle writer */
+static int log_writer_running = 0;
+static int log_writer_idle = 0;			/* Writer waits on log_wake_cond */
+static unsigned long int log_dropped = 0;
+static THREAD_LOCAL log_ring_t *log_my_ring = NULL;
+
+/* xa_debug() gates, the higher of the console and logfile levels,
+ * unless the module has a level of its own. */
+int log_module_level[LOG_MOD_MAX];
+static int log_module_override[LOG_MOD_MAX];	/* -1 for none, set up by log_update_module_levels() */
+static const char *log_module_names[LOG_MOD_MAX] = { "misc", "main", "client", "source", "connection",
+						     "sock", "threads", "avl", "string", "utility",
+						     "log", "timer", "metrics" };
+
+#define log_level_for(module, level) (log_module_override[module] >= 0 ? log_module_override[module] : (level))
+#define log_gate_for(module) log_level_for (module, info.consoledebuglevel > info.logfiledebuglevel ? info.consoledebuglevel : info.logfiledebuglevel)
+
+/* Only touched by the thread draining the rings */
+static time_t log_stamp_time = -1;
+static char log_stamp_buf[64];
+static int log_stamp_len = 0;
 
 int
 get_log_fd (int whichlog)
@@ -109,124 +143,501 @@ get_log_fd (int whichlog)
 	return -1;
 }
 
-
-void 
-write_log (int whichlog, char *fmt, ...)
+/*
+ * Format "[time] " into buf, without the malloc() of get_log_time()
+ * Returns the length of the result.
+ */
+static int
+log_stamp (time_t tt, char *buf, int len)
 {
-	char buf[BUFSIZE];
-	va_list ap;
-	char *logtime;
-	mythread_t *mt = thread_check_created ();
-	int fd = get_log_fd (whichlog);
+	char timebuf[40] = "error";
+#ifdef HAVE_LOCALTIME_R
+	struct tm mt;
 
+	if (localtime_r (&tt, &mt) && strftime (timebuf, 40, REGULAR_TIME, &mt) == 0)
+		strcpy (timebuf, "error");
+#else
+	char *lt = get_string_time (tt, REGULAR_TIME);
 
-		va_start(ap, fmt);
-		vsnprintf(buf, BUFSIZE, fmt, ap);
-  
-		if (!mt)
-			fprintf (stderr, "WARNING: No mt while outputting [%s]", buf);
+	strncpy (timebuf, lt, 39);
+	free (lt);
+#endif
+	return snprintf (buf, len, "[%s] ", timebuf);
+}
+
+/*
+ * Write all of iov to fd, continuing after short writes.
+ */
+static void
+log_writev (int fd, struct iovec *iov, int count)
+{
+#ifndef _WIN32
+	ssize_t res;
 
-		logtime = get_log_time();
+	while (count > 0) {
+		res = writev (fd, iov, count);
 
-		if (strstr (buf, "%s") != NULL) {
-			fprintf (stderr, "WARNING, write_log () called with '%%s' formatted string [%s]!", buf);
-			free (logtime);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
 			return;
 		}
 
-		if (mt && fd != -1) {
-			if ((whichlog != LOG_DEFAULT) || (info.logfiledebuglevel > -1)) {
-				fd_write (fd, "[%s] [%d:%s] %s\n", logtime, mt->id, nullcheck_string (mt->name), buf);
-			}
+		while (count > 0 && res >= (ssize_t) iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			count--;
 		}
 
-		if (whichlog != LOG_DEFAULT)
-		{
-			free (logtime);
-			va_end (ap);
-			return;
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+#else
+	int i;
+
+	for (i = 0; i < count; i++)
+		write (fd, iov[i].iov_base, iov[i].iov_len);
+#endif
+}
+
+/*
+ * Write one log line right away, from the calling thread.
+ * text is newline terminated, the console gets it from offset conofs.
+ * Session records go to the session log only.
+ */
+static void
+log_write_direct (int dest, const char *text, int len, int conofs)
+{
+	char stamp[64];
+	struct iovec iov[3];
+
+	if (dest & LOG_DEST_SESSION) {
+		if (info.sessionlog != -1) {
+			iov[0].iov_base = (char *) text;
+			iov[0].iov_len = len;
+			log_writev (info.sessionlog, iov, 1);
 		}
+		return;
+	}
+
+	iov[0].iov_base = stamp;
+	iov[0].iov_len = log_stamp (get_time (), stamp, 64);
+
+	if ((dest & LOG_DEST_FILE) && info.logfile != -1) {
+		iov[1].iov_base = (char *) text;
+		iov[1].iov_len = len;
+		log_writev (info.logfile, iov, 2);
+	}
 
+	if (dest & LOG_DEST_CONSOLE) {
 		if (running == SERVER_RUNNING) {
-			printf("\r[%s] %s\n", logtime, buf);
-			fflush(stdout);
+			printf ("\r%s%s", stamp, text + conofs);
+			fflush (stdout);
 		} else
-			fprintf (stderr, "[%s] %s\n", logtime, buf);
+			fprintf (stderr, "%s%s", stamp, text + conofs);
+	}
+}
 
-		if (logtime)
-			free(logtime);
-		va_end (ap);
-	
+/*
+ * Find or set up the log ring of the calling thread.
+ * Returns NULL if there is no memory for it.
+ */
+static log_ring_t *
+log_get_my_ring ()
+{
+	log_ring_t *ring = log_my_ring;
+
+	if (ring)
+		return ring;
+
+	internal_lock_mutex (&log_ring_mutex);
+
+	if (log_free_rings) {
+		ring = log_free_rings;
+		log_free_rings = ring->next;
+	} else {
+		/* Not nmalloc(), DEBUG_MEMORY would log from in here */
+		ring = (log_ring_t *) malloc (sizeof (log_ring_t));
+	}
+
+	if (ring) {
+		ring->head = 0;
+		ring->tail = 0;
+		ring->dropped = 0;
+		ring->orphaned = 0;
+		ring->next = log_rings;
+		ice_atomic_store (&log_rings, ring);
+	}
+
+	internal_unlock_mutex (&log_ring_mutex);
+
+	log_my_ring = ring;
+	return ring;
 }
 
-void 
-log_no_thread (int whichlog, char *fmt, ...)
+/* Wake the writer, for a line queued while it is idle */
+static void
+log_wake_writer ()
 {
-	char buf[BUFSIZE];
-	va_list ap;
-	char *logtime;
-	int fd = get_log_fd (whichlog);
+	internal_lock_mutex (&log_wake_mutex);
+	thread_cond_broadcast (&log_wake_cond);
+	internal_unlock_mutex (&log_wake_mutex);
+}
 
+/*
+ * Hand a newline terminated line, or a session record, to the log writer.
+ * Never blocks, when the ring of this thread is full the line is dropped
+ * and counted instead. Session records are written right away then, they
+ * are what sessions get billed by.
+ */
+static void
+log_dispatch (int dest, const char *text, int len, int conofs)
+{
+	log_ring_t *ring;
+	log_record_t *rec;
+	unsigned int head;
 
-		va_start(ap, fmt);
-		vsnprintf(buf, BUFSIZE, fmt, ap);
-  
-		logtime = get_log_time();
+	if (!dest)
+		return;
 
-		if (strstr (buf, "%s") != NULL) {
-			fprintf (stderr, "WARNING, write_log () called with '%%s' formatted string [%s]!", buf);
-			logtime = get_log_time();
-			return;
-		}
+	if (!ice_atomic_load (&log_writer_running) || !(ring = log_get_my_ring ())) {
+		log_write_direct (dest, text, len, conofs);
+		return;
+	}
+
+	head = ring->head;
+
+	if (head - ice_atomic_load (&ring->tail) >= LOG_RING_SLOTS) {
+		if (dest & LOG_DEST_SESSION)
+			log_write_direct (dest, text, len, conofs);
+		else
+			ice_atomic_add (&ring->dropped, 1);
+		return;
+	}
+
+	rec = &ring->rec[head % LOG_RING_SLOTS];
+
+	memcpy (rec->text, text, len);
+	rec->len = len;
+	rec->conofs = conofs;
+	rec->dest = dest;
+	rec->stamp = get_time ();
 
-		if (fd != -1) {
-			if ((whichlog != LOG_DEFAULT) || (info.logfiledebuglevel > -1)) {
-				fd_write (fd, "[%s] %s\n", logtime, buf);
+	ice_atomic_store (&ring->head, head + 1);
+	ice_atomic_fence ();
+
+	/* The writer stopped while this was queued, its last drain may have missed it */
+	if (!ice_atomic_load (&log_writer_running))
+		log_drain_all ();
+	/* First line in an empty ring, the writer may be waiting for it */
+	else if (ice_atomic_load (&ring->tail) == head && ice_atomic_load (&log_writer_idle))
+		log_wake_writer ();
+}
+
+static void
+log_flush_batch (struct iovec *fiov, int nf, struct iovec *ciov, int nc, struct iovec *siov, int ns)
+{
+	if (nf > 0)
+		log_writev (info.logfile, fiov, nf);
+	if (nc > 0)
+		log_writev (1, ciov, nc);
+	if (ns > 0)
+		log_writev (info.sessionlog, siov, ns);
+}
+
+/*
+ * Write out everything queued in ring, in batches of LOG_BATCH lines.
+ * Returns the number of lines written. Must have log_drain_mutex.
+ */
+static int
+log_drain_ring (log_ring_t *ring)
+{
+	struct iovec fiov[LOG_BATCH * 2], ciov[LOG_BATCH * 3], siov[LOG_BATCH];
+	unsigned int tail = ring->tail, head = ice_atomic_load (&ring->head);
+	unsigned long int dropped;
+	log_record_t *rec;
+	int nf = 0, nc = 0, ns = 0, done = 0;
+
+	while (tail != head) {
+		rec = &ring->rec[tail % LOG_RING_SLOTS];
+
+		/* The cached stamp is shared by the whole batch */
+		if (rec->stamp != log_stamp_time || nc == LOG_BATCH * 3 || nf == LOG_BATCH * 2 || ns == LOG_BATCH) {
+			log_flush_batch (fiov, nf, ciov, nc, siov, ns);
+			nf = nc = ns = 0;
+			ice_atomic_store (&ring->tail, tail);
+
+			if (rec->stamp != log_stamp_time) {
+				log_stamp_len = log_stamp (rec->stamp, log_stamp_buf, 64);
+				log_stamp_time = rec->stamp;
 			}
 		}
 
-		if (whichlog != LOG_DEFAULT)
-		{
-			free (logtime);
-			va_end (ap);
-			return;
+		if ((rec->dest & LOG_DEST_SESSION) && info.sessionlog != -1) {
+			siov[ns].iov_base = rec->text;
+			siov[ns++].iov_len = rec->len;
 		}
 
-		if (running == SERVER_RUNNING) {
-			printf("\r[%s] %s\n", logtime, buf);
-			fflush(stdout);
-		} else
-			fprintf (stderr, "[%s] %s\n", logtime, buf);
+		if ((rec->dest & LOG_DEST_FILE) && info.logfile != -1) {
+			fiov[nf].iov_base = log_stamp_buf;
+			fiov[nf++].iov_len = log_stamp_len;
+			fiov[nf].iov_base = rec->text;
+			fiov[nf++].iov_len = rec->len;
+		}
+
+		if ((rec->dest & LOG_DEST_CONSOLE) && running == SERVER_RUNNING) {
+			ciov[nc].iov_base = "\r";
+			ciov[nc++].iov_len = 1;
+			ciov[nc].iov_base = log_stamp_buf;
+			ciov[nc++].iov_len = log_stamp_len;
+			ciov[nc].iov_base = rec->text + rec->conofs;
+			ciov[nc++].iov_len = rec->len - rec->conofs;
+		} else if (rec->dest & LOG_DEST_CONSOLE) {
+			/* Shutting down, like log_write_direct() */
+			fprintf (stderr, "%s%.*s", log_stamp_buf, rec->len - rec->conofs, rec->text + rec->conofs);
+		}
+
+		tail++;
+		done++;
+	}
+
+	log_flush_batch (fiov, nf, ciov, nc, siov, ns);
+	ice_atomic_store (&ring->tail, tail);
+
+	if ((dropped = ice_atomic_swap (&ring->dropped, 0)) > 0) {
+		char line[BUFSIZE];
+
+		ice_atomic_add (&log_dropped, dropped);
+		snprintf (line, BUFSIZE, "WARNING: Log pipeline full, dropped %lu lines (%lu in total)\n", dropped, log_dropped);
+		log_write_direct (LOG_DEST_FILE | LOG_DEST_CONSOLE, line, ice_strlen (line), 0);
+	}
+
+	return done;
+}
+
+/*
+ * Drain the rings of all threads, and recycle the rings of threads that
+ * have exited. Returns the number of lines written.
+ */
+int
+log_drain_all ()
+{
+	log_ring_t *ring, *next, **pp;
+	int done = 0;
+
+	if (log_drain_mutex.thread_id == MUTEX_STATE_UNINIT)
+		return 0;
+
+	internal_lock_mutex (&log_drain_mutex);
+
+	for (ring = ice_atomic_load (&log_rings); ring; ring = next) {
+		int orphaned = ice_atomic_load (&ring->orphaned);
+
+		next = ring->next;
+		done += log_drain_ring (ring);
+
+		if (orphaned && ring->tail == ice_atomic_load (&ring->head)) {
+			internal_lock_mutex (&log_ring_mutex);
+			for (pp = &log_rings; *pp != ring; pp = &(*pp)->next)
+				;
+			*pp = next;
+			ring->next = log_free_rings;
+			log_free_rings = ring;
+			internal_unlock_mutex (&log_ring_mutex);
+		}
+	}
+
+	internal_unlock_mutex (&log_drain_mutex);
+
+	return done;
+}
+
+/*
+ * Start the log writer thread. From here on log lines are queued.
+ */
+void
+log_writer_start ()
+{
+	thread_create_mutex (&log_ring_mutex);
+	thread_create_mutex (&log_drain_mutex);
+	thread_create_mutex (&log_wake_mutex);
+	thread_cond_create (&log_wake_cond);
+
+	ice_atomic_store (&log_writer_running, 1);
+
+	thread_create ("Log Writer Thread", log_writer_thread, NULL);
+}
+
+/*
+ * Wait until a thread queues a line into an empty ring, or the writer
+ * is stopped. The idle flag is up before the rings are checked a last
+ * time, so log_dispatch() either sees it or the line gets drained here.
+ */
+static void
+log_writer_wait ()
+{
+	internal_lock_mutex (&log_wake_mutex);
+
+	ice_atomic_store (&log_writer_idle, 1);
+	ice_atomic_fence ();
+
+	if (log_drain_all () == 0 && ice_atomic_load (&log_writer_running))
+		thread_cond_timedwait (&log_wake_cond, &log_wake_mutex, LOG_WRITER_WAIT);
+
+	ice_atomic_store (&log_writer_idle, 0);
+
+	internal_unlock_mutex (&log_wake_mutex);
+}
+
+void *
+log_writer_thread (void *arg)
+{
+	mythread_t *mt;
+
+	thread_init ();
+
+	mt = thread_get_mythread ();
+
+	while (thread_alive (mt) && ice_atomic_load (&log_writer_running)) {
+		if (log_drain_all () == 0)
+			log_writer_wait ();
+
+		if (mt->ping == 1)
+			mt->ping = 0;
+	}
+
+	log_writer_flush ();
+
+	thread_exit (0);
+	return NULL;
+}
 
-		if (logtime)
-			free(logtime);
-		va_end (ap);
+/*
+ * Stop queueing and write out everything still queued.
+ * Called on shutdown, before the log file is closed. Lines logged from
+ * here on are written directly, and a line queued just before is
+ * drained by whichever of us sees it last.
+ */
+void
+log_writer_flush ()
+{
+	ice_atomic_store (&log_writer_running, 0);
+	ice_atomic_fence ();
+	if (log_wake_mutex.thread_id != MUTEX_STATE_UNINIT)
+		log_wake_writer ();
+	log_drain_all ();
+}
 
+/* Lines dropped because a log ring was full */
+unsigned long int
+log_dropped_records ()
+{
+	return ice_atomic_load (&log_dropped);
+}
+
+/*
+ * The calling thread is exiting, let the log writer recycle its ring
+ * once it has been drained.
+ */
+void
+log_thread_release ()
+{
+	if (log_my_ring) {
+		ice_atomic_store (&log_my_ring->orphaned, 1);
+		log_my_ring = NULL;
+	}
 }
 
 void 
-xa_debug (int level, char *fmt, ...)
+write_log (int whichlog, char *fmt, ...)
 {
-	char buf[BUFSIZE];
+	char buf[BUFSIZE], line[LOG_RECORD_LEN];
 	va_list ap;
-	char *logtime = NULL;
 	mythread_t *mt = thread_check_created ();
-#ifdef OPTIMIZE
-	return;
-#endif
+	int dest = 0, ofs, len;
+
 	va_start(ap, fmt);
 	vsnprintf(buf, BUFSIZE, fmt, ap);
+	va_end (ap);
 
 	if (!mt)
 		fprintf (stderr, "WARNING: No mt while outputting [%s]", buf);
-  
-	logtime = get_log_time();
 
-	if (!mt) 
+	if (strstr (buf, "%s") != NULL) {
+		fprintf (stderr, "WARNING, write_log () called with '%%s' formatted string [%s]!", buf);
+		return;
+	}
+
+	if (mt && get_log_fd (whichlog) != -1 && ((whichlog != LOG_DEFAULT) || (info.logfiledebuglevel > -1)))
+		dest |= LOG_DEST_FILE;
+
+	if (whichlog == LOG_DEFAULT)
+		dest |= LOG_DEST_CONSOLE;
+
+	ofs = snprintf (line, LOG_RECORD_LEN, "[%ld:%s] ", mt ? mt->id : -1, mt ? nullcheck_string (mt->name) : "");
+	len = log_terminate_line (line, ofs + snprintf (line + ofs, LOG_RECORD_LEN - ofs, "%s\n", buf));
+
+	log_dispatch (dest, line, len, ofs);
+}
+
+void 
+log_no_thread (int whichlog, char *fmt, ...)
+{
+	char buf[BUFSIZE], line[LOG_RECORD_LEN];
+	va_list ap;
+	int dest = 0, len;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, BUFSIZE, fmt, ap);
+	va_end (ap);
+
+	if (strstr (buf, "%s") != NULL) {
+		fprintf (stderr, "WARNING, write_log () called with '%%s' formatted string [%s]!", buf);
 		return;
+	}
+
+	if (get_log_fd (whichlog) != -1 && ((whichlog != LOG_DEFAULT) || (info.logfiledebuglevel > -1)))
+		dest |= LOG_DEST_FILE;
+
+	if (whichlog == LOG_DEFAULT)
+		dest |= LOG_DEST_CONSOLE;
+
+	len = log_terminate_line (line, snprintf (line, LOG_RECORD_LEN, "%s\n", buf));
+
+	log_dispatch (dest, line, len, 0);
+}
+
+void 
+xa_debug_c (int module, int level, char *fmt, ...)
+{
+	char buf[BUFSIZE], line[LOG_RECORD_LEN];
+	va_list ap;
+	mythread_t *mt;
+	int dest = 0, len;
+
+	/* The xa_debug() macro only checked the higher of the two levels */
+	if (log_level_for (module, info.logfiledebuglevel) >= level && info.logfile != -1)
+		dest |= LOG_DEST_FILE;
+
+	if (log_level_for (module, info.consoledebuglevel) >= level)
+		dest |= LOG_DEST_CONSOLE;
+
+	if (!dest)
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, BUFSIZE, fmt, ap);
+	va_end (ap);
+
+	if (!(mt = thread_check_created ())) {
+		fprintf (stderr, "WARNING: No mt while outputting [%s]", buf);
+		return;
+	}
 
 #ifdef DEBUG_FULL
-	fprintf (stderr, "\r[%s] [%ld:%s] %s\n", logtime, mt->id, nullcheck_string (mt->name), buf);
+	fprintf (stderr, "\r[%ld:%s] %s\n", mt->id, nullcheck_string (mt->name), buf);
 #endif
 
 	if (strstr (buf, "%s") != NULL) {
@@ -234,30 +645,187 @@ xa_debug (int level, char *fmt, ...)
 		return;
 	}
 
+	len = log_terminate_line (line, snprintf (line, LOG_RECORD_LEN, "[%ld:%s] %s\n", mt->id, nullcheck_string (mt->name), buf));
+
+	log_dispatch (dest, line, len, 0);
+}
+
+/*
+ * Recompute the xa_debug() gates from the console and logfile debug
+ * levels and the "debug_modules" setting, i.e "sock:4,source:3".
+ * Called after the config file has been (re)read.
+ */
+void
+log_update_module_levels ()
+{
+	char *modules, *name, *next;
+	int i;
+
+	for (i = 0; i < LOG_MOD_MAX; i++)
+		log_module_override[i] = -1;
+
+	if (info.debug_modules) {
+		modules = nstrdup (info.debug_modules);
+
+		for (name = strtok_r (modules, ", ", &next); name; name = strtok_r (NULL, ", ", &next)) {
+			char *level = strchr (name, ':');
+
+			if (!level) {
+				write_log (LOG_DEFAULT, "WARNING: No debug level given for module %s", name);
+				continue;
+			}
+
+			*level++ = '\0';
+
+			if (log_set_module_level (name, atoi (level)) < 0)
+				write_log (LOG_DEFAULT, "WARNING: Unknown debug module %s", name);
+		}
+
+		nfree (modules);
+	}
+
+	for (i = 0; i < LOG_MOD_MAX; i++)
+		log_module_level[i] = log_gate_for (i);
+}
 
-	if (info.logfiledebuglevel >= level)
-		if (info.logfile != -1) {
-			fd_write (info.logfile, "[%s] [%ld:%s] %s\n", logtime, mt->id, nullcheck_string (mt->name), buf);
+/*
+ * Set the debug level of one module (or "all") at runtime.
+ * Returns -1 for unknown modules.
+ */
+int
+log_set_module_level (const char *name, int level)
+{
+	int i, found = -1;
+
+	for (i = 0; i < LOG_MOD_MAX; i++) {
+		if (ice_strcmp (name, "all") == 0 || ice_strcmp (name, log_module_names[i]) == 0) {
+			log_module_override[i] = level;
+			log_module_level[i] = log_gate_for (i);
+			found = 0;
 		}
+	}
 
-	if (info.consoledebuglevel >= level) {
-			printf("\r[%s] [%ld:%s] %s\n", logtime, mt->id, nullcheck_string (mt->name), buf);
-			fflush(stdout);
+	return found;
+}
+
+/*
+ * Make sure a line truncated by snprintf() still ends with a newline
+ * Returns the length of the line.
+ */
+int
+log_terminate_line (char *line, int len)
+{
+	if (len >= LOG_RECORD_LEN) {
+		line[LOG_RECORD_LEN - 2] = '\n';
+		return LOG_RECORD_LEN - 1;
 	}
-	
-	if (!(running == SERVER_RUNNING)) {
-		if (info.consoledebuglevel >= level)
-			fprintf (stderr, "[%s] %s\n", logtime, buf);
+
+	return len;
+}
+
+/*
+ * Map a kick reason string to its kick_reason_t, KICK_OTHER if unknown
+ */
+int
+kick_reason_code (const char *reason)
+{
+	int i;
+
+	if (!reason)
+		return KICK_OTHER;
+
+	for (i = 1; i < KICK_MAX; i++)
+		if (ice_strcmp (reason, kick_reason_names[i]) == 0)
+			return i;
+
+	return KICK_OTHER;
+}
+
+const char *
+kick_reason_name (int code)
+{
+	if (code < 0 || code >= KICK_MAX)
+		code = KICK_OTHER;
+
+	return kick_reason_names[code];
+}
+
+/*
+ * Queue a binary session record for con, which is being kicked for reason.
+ * connected is 0 for logins that never made it.
+ */
+void
+session_log (connection_t *con, const char *reason, int connected)
+{
+	session_record_t rec;
+
+	if (info.sessionlog == -1 || !con)
+		return;
+
+	memset (&rec, 0, sizeof (rec));
+
+	rec.id = con->id;
+	rec.start = con->connect_time;
+	rec.end = get_time ();
+	rec.reason = kick_reason_code (reason);
+	rec.connected = connected;
+
+	/* The new process goes on with the same session, it logs it when it ends */
+	if (rec.reason == KICK_HANDED_OVER)
+		return;
+
+	if (con->sin) {
+		rec.addr = con->sin->sin_addr.s_addr;
+		rec.port = ntohs (con->sin->sin_port);
 	}
-	
-	if (logtime)
-		free(logtime);
-	va_end (ap);
+
+	if (con->user)
+		strncpy (rec.user, con->user, SESSION_USER_LEN - 1);
+
+	if (con->type == client_e && con->food.client) {
+		rec.type = SESSION_CLIENT;
+		rec.role = con->food.client->type;
+		rec.bytes = con->food.client->write_bytes;
+		if (con->food.client->source && con->food.client->source->audiocast.mount)
+			strncpy (rec.mount, con->food.client->source->audiocast.mount, SESSION_MOUNT_LEN - 1);
+	} else if (con->type == source_e && con->food.source) {
+		rec.type = SESSION_SOURCE;
+		rec.role = con->food.source->type;
+		rec.bytes = (uint64_t) con->food.source->stats.read_kilos * 1024 + con->food.source->stats.read_bytes;
+		if (con->food.source->audiocast.mount)
+			strncpy (rec.mount, con->food.source->audiocast.mount, SESSION_MOUNT_LEN - 1);
+	} else
+		rec.type = SESSION_OTHER;
+
+	log_dispatch (LOG_DEST_SESSION, (char *) &rec, sizeof (rec), 0);
 }
 
 void open_log_files()
 {
 	info.logfile = open_log_file(info.logfilename, info.logfile);
+	info.sessionlog = open_session_log(info.sessionlogfilename, info.sessionlog);
+}
+
+/*
+ * Open the binary session log, and give it a header if it is new
+ */
+int open_session_log (char *name, int oldfd)
+{
+	session_log_header_t header;
+	int outfd = open_log_file (name, oldfd);
+
+	if (outfd == -1 || lseek (outfd, 0, SEEK_END) != 0)
+		return outfd;
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, SESSION_LOG_MAGIC, 8);
+	header.byteorder = SESSION_LOG_BYTEORDER;
+	header.record_size = sizeof (session_record_t);
+
+	if (write (outfd, &header, sizeof (header)) != sizeof (header))
+		write_log (LOG_DEFAULT, "WARNING: Could not write session log header, %s", strerror (errno));
+
+	return outfd;
 }
 
 int open_log_file(char *name, int oldfd)
@@ -388,6 +956,18 @@ long get_time()
 	return time(NULL);
 }
 
+/* Microseconds on the monotonic clock, for measuring intervals */
+long long get_mono_usec()
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+		return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	return (long long) time (NULL) * 1000000;
+}
+
 char *get_log_time()
 {
 	return get_string_time(get_time(), REGULAR_TIME);
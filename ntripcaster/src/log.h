@@ -41,8 +41,65 @@
 #ifndef __ICECAST_LOG_H
 #define __ICECAST_LOG_H
 
+/* Log pipeline, see log.c */
+#define LOG_DEST_FILE 1
+#define LOG_DEST_CONSOLE 2
+#define LOG_DEST_SESSION 4		/* Binary session records, see sessionlog.h */
+#define LOG_RING_SLOTS 64		/* Queued lines per thread */
+#define LOG_RECORD_LEN (BUFSIZE + 128)	/* Room for message and "[id:thread] " */
+#define LOG_BATCH 32			/* Lines per writev() */
+#define LOG_WRITER_WAIT 1000		/* msecs an idle writer waits unless woken */
+
+typedef struct log_record_St
+{
+	time_t stamp;
+	int dest;
+	int conofs;	/* Console output starts here */
+	int len;
+	char text[LOG_RECORD_LEN];
+} log_record_t;
+
+typedef struct log_ring_St
+{
+	unsigned int head;		/* Written by the owning thread only */
+	unsigned int tail;		/* Written by the log writer only */
+	unsigned long int dropped;
+	int orphaned;			/* Owner has exited */
+	struct log_ring_St *next;
+	log_record_t rec[LOG_RING_SLOTS];
+} log_ring_t;
+
+/* Debug output. xa_debug() checks the level before any of its arguments
+ * are evaluated. Levels above XA_DEBUG_FLOOR are compiled out, and the
+ * runtime level is kept per module (LOG_MODULE, defined by each file). */
+typedef enum { LOG_MOD_MISC = 0, LOG_MOD_MAIN, LOG_MOD_CLIENT, LOG_MOD_SOURCE, LOG_MOD_CONNECTION,
+	       LOG_MOD_SOCK, LOG_MOD_THREADS, LOG_MOD_AVL, LOG_MOD_STRING, LOG_MOD_UTILITY,
+	       LOG_MOD_LOG, LOG_MOD_TIMER, LOG_MOD_METRICS, LOG_MOD_MAX } log_module_t;
+
+#ifndef XA_DEBUG_FLOOR
+# ifdef OPTIMIZE
+#  define XA_DEBUG_FLOOR 0
+# else
+#  define XA_DEBUG_FLOOR 5
+# endif
+#endif
+
+#ifndef LOG_MODULE
+# define LOG_MODULE LOG_MOD_MISC
+#endif
+
+extern int log_module_level[LOG_MOD_MAX];
+
+#define xa_debug(level, ...) \
+	do { \
+		if ((level) <= XA_DEBUG_FLOOR && (level) <= log_module_level[LOG_MODULE]) \
+			xa_debug_c (LOG_MODULE, level, __VA_ARGS__); \
+	} while (0)
+
 void write_log(int whichlog, char *fmt, ...);
-void xa_debug (int level, char *fmt, ...);
+void xa_debug_c (int module, int level, char *fmt, ...);
+void log_update_module_levels ();
+int log_set_module_level (const char *name, int level);
 void my_perror(char *where);
 void stats_write(server_info_t *info);
 void clear_logfile(char *logfilename) ;
@@ -55,6 +112,17 @@ void stats_write_html (server_info_t *info);
 int get_log_fd (int whichlog);
 void write_log_not_me (int whichlog, connection_t *nothim, char *fmt, ...);
 void log_no_thread (int whichlog, char *fmt, ...);
+int log_terminate_line (char *line, int len);
+int open_session_log (char *name, int oldfd);
+void session_log (connection_t *con, const char *reason, int connected);
+int kick_reason_code (const char *reason);
+const char *kick_reason_name (int code);
+void log_writer_start ();
+void *log_writer_thread (void *arg);
+void log_writer_flush ();
+int log_drain_all ();
+unsigned long int log_dropped_records ();
+void log_thread_release ();
 #endif
 
 /* logtime.h. ajd ***************************************************/
@@ -66,6 +134,7 @@ void log_no_thread (int whichlog, char *fmt, ...);
 #define REGULAR_TIME "%d/%b/%Y:%H:%M:%S"
 
 long get_time();
+long long get_mono_usec();
 char *get_log_time();
 char *get_string_time (time_t tt, char *format);
 char *get_date();
@@ -71,6 +71,7 @@
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
 # ifdef TIME_WITH_SYS_TIME
 #  include <sys/time.h>
 # endif
@@ -82,10 +83,15 @@
 #include <sys/resource.h>
 #endif
 
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
 #include "avl.h"
 #include "threads.h"
 #include "ntripcaster.h"
 #include "sock.h"
+#define LOG_MODULE LOG_MOD_MAIN
 #include "log.h"
 #include "main.h"
 #include "utility.h"
@@ -94,6 +100,7 @@
 #include "client.h"
 #include "connection.h"
 #include "timer.h"
+#include "metrics.h"
 
 #ifndef _WIN32
 #include <signal.h>
@@ -116,6 +123,7 @@ extern mutex_t sock_mutex;
 /* global */
 server_info_t info;
 struct in_addr localaddr;
+static int lock_profile_dump = 0;	/* Set by SIGUSR1 */
 
 
 int 
@@ -136,6 +144,9 @@ main (int argc, char **argv)
 	/* Set all server variables to a default value */
 	setup_defaults ();
 
+	/* Keep the command line for a hot upgrade */
+	upgrade_init (argv);
+
 	/* Trap some signals */
 	setup_signal_traps ();
 
@@ -246,6 +257,8 @@ setup_signal_traps()
 # endif
 	
 	signal(SIGHUP, sig_hup);
+	signal(SIGUSR1, sig_usr1);
+	signal(SIGUSR2, sig_usr2);
 	signal(SIGINT, sig_die);
 	signal(SIGTERM, sig_die);
 	signal(SIGCHLD, sig_child);
@@ -263,6 +276,8 @@ setup_defaults()
 
 	info.consoledebuglevel = 0;
 	info.logfiledebuglevel = 0;
+	info.debug_modules = NULL;
+	log_update_module_levels ();
 	info.console_mode = DEFAULT_CONSOLE_MODE;
 
 #ifdef HAVE_UMASK
@@ -274,12 +289,15 @@ setup_defaults()
 #endif
 
 	/* Create the data locking mutexes */
-	thread_create_mutex(&info.double_mutex);
 	thread_create_mutex(&info.source_mutex);
 	thread_create_mutex(&info.misc_mutex);
 	thread_create_mutex(&info.mount_mutex);
 	thread_create_mutex(&info.hostname_mutex);
 	thread_create_mutex(&info.resolvmutex);
+	slab_init ();
+	metrics_init ();
+	timer_init ();
+	pending_init ();
 
 #ifdef DEBUG_SOCKETS
 	thread_create_mutex(&sock_mutex);
@@ -295,10 +313,23 @@ setup_defaults()
 
 	/* Default value for hostname reverse lookups */
 	info.reverse_lookups = DEFAULT_LOOKUPS;
+	info.dns_cache_size = DEFAULT_DNS_CACHE_SIZE;
+	info.dns_cache_ttl = DEFAULT_DNS_CACHE_TTL;
+	info.dns_negative_ttl = DEFAULT_DNS_NEGATIVE_TTL;
+	info.max_connections_per_ip = 0;
+	info.connect_rate = 0;
+	info.connect_burst = DEFAULT_CONNECT_BURST;
+	info.connect_ban_time = DEFAULT_CONNECT_BAN_TIME;
+	info.workers = DEFAULT_WORKERS;
+	info.worker_id = 0;
+	info.replication_password = NULL;
+	info.replicate_from = NULL;
+	info.replicate_password = NULL;
+	info.replicate_mounts = NULL;
+	info.io_uring = DEFAULT_IO_URING;
 
 	/* Statistics */
 	zero_stats(&info.daily_stats);
-	zero_stats(&info.hourly_stats);
 	zero_stats(&info.total_stats);
 
 	info.server_start_time = get_time();
@@ -311,12 +342,28 @@ setup_defaults()
 	for (i = 1; i < MAXLISTEN; i++) {
 		info.port[i] = 0;
 	}
+	for (i = 0; i < MAXLISTEN; i++) {
+		info.tls_port[i] = 0;
+		info.tls_listen_sock[i] = INVALID_SOCKET;
+	}
+	info.tls_certificate = NULL;
+	info.tls_key = NULL;
+	info.tls_ciphers = NULL;
+	info.tls_ktls = DEFAULT_TLS_KTLS;
 
 	/* Variables that affect clients */
 	info.num_clients = 0;
 	info.max_clients = DEFAULT_MAX_CLIENTS;
 	info.max_clients_per_source = DEFAULT_MAX_CLIENTS_PER_SOURCE;
 	info.client_timeout = DEFAULT_CLIENT_TIMEOUT;
+	info.login_timeout = DEFAULT_LOGIN_TIMEOUT;
+	info.client_idle_timeout = DEFAULT_CLIENT_IDLE_TIMEOUT;
+	info.client_dead_timeout = DEFAULT_CLIENT_DEAD_TIMEOUT;
+
+	/* After client_dead_timeout, the client policy depends on it */
+	for (i = 0; i < SOCK_ROLE_MAX; i++)
+		info.socket_policy[i] = NULL;
+	sock_update_policies ();
 	info.client_pass = nstrdup(DEFAULT_CLIENT_PASSWORD);
 
 	/* Variables that affect sources */
@@ -353,6 +400,11 @@ setup_defaults()
 	info.configfile = nstrdup(DEFAULT_CONFIG_FILE);
 	info.logfilename = nstrdup(DEFAULT_LOGFILE);
 	info.logfile = -1;
+	info.sessionlogfilename = NULL;
+	info.sessionlog = -1;
+	info.metrics = 0;
+	info.metrics_interval = DEFAULT_METRICS_INTERVAL;
+	info.lock_profile = 0;
 
 	/* Server meta info */
 	info.location = nstrdup(DEFAULT_LOCATION);
@@ -377,6 +429,7 @@ allocate_resources()
 #endif
 	
 	pool_init ();
+	admit_init ();
 
 	if (!info.sources || !info.threads || !info.my_hostnames) {
 		fprintf(stderr, "Cannot allocate tree resources, exiting");
@@ -402,12 +455,15 @@ clean_shutdown (server_info_t *info)
 	thread_library_unlock ();
 	
 	write_log(LOG_DEFAULT, "Cleanly shutting down...");
+	signal_workers (SIGTERM);
 	write_log(LOG_DEFAULT, "Closing all listening sockets...");
 
 	for (i = 0; i < MAXLISTEN; i++) 
 	{
 		if (sock_valid (info->listen_sock[i]))
 			sock_close(info->listen_sock[i]);
+		if (sock_valid (info->tls_listen_sock[i]))
+			sock_close(info->tls_listen_sock[i]);
 	}
 	
 	pool_shutdown ();
@@ -436,8 +492,11 @@ clean_shutdown (server_info_t *info)
 #endif
 
 	write_log(LOG_DEFAULT, "Exiting..");
+	log_writer_flush ();
 	if (info->logfile != -1)
 		fd_close(info->logfile);
+	if (info->sessionlog != -1)
+		fd_close(info->sessionlog);
 	
 #ifdef DEBUG_MEMORY
 	{
@@ -465,28 +524,53 @@ threaded_server_proc (void *infoarg)
 
 	write_log(LOG_DEFAULT, "Starting main connection handler...");
   
+	/* Fork the workers, they set up their own listeners */
+	start_workers ();
+
 	/* Setup listeners */
 	setup_listeners();
 
 	/* Just print some runtime server info */
 	print_startup_server_info();
 
+	/* From here on log lines are written by a thread of their own */
+	log_writer_start ();
+
+	write_log (LOG_DEFAULT, "Starting Resolver Thread...");
+	resolv_start ();
+
+	/* Before the login thread, a REPLICATE may come in right away */
+	replica_start ();
+
+	write_log (LOG_DEFAULT, "Starting Login Thread...");
+	login_start_thread ();
+
 	write_log (LOG_DEFAULT, "Starting Calender Thread...");
 	/* Fork another thread that handles time based actions */
 	thread_create("Calendar Thread", startup_timer_thread, NULL);
+
+	/* Tell the process we took over from, if any, that we are up */
+	upgrade_ready ();
 	
 	while (running == SERVER_RUNNING)
 	{
 		/* Try to get a new connection */
-		con = get_connection(info.listen_sock);
+		con = get_connection(info.listen_sock, info.tls_listen_sock);
 		
 		if (con) {
-			/* handle the new connection it in a new thread */
-			thread_create("Connection Handler", handle_connection, (void *)con);
+			/* It gets a thread of its own once its request is in */
+			login_queue (con);
 		}
 		
 		if (mt->ping == 1)
 			mt->ping = 0;
+
+		if (lock_profile_dump) {
+			lock_profile_dump = 0;
+			lockprof_dump ();
+		}
+
+		upgrade_poll ();
 	}
   
 	/* user pressed ^C */
@@ -526,10 +610,19 @@ sig_hup(int signo)
 	open_log_files();
 	
 	write_log(LOG_DEFAULT, "Caught SIGHUP, rehashed config and reopened logfiles...");
+	signal_workers (SIGHUP);
 	
 	signal(SIGHUP, sig_hup);
 }
 
+/* Dump the lock profile, from the main loop since it takes locks */
+RETSIGTYPE 
+sig_usr1(int signo)
+{
+	lock_profile_dump = 1;
+	signal(SIGUSR1, sig_usr1);
+}
+
 RETSIGTYPE 
 sig_die(int signo)
 {
@@ -551,13 +644,43 @@ sig_die_hard(int signo)
  * find out local ip if dynamic,
  * make sure the server name is resolvable 
  */
+static SOCKET
+setup_listener (int port)
+{
+	SOCKET sockfd = sock_get_server_socket(port);
+
+	if (sockfd == INVALID_SOCKET) 
+	{
+		write_log(LOG_DEFAULT, "ERROR: Could not listen to port %d. Perhaps another process is using it?", port);
+		clean_shutdown(&info);
+	}
+
+	/* Set the socket to nonblocking */
+	sock_set_blocking(sockfd, SOCK_NONBLOCK);
+
+	if (listen(sockfd, LISTEN_QUEUE) == SOCKET_ERROR) 
+	{
+		write_log(LOG_DEFAULT, "Could not listen for clients on port %d", port);
+		clean_shutdown(&info);
+	} 
+
+	return sockfd;
+}
+
+static void upgrade_take_listeners ();
+
 void 
 setup_listeners()
 {
-	int i;
+	int i, tls = -1;
 
-	for (i = 0; i < MAXLISTEN; i++)
+	for (i = 0; i < MAXLISTEN; i++) {
 		info.listen_sock[i] = INVALID_SOCKET;
+		info.tls_listen_sock[i] = INVALID_SOCKET;
+	}
+
+	/* Sockets of the process we take over from, if any */
+	upgrade_take_listeners ();
 
 	/* Create the socket, on the correct hostname or INADDR_ANY and bind it to the port. */
 	for (i = 0; i < MAXLISTEN; i++) 
@@ -567,22 +690,29 @@ setup_listeners()
 			continue;
 		}
 
-		info.listen_sock[i] = sock_get_server_socket(info.port[i]);
-  
-		if (info.listen_sock[i] == INVALID_SOCKET) 
-		{
-			write_log(LOG_DEFAULT, "ERROR: Could not listen to port %d. Perhaps another process is using it?", info.port[i]);
-			clean_shutdown(&info);
-		}
+		if (!sock_valid (info.listen_sock[i]))
+			info.listen_sock[i] = setup_listener (info.port[i]);
+	}
 
-		/* Set the socket to nonblocking */
-		sock_set_blocking(info.listen_sock[i], SOCK_NONBLOCK);
+	/* TLS ports are left closed if there's no certificate to offer */
+	for (i = 0; i < MAXLISTEN; i++) 
+	{
+		if (info.tls_port[i] <= 0)
+			continue;
 
-		if (listen(info.listen_sock[i], LISTEN_QUEUE) == SOCKET_ERROR) 
-		{
-			write_log(LOG_DEFAULT, "Could not listen for clients on port %d", info.port[i]);
-			clean_shutdown(&info);
-		} 
+		if (tls < 0)
+			tls = tls_init ();
+		if (!tls) {
+			write_log(LOG_DEFAULT, "ERROR: Not listening to TLS port %d", info.tls_port[i]);
+			if (sock_valid (info.tls_listen_sock[i])) {
+				sock_close (info.tls_listen_sock[i]);
+				info.tls_listen_sock[i] = INVALID_SOCKET;
+			}
+			continue;
+		}
+
+		if (!sock_valid (info.tls_listen_sock[i]))
+			info.tls_listen_sock[i] = setup_listener (info.tls_port[i]);
 	}
 	
 	if (ice_strcasecmp(info.server_name, "dynamic") == 0) 
@@ -609,3 +739,987 @@ setup_listeners()
 
 
 
+
+/* workers.c. ajd ***********************************************************************/
+
+/*
+ * With workers set above 1 the caster forks into that many processes
+ * before it opens its ports. Each one binds them with SO_REUSEPORT, so
+ * the kernel spreads the connections over the workers, and they share
+ * their mounts over the mount bus (see bus.c in source.c). The first
+ * process passes SIGHUP and its shutdown on to the others, a worker that
+ * dies isn't started again. Limits are per worker, each worker's metrics
+ * go on a shared board (see board.c in metrics.c).
+ */
+#ifndef _WIN32
+
+static pid_t *worker_pids = NULL;	/* Forked workers, in the first process only */
+static int worker_count = 0;
+
+void
+start_workers ()
+{
+	pid_t pid;
+	int i;
+
+	if (info.workers <= 1)
+		return;
+
+	if (!bus_init (info.workers * info.max_sources)) {
+		write_log (LOG_DEFAULT, "WARNING: No mount bus, running as one process");
+		info.workers = 1;
+		return;
+	}
+
+	/* Each scrape goes to one worker, it answers for all of them */
+	metrics_board_init (info.workers);
+
+	worker_pids = (pid_t *) nmalloc (info.workers * sizeof (pid_t));
+
+	for (i = 1; i < info.workers; i++) {
+		pid = fork ();
+
+		if (pid == 0) {
+#ifdef __linux__
+			prctl (PR_SET_PDEATHSIG, SIGTERM);
+#endif
+			nfree (worker_pids);
+			worker_pids = NULL;
+			worker_count = 0;
+			info.worker_id = i;
+			write_log (LOG_DEFAULT, "Worker %d running as process %d", i, (int) getpid ());
+			return;
+		}
+
+		if (pid < 0) {
+			write_log (LOG_DEFAULT, "ERROR: Could not fork worker %d: %s", i, strerror (errno));
+			break;
+		}
+
+		worker_pids[worker_count++] = pid;
+	}
+
+	write_log (LOG_DEFAULT, "Started %d workers, process %d is worker 0", worker_count, (int) getpid ());
+}
+
+/* Pass sig on to the workers, safe in signal handlers */
+void
+signal_workers (int sig)
+{
+	int i;
+
+	for (i = 0; i < worker_count; i++)
+		kill (worker_pids[i], sig);
+}
+
+#else
+
+void
+start_workers ()
+{
+}
+
+void
+signal_workers (int sig)
+{
+}
+
+#endif
+
+/* upgrade.c. ajd ***********************************************************************/
+
+/*
+ * Hot upgrade, started with kill -USR2. The caster runs its binary again
+ * with one end of a unix socket pair in NTRIPCASTER_UPGRADE, and passes
+ * its listening sockets over it (SCM_RIGHTS). The new process starts up on
+ * them, and when it says it's ready the old one stops accepting. Every
+ * encoder source then hands its socket, the chunks in its ring and its
+ * clients with their place in the ring over from its own thread, and the
+ * new process goes on streaming where the old one stopped. The old process
+ * exits when all of them are through. TLS connections, relays, sources
+ * waiting for a reconnect and connections still logging in can't be handed
+ * over, they go with the old process as on a restart. If the new process
+ * doesn't come up, the old one keeps running.
+ */
+#ifndef _WIN32
+
+#define UPGRADE_ENV "NTRIPCASTER_UPGRADE"
+#define UPGRADE_VERSION 1
+#define UPGRADE_START_TIMEOUT 30	/* Seconds the new process gets to get ready */
+#define UPGRADE_HANDOFF_TIMEOUT 5	/* Seconds the sources get to hand over */
+
+/* Records on the upgrade socket, each an upgrade_msg_t and len bytes */
+#define UPGRADE_HELLO 1		/* Old to new, upgrade_hello_t */
+#define UPGRADE_LISTENER 2	/* Old to new, upgrade_listener_t and its socket */
+#define UPGRADE_READY 3		/* New to old, upgrade_ready_t */
+#define UPGRADE_SOURCE 4	/* Old to new, upgrade_source_t, its chunks and socket */
+#define UPGRADE_CLIENT 5	/* Old to new, upgrade_client_t of the last source and its socket */
+#define UPGRADE_DONE 6		/* Old to new, no more sources */
+
+#define UPGRADE_IDLE 0
+#define UPGRADE_STARTING 1	/* Waiting for UPGRADE_READY */
+#define UPGRADE_HANDOFF 2	/* Sources are handing over */
+
+typedef struct upgrade_msg_St
+{
+	int type;
+	int len;
+} upgrade_msg_t;
+
+typedef struct upgrade_hello_St
+{
+	int version;
+	int layout;		/* Record sizes, streams only go to the same build */
+	unsigned long int next_id;
+	int listeners;
+} upgrade_hello_t;
+
+typedef struct upgrade_listener_St
+{
+	int port;
+	int tls;
+} upgrade_listener_t;
+
+typedef struct upgrade_ready_St
+{
+	int streams;		/* Takes the sources and clients as well */
+} upgrade_ready_t;
+
+typedef struct upgrade_con_St
+{
+	unsigned long int id;
+	time_t connect_time;
+	int has_sin;
+	struct sockaddr_in sin;
+	char user[BUFSIZE];
+	char request[BUFSIZE];	/* Request line and headers */
+} upgrade_con_t;
+
+typedef struct upgrade_source_St
+{
+	upgrade_con_t con;
+	char mount[BUFSIZE];
+	char agent[BUFSIZE];
+	int cid;
+	int len[CHUNKLEN];	/* The chunk data follows, len[i] bytes of each */
+	int metalen[CHUNKLEN];
+	int clients_left[CHUNKLEN];
+	statistics_t stats;
+} upgrade_source_t;
+
+typedef struct upgrade_client_St
+{
+	upgrade_con_t con;
+	client_type_t type;
+	int virgin;
+	int cid;
+	int offset;
+	int flags;
+	unsigned long int write_bytes;
+} upgrade_client_t;
+
+#define UPGRADE_CHUNK_MAX (SOURCE_BUFFSIZE + MAXMETADATALENGTH)
+#define UPGRADE_MSG_MAX ((int) sizeof (upgrade_source_t) + CHUNKLEN * UPGRADE_CHUNK_MAX)
+#define UPGRADE_LAYOUT ((int) (sizeof (upgrade_source_t) + sizeof (upgrade_client_t) + UPGRADE_CHUNK_MAX))
+
+static char **upgrade_argv = NULL;
+static volatile int upgrade_requested = 0;	/* Set by SIGUSR2 */
+static int upgrade_state = UPGRADE_IDLE;	/* Main thread only */
+static int upgrade_fd = -1;
+static pid_t upgrade_pid = -1;
+static long long upgrade_deadline, upgrade_started;
+static int upgrade_streams = 0;
+static long int upgrade_sources_left = 0;	/* Sources flagged that haven't handed over yet */
+static unsigned long int upgrade_sources = 0, upgrade_clients = 0;
+static mutex_t upgrade_mutex;		/* Leaf lock, one source on upgrade_fd at a time */
+
+void
+upgrade_init (char **argv)
+{
+	upgrade_argv = argv;
+	thread_create_mutex (&upgrade_mutex);
+}
+
+RETSIGTYPE 
+sig_usr2(int signo)
+{
+	upgrade_requested = 1;
+	signal(SIGUSR2, sig_usr2);
+}
+
+/* Send a record, with sock attached unless it's INVALID_SOCKET */
+static int
+upgrade_send (int type, SOCKET sock, const void *data, int len)
+{
+	upgrade_msg_t msg;
+	struct msghdr mh;
+	struct iovec iov[2];
+	char cbuf[CMSG_SPACE (sizeof (int))];
+	struct cmsghdr *cm;
+	int n, sent, total = sizeof (msg) + len;
+
+	msg.type = type;
+	msg.len = len;
+	iov[0].iov_base = &msg;
+	iov[0].iov_len = sizeof (msg);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+
+	memset (&mh, 0, sizeof (mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = len > 0 ? 2 : 1;
+
+	if (sock_valid (sock)) {
+		memset (cbuf, 0, sizeof (cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof (cbuf);
+		cm = CMSG_FIRSTHDR (&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN (sizeof (int));
+		memcpy (CMSG_DATA (cm), &sock, sizeof (int));
+	}
+
+	while ((sent = sendmsg (upgrade_fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	if (sent < 0) {
+		write_log (LOG_DEFAULT, "WARNING: Hot upgrade: sendmsg() failed: %s", strerror (errno));
+		return 0;
+	}
+
+	/* The rest of a big one goes without the socket */
+	while (sent < total) {
+		if (sent < (int) sizeof (msg))
+			n = send (upgrade_fd, (char *) &msg + sent, sizeof (msg) - sent, MSG_NOSIGNAL);
+		else
+			n = send (upgrade_fd, (const char *) data + (sent - sizeof (msg)), total - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		sent += n;
+	}
+
+	return 1;
+}
+
+/* Read a record of at most size bytes into buf. The socket that came
+   with it, if any, ends up in *sock. Returns 0 on errors and EOF. */
+static int
+upgrade_recv (upgrade_msg_t *msg, SOCKET *sock, char *buf, int size)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	char cbuf[CMSG_SPACE (sizeof (int))];
+	struct cmsghdr *cm;
+	int n, got;
+
+	*sock = INVALID_SOCKET;
+
+	iov.iov_base = msg;
+	iov.iov_len = sizeof (*msg);
+	memset (&mh, 0, sizeof (mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof (cbuf);
+
+	while ((n = recvmsg (upgrade_fd, &mh, MSG_WAITALL)) < 0 && errno == EINTR)
+		;
+
+	for (cm = CMSG_FIRSTHDR (&mh); n > 0 && cm; cm = CMSG_NXTHDR (&mh, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+			memcpy (sock, CMSG_DATA (cm), sizeof (int));
+
+	if (n != sizeof (*msg) || msg->len < 0 || msg->len > size)
+		goto fail;
+
+	for (got = 0; got < msg->len; got += n) {
+		n = recv (upgrade_fd, buf + got, msg->len - got, MSG_WAITALL);
+		if (n < 0 && errno == EINTR) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			goto fail;
+	}
+
+	return 1;
+
+ fail:
+	if (sock_valid (*sock))
+		sock_close (*sock);
+	*sock = INVALID_SOCKET;
+	return 0;
+}
+
+static void
+upgrade_close ()
+{
+	internal_lock_mutex (&upgrade_mutex);
+	if (upgrade_fd >= 0)
+		close (upgrade_fd);
+	upgrade_fd = -1;
+	internal_unlock_mutex (&upgrade_mutex);
+}
+
+/* The binary to run, argv[0] or where PATH finds it */
+static char *
+upgrade_find_binary (const char *name)
+{
+	char path[BUFSIZE];
+	const char *dir, *end, *env = getenv ("PATH");
+
+	if (strchr (name, '/'))
+		return nstrdup (name);
+
+	for (dir = env; dir && *dir; dir = *end ? end + 1 : end) {
+		if (!(end = strchr (dir, ':')))
+			end = dir + strlen (dir);
+		snprintf (path, sizeof (path), "%.*s/%s", (int) (end - dir), dir, name);
+		if (access (path, X_OK) == 0)
+			return nstrdup (path);
+	}
+
+	return NULL;
+}
+
+/* Our environment with var in it, for the new process */
+static char **
+upgrade_environment (char *var)
+{
+	extern char **environ;
+	char **env;
+	int i, n = 0;
+
+	for (i = 0; environ[i]; i++)
+		;
+	env = (char **) nmalloc ((i + 2) * sizeof (char *));
+
+	for (i = 0; environ[i]; i++)
+		if (strncmp (environ[i], UPGRADE_ENV "=", strlen (UPGRADE_ENV) + 1) != 0)
+			env[n++] = environ[i];
+	env[n++] = var;
+	env[n] = NULL;
+
+	return env;
+}
+
+static void
+upgrade_abort (const char *why)
+{
+	write_log (LOG_DEFAULT, "Hot upgrade failed: %s, going on as before", why);
+
+	upgrade_close ();
+	if (upgrade_pid > 0)
+		kill (upgrade_pid, SIGTERM);
+	upgrade_pid = -1;
+	upgrade_state = UPGRADE_IDLE;
+}
+
+/* Start the new process and hand it the listening sockets */
+static void
+upgrade_begin ()
+{
+	upgrade_hello_t hello;
+	upgrade_listener_t lis;
+	struct rlimit rl;
+	char var[64], *path, **env;
+	int sv[2], i, fd, maxfd = 1024;
+
+	if (upgrade_fd >= 0) {
+		write_log (LOG_DEFAULT, "WARNING: Hot upgrade: still taking over from the last one");
+		return;
+	}
+
+	if (info.workers > 1) {
+		write_log (LOG_DEFAULT, "WARNING: Hot upgrade: not with workers, restart instead");
+		return;
+	}
+
+	if (!upgrade_argv || !(path = upgrade_find_binary (upgrade_argv[0]))) {
+		write_log (LOG_DEFAULT, "WARNING: Hot upgrade: can't find the ntripcaster binary");
+		return;
+	}
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		write_log (LOG_DEFAULT, "WARNING: Hot upgrade: socketpair() failed: %s", strerror (errno));
+		nfree (path);
+		return;
+	}
+
+	snprintf (var, sizeof (var), "%s=%d", UPGRADE_ENV, sv[1]);
+	env = upgrade_environment (var);
+	if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+		maxfd = (int) rl.rlim_cur;
+
+	upgrade_pid = fork ();
+
+	if (upgrade_pid == 0) {
+		sigset_t ss;
+
+		/* Only the upgrade socket goes along, the rest is passed on purpose */
+		sigemptyset (&ss);
+		sigprocmask (SIG_SETMASK, &ss, NULL);
+		for (fd = 3; fd < maxfd; fd++)
+			if (fd != sv[1])
+				close (fd);
+		execve (path, upgrade_argv, env);
+		_exit (1);
+	}
+
+	close (sv[1]);
+	nfree (env);
+
+	if (upgrade_pid < 0) {
+		write_log (LOG_DEFAULT, "WARNING: Hot upgrade: fork() failed: %s", strerror (errno));
+		nfree (path);
+		close (sv[0]);
+		return;
+	}
+
+	write_log (LOG_DEFAULT, "Hot upgrade: started %s as process %d", path, (int) upgrade_pid);
+	nfree (path);
+
+	upgrade_fd = sv[0];
+	upgrade_state = UPGRADE_STARTING;
+	upgrade_deadline = get_mono_usec () + UPGRADE_START_TIMEOUT * 1000000LL;
+
+	memset (&hello, 0, sizeof (hello));
+	hello.version = UPGRADE_VERSION;
+	hello.layout = UPGRADE_LAYOUT;
+	hello.next_id = ice_atomic_load (&info.id);
+	for (i = 0; i < MAXLISTEN; i++)
+		hello.listeners += sock_valid (info.listen_sock[i]) + sock_valid (info.tls_listen_sock[i]);
+
+	if (!upgrade_send (UPGRADE_HELLO, INVALID_SOCKET, &hello, sizeof (hello))) {
+		upgrade_abort ("can't talk to the new process");
+		return;
+	}
+
+	for (i = 0; i < MAXLISTEN; i++) {
+		lis.tls = 0;
+		lis.port = info.port[i];
+		if (sock_valid (info.listen_sock[i]) && !upgrade_send (UPGRADE_LISTENER, info.listen_sock[i], &lis, sizeof (lis)))
+			break;
+		lis.tls = 1;
+		lis.port = info.tls_port[i];
+		if (sock_valid (info.tls_listen_sock[i]) && !upgrade_send (UPGRADE_LISTENER, info.tls_listen_sock[i], &lis, sizeof (lis)))
+			break;
+	}
+
+	if (i < MAXLISTEN)
+		upgrade_abort ("can't pass the listening sockets");
+}
+
+/* The new process is up, stop accepting and flag the sources to hand over */
+static void
+upgrade_handoff (upgrade_ready_t *ready)
+{
+	avl_traverser trav = {0};
+	connection_t *con;
+	source_t *source;
+	long int flagged = 0;
+	int i;
+
+	for (i = 0; i < MAXLISTEN; i++) {
+		if (sock_valid (info.listen_sock[i]))
+			sock_close (info.listen_sock[i]);
+		if (sock_valid (info.tls_listen_sock[i]))
+			sock_close (info.tls_listen_sock[i]);
+		info.listen_sock[i] = INVALID_SOCKET;
+		info.tls_listen_sock[i] = INVALID_SOCKET;
+	}
+
+	upgrade_started = get_mono_usec ();
+	upgrade_deadline = upgrade_started + UPGRADE_HANDOFF_TIMEOUT * 1000000LL;
+	upgrade_state = UPGRADE_HANDOFF;
+
+	if (!ready->streams) {
+		write_log (LOG_DEFAULT, "Hot upgrade: the new process is a different build, not handing over streams");
+		return;
+	}
+
+	thread_mutex_lock (&info.source_mutex);
+
+	while ((con = avl_traverse (info.sources, &trav))) {
+		source = con->food.source;
+		if (source->type == encoder_e && source->connected == SOURCE_CONNECTED && !con->tls) {
+			ice_atomic_store (&source->handoff, 1);
+			flagged++;
+		}
+	}
+
+	thread_mutex_unlock (&info.source_mutex);
+
+	/* Sources may be done already, so this can go below 0 for a moment */
+	ice_atomic_add (&upgrade_sources_left, flagged);
+
+	write_log (LOG_DEFAULT, "Hot upgrade: new process is accepting, handing over %ld sources", flagged);
+}
+
+/* Driven from the main loop */
+void
+upgrade_poll ()
+{
+	struct pollfd pfd;
+	upgrade_msg_t msg;
+	upgrade_ready_t ready;
+	SOCKET sock;
+	long long now;
+
+	if (upgrade_requested) {
+		upgrade_requested = 0;
+		write_log (LOG_DEFAULT, "Caught SIGUSR2, starting a hot upgrade...");
+		if (upgrade_state == UPGRADE_IDLE)
+			upgrade_begin ();
+		else
+			write_log (LOG_DEFAULT, "WARNING: Hot upgrade in progress already");
+	}
+
+	if (upgrade_state == UPGRADE_IDLE)
+		return;
+
+	now = get_mono_usec ();
+
+	if (upgrade_state == UPGRADE_STARTING) {
+		pfd.fd = upgrade_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll (&pfd, 1, 0) <= 0) {
+			if (now > upgrade_deadline)
+				upgrade_abort ("the new process didn't get ready in time");
+			return;
+		}
+
+		memset (&ready, 0, sizeof (ready));
+		if (!upgrade_recv (&msg, &sock, (char *) &ready, sizeof (ready)) || msg.type != UPGRADE_READY) {
+			if (sock_valid (sock))
+				sock_close (sock);
+			upgrade_abort ("the new process went away");
+			return;
+		}
+
+		upgrade_handoff (&ready);
+		return;
+	}
+
+	if (ice_atomic_load (&upgrade_sources_left) > 0 && now < upgrade_deadline)
+		return;
+
+	internal_lock_mutex (&upgrade_mutex);
+	upgrade_send (UPGRADE_DONE, INVALID_SOCKET, NULL, 0);
+	internal_unlock_mutex (&upgrade_mutex);
+	upgrade_close ();
+
+	write_log (LOG_DEFAULT, "Hot upgrade: handed over %lu sources and %lu clients in %lld ms, exiting",
+		   ice_atomic_load (&upgrade_sources), ice_atomic_load (&upgrade_clients), (now - upgrade_started) / 1000);
+
+	upgrade_state = UPGRADE_IDLE;
+	running = SERVER_DYING;
+}
+
+/* Fill in what the new process needs to know about con */
+static void
+upgrade_describe (connection_t *con, upgrade_con_t *rec)
+{
+	header_table_t *ht = &con->headers;
+	int i, len = 0;
+
+	memset (rec, 0, sizeof (*rec));
+	rec->id = con->id;
+	rec->connect_time = con->connect_time;
+	if (con->sin) {
+		rec->has_sin = 1;
+		rec->sin = *con->sin;
+	}
+	if (con->user)
+		strncpy (rec->user, con->user, BUFSIZE - 1);
+
+	/* The request buffer was cut up by header_parse(), put it back together */
+	if (ht->request_line)
+		len = snprintf (rec->request, BUFSIZE, "%s\n", ht->request_line);
+	for (i = 0; i < ht->count && len < BUFSIZE; i++)
+		len += snprintf (rec->request + len, BUFSIZE - len, "%s: %s\n", ht->hdr[i].name, ht->hdr[i].value);
+}
+
+/*
+ * Called by the source thread when its source is flagged for handing
+ * over. Passes the source with its ring and its clients to the new
+ * process and kicks them here. Returns 1 if the source is gone.
+ */
+int
+upgrade_source (connection_t *con)
+{
+	source_t *source = con->food.source;
+	upgrade_source_t *rec;
+	upgrade_client_t *crec;
+	connection_t *clicon, *reap;
+	client_slot_t *slot;
+	int i, len, handed = 0, clients = 0;
+
+	ice_atomic_store (&source->handoff, 0);
+
+	rec = (upgrade_source_t *) nmalloc (UPGRADE_MSG_MAX);
+	crec = (upgrade_client_t *) nmalloc (sizeof (upgrade_client_t));
+
+	thread_mutex_lock (&source->mutex);
+
+	source_get_new_clients (source);
+
+	upgrade_describe (con, &rec->con);
+	memset (rec->mount, 0, BUFSIZE);
+	memset (rec->agent, 0, BUFSIZE);
+	strncpy (rec->mount, source->audiocast.mount, BUFSIZE - 1);
+	if (source->source_agent)
+		strncpy (rec->agent, source->source_agent, BUFSIZE - 1);
+	rec->cid = source->cid;
+	rec->stats = source->stats;
+
+	len = sizeof (upgrade_source_t);
+	for (i = 0; i < CHUNKLEN; i++) {
+		rec->len[i] = source->chunk[i].len;
+		rec->metalen[i] = source->chunk[i].metalen;
+		rec->clients_left[i] = source->chunk[i].clients_left;
+		memcpy ((char *) rec + len, source->chunk[i].data, source->chunk[i].len);
+		len += source->chunk[i].len;
+	}
+
+	internal_lock_mutex (&upgrade_mutex);
+
+	if (upgrade_fd >= 0 && upgrade_send (UPGRADE_SOURCE, con->sock, rec, len)) {
+		handed = 1;
+
+		for (i = 0; i < source->clients.count; i++) {
+			clicon = source->clients.con[i];
+			slot = &source->clients.slot[i];
+
+			if ((slot->flags & CLIENT_SLOT_DEAD) || clicon->tls)
+				continue;
+
+			upgrade_describe (clicon, &crec->con);
+			crec->type = clicon->food.client->type;
+			crec->virgin = clicon->food.client->virgin;
+			crec->cid = slot->cid;
+			crec->offset = slot->offset;
+			crec->flags = slot->flags;
+			crec->write_bytes = clicon->food.client->write_bytes;
+
+			if (!upgrade_send (UPGRADE_CLIENT, clicon->sock, crec, sizeof (upgrade_client_t)))
+				break;
+
+			/* Our copy of the socket just gets closed, the peer doesn't notice */
+			kick_connection (clicon, "Handed over to new process");
+			clients++;
+		}
+	}
+
+	internal_unlock_mutex (&upgrade_mutex);
+
+	reap = kick_dead_clients (source);
+
+	if (handed) {
+		write_log (LOG_DEFAULT, "Handed source %d on %s over with %d clients", con->id, source->audiocast.mount, clients);
+		kick_connection (con, "Handed over to new process");
+		con->sock = INVALID_SOCKET;	/* Closed by the kick, the number may be in use again */
+	}
+
+	thread_mutex_unlock (&source->mutex);
+
+	reap_clients (reap);
+
+	nfree (rec);
+	nfree (crec);
+
+	if (handed) {
+		ice_atomic_add (&upgrade_sources, 1);
+		ice_atomic_add (&upgrade_clients, clients);
+	}
+	ice_atomic_sub (&upgrade_sources_left, 1);
+
+	return handed;
+}
+
+/* Take the listening sockets over from the old process, if we are a hot upgrade */
+static void
+upgrade_take_listeners ()
+{
+	upgrade_msg_t msg;
+	upgrade_hello_t hello;
+	upgrade_listener_t lis;
+	SOCKET sock;
+	const char *env = getenv (UPGRADE_ENV);
+	int i, n, taken = 0;
+
+	if (!env)
+		return;
+
+	upgrade_fd = atoi (env);
+	unsetenv (UPGRADE_ENV);
+
+	if (!upgrade_recv (&msg, &sock, (char *) &hello, sizeof (hello)) || msg.type != UPGRADE_HELLO) {
+		write_log (LOG_DEFAULT, "WARNING: Hot upgrade: nothing from the old process, starting afresh");
+		upgrade_close ();
+		return;
+	}
+
+	upgrade_streams = hello.version == UPGRADE_VERSION && hello.layout == UPGRADE_LAYOUT;
+	if (hello.next_id > info.id)
+		info.id = hello.next_id;
+
+	for (n = 0; n < hello.listeners; n++) {
+		if (!upgrade_recv (&msg, &sock, (char *) &lis, sizeof (lis)) || msg.type != UPGRADE_LISTENER || !sock_valid (sock))
+			break;
+
+		for (i = 0; i < MAXLISTEN; i++) {
+			if (!lis.tls && info.port[i] == lis.port && !sock_valid (info.listen_sock[i])) {
+				info.listen_sock[i] = sock;
+				break;
+			}
+			if (lis.tls && info.tls_port[i] == lis.port && !sock_valid (info.tls_listen_sock[i])) {
+				info.tls_listen_sock[i] = sock;
+				break;
+			}
+		}
+
+		if (i < MAXLISTEN) {
+			taken++;
+		} else {
+			write_log (LOG_DEFAULT, "Hot upgrade: port %d is gone from the config, closing it", lis.port);
+			sock_close (sock);
+		}
+	}
+
+	write_log (LOG_DEFAULT, "Hot upgrade: took over %d listening sockets from the old process", taken);
+}
+
+static connection_t *
+upgrade_adopt (upgrade_con_t *rec, SOCKET sock)
+{
+	connection_t *con = create_connection ();
+
+	con->sock = sock;
+	con->id = rec->id;
+	con->connect_time = rec->connect_time;
+	con->connect_usec = get_mono_usec ();
+
+	if (rec->has_sin && (con->sin = (struct sockaddr_in *) slab_alloc (&sockaddr_slab))) {
+		memcpy (con->sin, &rec->sin, sizeof (struct sockaddr_in));
+		con->sinlen = sizeof (struct sockaddr_in);
+		con->host = create_malloced_ascii_host (&con->sin->sin_addr);
+		con->admitted = admit_adopt (con->sin->sin_addr);
+	}
+
+	if (rec->user[0])
+		con->user = nstrdup (rec->user);
+
+	rec->request[BUFSIZE - 1] = '\0';
+	memcpy (con->request, rec->request, BUFSIZE);
+	header_parse (con, con->request);
+
+	return con;
+}
+
+/* A source of the old process, set up like source_login() does */
+static connection_t *
+upgrade_adopt_source (upgrade_source_t *rec, int len, SOCKET sock)
+{
+	connection_t *con;
+	source_t *source;
+	char *data = (char *) (rec + 1);
+	int i, need = sizeof (upgrade_source_t);
+
+	for (i = 0; i < CHUNKLEN; i++) {
+		if (rec->len[i] < 0 || rec->len[i] > UPGRADE_CHUNK_MAX)
+			break;
+		need += rec->len[i];
+	}
+
+	if (i < CHUNKLEN || len != need || rec->cid < 0 || rec->cid >= CHUNKLEN) {
+		write_log (LOG_DEFAULT, "WARNING: Hot upgrade: garbled source record");
+		sock_close (sock);
+		return NULL;
+	}
+
+	rec->mount[BUFSIZE - 1] = '\0';
+	rec->agent[BUFSIZE - 1] = '\0';
+
+	con = upgrade_adopt (&rec->con, sock);
+	put_source (con);
+	source = con->food.source;
+	source->type = encoder_e;
+	source->audiocast.mount = my_strdup (rec->mount);
+	if (rec->agent[0])
+		source->source_agent = my_strdup (rec->agent);
+	source->cid = rec->cid;
+	source->stats = rec->stats;
+
+	for (i = 0; i < CHUNKLEN; i++) {
+		memcpy (source->chunk[i].data, data, rec->len[i]);
+		data += rec->len[i];
+		source->chunk[i].len = rec->len[i];
+		source->chunk[i].metalen = rec->metalen[i];
+		source->chunk[i].clients_left = rec->clients_left[i];
+		source->chunk[i].arrival = con->connect_usec;
+	}
+
+	if (mount_exists (source->audiocast.mount)) {
+		kick_connection (con, "Invalid Mount Point");
+		return NULL;
+	}
+
+	if (!add_source ()) {
+		kick_connection (con, "Server Full (too many streams)");
+		return NULL;
+	}
+
+	sock_apply_policy (con->sock, SOCK_ROLE_SOURCE);
+	source->connected = SOURCE_CONNECTED;
+
+	thread_mutex_lock (&info.source_mutex);
+	avl_insert (info.sources, con);
+	thread_mutex_unlock (&info.source_mutex);
+
+	return con;
+}
+
+/* A client of the last source, back on its place in the ring */
+static int
+upgrade_adopt_client (connection_t *scon, upgrade_client_t *rec, SOCKET sock)
+{
+	source_t *source = scon->food.source;
+	connection_t *con;
+	client_slot_t *slot;
+
+	if (!util_increase_total_clients (source)) {
+		sock_close (sock);
+		return 0;
+	}
+
+	con = upgrade_adopt (&rec->con, sock);
+	put_client (con);
+	con->food.client->type = rec->type;
+	con->food.client->source = source;
+	con->food.client->write_bytes = rec->write_bytes;
+	con->food.client->virgin = rec->virgin;
+	sock_apply_policy (con->sock, rec->type == pulling_client_e ? SOCK_ROLE_RELAY : SOCK_ROLE_CLIENT);
+
+	thread_mutex_lock (&source->mutex);
+
+	if (rec->virgin == 0)
+		source->num_clients++;
+
+	client_set_add (source, con);
+	slot = &source->clients.slot[con->food.client->slot];
+
+	if (!(rec->flags & CLIENT_SLOT_NEW) && rec->cid >= 0 && rec->cid < CHUNKLEN
+	    && rec->offset >= 0 && rec->offset <= source->chunk[rec->cid].len) {
+		slot->cid = rec->cid;
+		slot->offset = rec->offset;
+		slot->flags &= ~CLIENT_SLOT_NEW;
+	}
+
+	thread_mutex_unlock (&source->mutex);
+
+	return 1;
+}
+
+static void
+upgrade_start_source (connection_t *con, int clients)
+{
+	if (!con)
+		return;
+
+	write_log (LOG_DEFAULT, "Took over source %d on %s with %d clients", con->id, con->food.source->audiocast.mount, clients);
+	thread_create ("Source Thread", source_func, (void *) con);
+}
+
+/* Takes the sources and clients as the old process sends them */
+static void *
+upgrade_receive_thread (void *arg)
+{
+	upgrade_msg_t msg;
+	connection_t *con = NULL;
+	char *buf = (char *) nmalloc (UPGRADE_MSG_MAX);
+	unsigned long int sources = 0, clients = 0;
+	int con_clients = 0;
+	SOCKET sock;
+
+	thread_init ();
+
+	while (upgrade_recv (&msg, &sock, buf, UPGRADE_MSG_MAX) && msg.type != UPGRADE_DONE) {
+		if (msg.type == UPGRADE_SOURCE && sock_valid (sock) && msg.len >= (int) sizeof (upgrade_source_t)) {
+			upgrade_start_source (con, con_clients);
+			con_clients = 0;
+			if ((con = upgrade_adopt_source ((upgrade_source_t *) buf, msg.len, sock)))
+				sources++;
+		} else if (msg.type == UPGRADE_CLIENT && sock_valid (sock) && con && msg.len == sizeof (upgrade_client_t)) {
+			if (upgrade_adopt_client (con, (upgrade_client_t *) buf, sock)) {
+				con_clients++;
+				clients++;
+			}
+		} else if (sock_valid (sock)) {
+			/* Its source didn't make it */
+			sock_close (sock);
+		}
+	}
+
+	upgrade_start_source (con, con_clients);
+	upgrade_close ();
+	nfree (buf);
+
+	write_log (LOG_DEFAULT, "Hot upgrade: took over %lu sources and %lu clients", sources, clients);
+
+	thread_exit (0);
+	return NULL;
+}
+
+/* Tell the old process we are accepting, and take its streams */
+void
+upgrade_ready ()
+{
+	upgrade_ready_t ready;
+
+	if (upgrade_fd < 0)
+		return;
+
+	ready.streams = upgrade_streams;
+
+	if (!upgrade_send (UPGRADE_READY, INVALID_SOCKET, &ready, sizeof (ready)) || !upgrade_streams) {
+		upgrade_close ();
+		return;
+	}
+
+	thread_create ("Upgrade Thread", upgrade_receive_thread, NULL);
+}
+
+#else
+
+void
+upgrade_init (char **argv)
+{
+}
+
+void
+upgrade_poll ()
+{
+}
+
+void
+upgrade_ready ()
+{
+}
+
+int
+upgrade_source (connection_t *con)
+{
+	return 0;
+}
+
+static void
+upgrade_take_listeners ()
+{
+}
+
+#endif
@@ -55,6 +55,8 @@ void initialize_network ();
 BOOL WINAPI win_sig_die (DWORD CtrlType);
 #else
 RETSIGTYPE sig_hup(int signo);
+RETSIGTYPE sig_usr1(int signo);
+RETSIGTYPE sig_usr2(int signo);
 RETSIGTYPE sig_die(int signo);
 RETSIGTYPE sig_die_hard (int signo);
 RETSIGTYPE sig_child(int signo);
@@ -62,4 +64,12 @@ RETSIGTYPE sig_child(int signo);
 char *splitc(char *first, char *rest, const char divider);
 void close_socket(sock_t sock);
 
+void start_workers ();
+void signal_workers (int sig);
+
+void upgrade_init (char **argv);
+void upgrade_poll ();
+void upgrade_ready ();
+int upgrade_source (connection_t *con);
+
 #endif
@@ -0,0 +1,992 @@
+/* metrics.c
+ * - Prometheus metrics, rendered from periodic snapshots
+ *
+ * Copyright (c) 2003
+ * German Federal Agency for Cartography and Geodesy (BKG)
+ *
+ * Developed for Networked Transport of RTCM via Internet Protocol (NTRIP)
+ * for streaming GNSS data over the Internet.
+ *
+ * Designed by Informatik Centrum Dortmund http://www.icd.de
+ *
+ * NTRIP is currently an experimental technology.
+ * The BKG disclaims any liability nor responsibility to any person or entity
+ * with respect to any loss or damage caused, or alleged to be caused,
+ * directly or indirectly by the use and application of the NTRIP technology.
+ *
+ * For latest information and updates, access:
+ * http://igs.ifag.de/index_ntrip.htm
+ *
+ * Georg Weber
+ * BKG, Frankfurt, Germany, June 2003-06-13
+ * E-mail: euref-ip@bkg.bund.de
+ *
+ * Based on the GNU General Public License published Icecast 1.3.12
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#ifdef _WIN32
+#include <win32config.h>
+#else
+#include <config.h>
+#endif
+#endif
+
+#include "definitions.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <signal.h>
+#endif
+
+#include <sys/types.h>
+#include <time.h>
+#include <stdlib.h>
+
+#include "avl.h"
+#include "threads.h"
+#include "ntripcaster.h"
+#include "utility.h"
+#include "ntrip_string.h"
+#include "timer.h"
+#define LOG_MODULE LOG_MOD_METRICS
+#include "log.h"
+#include "sock.h"
+#include "client.h"
+#include "source.h"
+#include "connection.h"
+#include "metrics.h"
+#include "sessionlog.h"
+
+extern server_info_t info;
+
+static mutex_t metrics_mutex = {MUTEX_STATE_UNINIT};
+static metrics_snapshot_t *metrics_current = NULL;
+static time_t metrics_last_update = 0;
+
+/* Updated lock free by the threads that see the events */
+static unsigned long int metrics_kicks[KICK_MAX];
+static histogram_t metrics_client_login;	/* Microseconds */
+static histogram_t metrics_source_login;
+
+typedef struct metrics_buf_St
+{
+	char *text;
+	int len;
+	int size;
+} metrics_buf_t;
+
+typedef struct metrics_mount_St
+{
+	char *mount;
+	unsigned long int bytes_in;
+	unsigned long int bytes_out;
+	unsigned long int clients;
+	unsigned long int ingest_gaps;
+	double max_gap;
+	double since_data;
+	histogram_t fanout_lag;
+	latency_hist_t latency;
+} metrics_mount_t;
+
+/* histogram.c. ajd ****************************************************/
+
+/* Values in bucket i are below 2^i */
+int
+histogram_bucket (unsigned long int value)
+{
+	int bucket = 0;
+
+	while (value && bucket < HISTOGRAM_BUCKETS - 1) {
+		value >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/* For histograms with only one writing thread */
+void
+histogram_add (histogram_t *h, unsigned long int value)
+{
+	h->bucket[histogram_bucket (value)]++;
+	h->sum += value;
+	h->samples++;
+}
+
+void
+histogram_add_atomic (histogram_t *h, unsigned long int value)
+{
+	ice_atomic_add (&h->bucket[histogram_bucket (value)], 1);
+	ice_atomic_add (&h->sum, value);
+	ice_atomic_add (&h->samples, 1);
+}
+
+/* Bucket of a latency value. The first 2^LATENCY_SUB_BITS values get a
+ * bucket each, after that every power of two is split in 2^LATENCY_SUB_BITS
+ * linear buckets, so a bucket is never more than 1/8 of its values wide. */
+static int
+latency_bucket (unsigned long int value)
+{
+	int exp = 0;
+	unsigned long int v;
+
+	if (value < (1UL << LATENCY_SUB_BITS))
+		return value;
+
+	if (value >= (1UL << LATENCY_MAX_BITS))
+		return LATENCY_BUCKETS - 1;
+
+	for (v = value; v > 1; v >>= 1)
+		exp++;
+
+	return ((exp - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + ((value >> (exp - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+/* Highest value that falls in bucket */
+static unsigned long int
+latency_bucket_top (int bucket)
+{
+	int exp, sub;
+
+	if (bucket < (1 << LATENCY_SUB_BITS))
+		return bucket;
+
+	exp = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+	sub = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+
+	return (((1UL << LATENCY_SUB_BITS) + sub + 1) << (exp - LATENCY_SUB_BITS)) - 1;
+}
+
+/* Only one thread may add to a latency histogram, no locking or
+ * allocation is done here */
+void
+latency_add (latency_hist_t *h, unsigned long int usecs)
+{
+	h->bucket[latency_bucket (usecs)]++;
+	h->samples++;
+	h->sum += usecs;
+	if (usecs > h->max)
+		h->max = usecs;
+}
+
+/* Value below which percentile (0-100) of the samples fall, rounded up
+ * to the top of its bucket */
+unsigned long int
+latency_percentile (latency_hist_t *h, double percentile)
+{
+	unsigned long int seen = 0, wanted;
+	int i;
+
+	if (h->samples == 0)
+		return 0;
+
+	wanted = (unsigned long int) (h->samples * percentile / 100.0 + 0.5);
+	if (wanted < 1)
+		wanted = 1;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= wanted)
+			return latency_bucket_top (i) < h->max ? latency_bucket_top (i) : h->max;
+	}
+
+	return h->max;
+}
+
+/* Log the latency percentiles of a source that is going away.
+ * Must be the source thread, or have the source mutex. */
+void
+latency_log_summary (source_t *source)
+{
+	latency_hist_t *h = &source->latency;
+
+	if (h->samples == 0)
+		return;
+
+	write_log (LOG_DEFAULT, "Latency on mountpoint %s over %lu writes: p50 %lu us, p90 %lu us, p99 %lu us, max %lu us",
+		   nullcheck_string (source->audiocast.mount), h->samples, latency_percentile (h, 50.0),
+		   latency_percentile (h, 90.0), latency_percentile (h, 99.0), h->max);
+}
+
+/* metrics.c. ajd ****************************************************/
+
+void
+metrics_init ()
+{
+	thread_create_mutex (&metrics_mutex);
+}
+
+void
+metrics_kick (const char *reason)
+{
+	ice_atomic_add (&metrics_kicks[kick_reason_code (reason)], 1);
+}
+
+/* con has logged in as a client or source, record how long it took */
+void
+metrics_login_done (connection_t *con)
+{
+	long long usecs = get_mono_usec () - con->connect_usec;
+
+	if (usecs < 0)
+		usecs = 0;
+
+	histogram_add_atomic (con->type == source_e ? &metrics_source_login : &metrics_client_login, usecs);
+}
+
+/* Called by the source thread for every chunk read from the source */
+void
+metrics_ingest (source_t *source)
+{
+	long long now = get_mono_usec ();
+
+	if (source->last_ingest > 0) {
+		long long gap = now - source->last_ingest;
+
+		if (gap >= INGEST_GAP_USEC)
+			source->ingest_gaps++;
+		if (gap > source->max_ingest_gap)
+			source->max_ingest_gap = gap;
+	}
+
+	source->last_ingest = now;
+}
+
+static void
+mb_printf (metrics_buf_t *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int res;
+
+	while (1) {
+		va_start (ap, fmt);
+		res = vsnprintf (mb->text + mb->len, mb->size - mb->len, fmt, ap);
+		va_end (ap);
+
+		if (res < 0)
+			return;
+
+		if (res < mb->size - mb->len) {
+			mb->len += res;
+			return;
+		}
+
+		{
+			char *text = (char *) nmalloc (mb->size * 2);
+
+			memcpy (text, mb->text, mb->len);
+			nfree (mb->text);
+			mb->text = text;
+			mb->size *= 2;
+		}
+	}
+}
+
+/* Label values escaped as the exposition format wants them */
+static const char *
+metrics_label (const char *value, char *buf, int len)
+{
+	int i = 0;
+
+	for (; value && *value && i < len - 2; value++) {
+		if (*value == '\\' || *value == '"' || *value == '\n') {
+			buf[i++] = '\\';
+			buf[i++] = *value == '\n' ? 'n' : *value;
+		} else
+			buf[i++] = *value;
+	}
+
+	buf[i] = '\0';
+	return buf;
+}
+
+/* Render h as a prometheus histogram, with buckets up to 2^(buckets - 1)
+ * units. labels is "" or 'name="value",' */
+static void
+metrics_histogram (metrics_buf_t *mb, const char *name, const char *labels, histogram_t *h, double unit, int buckets)
+{
+	unsigned long int count = 0;
+	int i;
+
+	for (i = 0; i < buckets && i < HISTOGRAM_BUCKETS; i++) {
+		count += ice_atomic_load (&h->bucket[i]);
+		mb_printf (mb, "%s_bucket{%sle=\"%g\"} %lu\n", name, labels, (double) (1UL << i) * unit, count);
+	}
+
+	mb_printf (mb, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, labels, ice_atomic_load (&h->samples));
+
+	/* Drop the trailing ',' of labels */
+	i = ice_strlen (labels);
+	mb_printf (mb, "%s_sum{%.*s} %g\n", name, i > 0 ? i - 1 : 0, labels, (double) ice_atomic_load (&h->sum) * unit);
+	mb_printf (mb, "%s_count{%.*s} %lu\n", name, i > 0 ? i - 1 : 0, labels, ice_atomic_load (&h->samples));
+}
+
+/* Per mount series. The numbers are copied under the source mutexes,
+ * and rendered after they are released. */
+static void
+metrics_render_mounts (metrics_buf_t *mb)
+{
+	avl_traverser trav = {0};
+	connection_t *sourcecon;
+	metrics_mount_t *mounts;
+	int num_mounts = 0, i;
+	long long now = get_mono_usec ();
+	char label[BUFSIZE], labels[BUFSIZE + 16];
+
+	thread_mutex_lock (&info.source_mutex);
+
+	mounts = (metrics_mount_t *) nmalloc ((avl_count (info.sources) + 1) * sizeof (metrics_mount_t));
+
+	while ((sourcecon = avl_traverse (info.sources, &trav))) {
+		source_t *source = sourcecon->food.source;
+		metrics_mount_t *m = &mounts[num_mounts++];
+
+		thread_mutex_lock (&source->mutex);
+
+		m->mount = nstrdup (source->audiocast.mount ? source->audiocast.mount : "");
+		m->bytes_in = source->stats.read_kilos * 1024 + source->stats.read_bytes;
+		m->bytes_out = source->stats.write_kilos * 1024 + source->stats.write_bytes;
+		m->clients = source->num_clients;
+		m->ingest_gaps = source->ingest_gaps;
+		m->max_gap = source->max_ingest_gap / 1000000.0;
+		m->since_data = source->last_ingest > 0 ? (now - source->last_ingest) / 1000000.0 : -1.0;
+		m->fanout_lag = source->fanout_lag;
+		m->latency = source->latency;
+
+		thread_mutex_unlock (&source->mutex);
+	}
+
+	thread_mutex_unlock (&info.source_mutex);
+
+	mb_printf (mb, "# TYPE ntripcaster_mount_bytes_in_total counter\n");
+	for (i = 0; i < num_mounts; i++)
+		mb_printf (mb, "ntripcaster_mount_bytes_in_total{mount=\"%s\"} %lu\n",
+			   metrics_label (mounts[i].mount, label, BUFSIZE), mounts[i].bytes_in);
+
+	mb_printf (mb, "# TYPE ntripcaster_mount_bytes_out_total counter\n");
+	for (i = 0; i < num_mounts; i++)
+		mb_printf (mb, "ntripcaster_mount_bytes_out_total{mount=\"%s\"} %lu\n",
+			   metrics_label (mounts[i].mount, label, BUFSIZE), mounts[i].bytes_out);
+
+	mb_printf (mb, "# TYPE ntripcaster_mount_clients gauge\n");
+	for (i = 0; i < num_mounts; i++)
+		mb_printf (mb, "ntripcaster_mount_clients{mount=\"%s\"} %lu\n",
+			   metrics_label (mounts[i].mount, label, BUFSIZE), mounts[i].clients);
+
+	mb_printf (mb, "# TYPE ntripcaster_mount_ingest_gaps_total counter\n");
+	for (i = 0; i < num_mounts; i++)
+		mb_printf (mb, "ntripcaster_mount_ingest_gaps_total{mount=\"%s\"} %lu\n",
+			   metrics_label (mounts[i].mount, label, BUFSIZE), mounts[i].ingest_gaps);
+
+	mb_printf (mb, "# TYPE ntripcaster_mount_ingest_gap_max_seconds gauge\n");
+	for (i = 0; i < num_mounts; i++)
+		mb_printf (mb, "ntripcaster_mount_ingest_gap_max_seconds{mount=\"%s\"} %g\n",
+			   metrics_label (mounts[i].mount, label, BUFSIZE), mounts[i].max_gap);
+
+	mb_printf (mb, "# TYPE ntripcaster_mount_seconds_since_data gauge\n");
+	for (i = 0; i < num_mounts; i++)
+		mb_printf (mb, "ntripcaster_mount_seconds_since_data{mount=\"%s\"} %g\n",
+			   metrics_label (mounts[i].mount, label, BUFSIZE), mounts[i].since_data);
+
+	mb_printf (mb, "# TYPE ntripcaster_mount_fanout_lag_chunks histogram\n");
+	for (i = 0; i < num_mounts; i++) {
+		snprintf (labels, BUFSIZE + 16, "mount=\"%s\",", metrics_label (mounts[i].mount, label, BUFSIZE));
+		metrics_histogram (mb, "ntripcaster_mount_fanout_lag_chunks", labels, &mounts[i].fanout_lag, 1.0, 7);
+	}
+
+	mb_printf (mb, "# TYPE ntripcaster_mount_latency_seconds summary\n");
+	for (i = 0; i < num_mounts; i++) {
+		static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+		latency_hist_t *h = &mounts[i].latency;
+		int q;
+
+		metrics_label (mounts[i].mount, label, BUFSIZE);
+		for (q = 0; q < 4; q++)
+			mb_printf (mb, "ntripcaster_mount_latency_seconds{mount=\"%s\",quantile=\"%g\"} %g\n", label, quantiles[q],
+				   latency_percentile (h, quantiles[q] * 100.0) / 1000000.0);
+		mb_printf (mb, "ntripcaster_mount_latency_seconds_sum{mount=\"%s\"} %g\n", label, h->sum / 1000000.0);
+		mb_printf (mb, "ntripcaster_mount_latency_seconds_count{mount=\"%s\"} %lu\n", label, h->samples);
+	}
+
+	mb_printf (mb, "# TYPE ntripcaster_mount_latency_max_seconds gauge\n");
+	for (i = 0; i < num_mounts; i++)
+		mb_printf (mb, "ntripcaster_mount_latency_max_seconds{mount=\"%s\"} %g\n",
+			   metrics_label (mounts[i].mount, label, BUFSIZE), mounts[i].latency.max / 1000000.0);
+
+	for (i = 0; i < num_mounts; i++) {
+		nfree (mounts[i].mount);
+	}
+
+	nfree (mounts);
+}
+
+/* Object cache occupancy */
+static void
+metrics_render_slabs (metrics_buf_t *mb)
+{
+	slab_stats_t st[SLAB_MAX_CACHES];
+	slab_cache_t *cache;
+	int i, n;
+
+	for (n = 0; (cache = slab_cache (n)); n++)
+		slab_get_stats (cache, &st[n]);
+
+	mb_printf (mb, "# TYPE ntripcaster_slab_objects gauge\n");
+	for (i = 0; i < n; i++) {
+		const char *name = slab_cache (i)->name;
+		mb_printf (mb, "ntripcaster_slab_objects{cache=\"%s\",state=\"in_use\"} %lu\n", name, st[i].in_use);
+		mb_printf (mb, "ntripcaster_slab_objects{cache=\"%s\",state=\"magazine\"} %lu\n", name, st[i].magazines);
+		mb_printf (mb, "ntripcaster_slab_objects{cache=\"%s\",state=\"depot\"} %lu\n", name, st[i].depot_free);
+	}
+	mb_printf (mb, "# TYPE ntripcaster_slab_bytes gauge\n");
+	for (i = 0; i < n; i++)
+		mb_printf (mb, "ntripcaster_slab_bytes{cache=\"%s\"} %lu\n", slab_cache (i)->name, st[i].bytes);
+	mb_printf (mb, "# TYPE ntripcaster_slab_depot_ops_total counter\n");
+	for (i = 0; i < n; i++) {
+		mb_printf (mb, "ntripcaster_slab_depot_ops_total{cache=\"%s\",op=\"refill\"} %lu\n", slab_cache (i)->name, st[i].refills);
+		mb_printf (mb, "ntripcaster_slab_depot_ops_total{cache=\"%s\",op=\"flush\"} %lu\n", slab_cache (i)->name, st[i].flushes);
+	}
+}
+
+/* Per address admission control */
+static void
+metrics_render_admission (metrics_buf_t *mb)
+{
+	admit_stats_t st;
+
+	admit_get_stats (&st);
+
+	mb_printf (mb, "# TYPE ntripcaster_admission_rejected_total counter\n");
+	mb_printf (mb, "ntripcaster_admission_rejected_total{reason=\"per_ip\"} %lu\n", st.rejected_open);
+	mb_printf (mb, "ntripcaster_admission_rejected_total{reason=\"rate\"} %lu\n", st.rejected_rate);
+	mb_printf (mb, "ntripcaster_admission_rejected_total{reason=\"banned\"} %lu\n", st.rejected_banned);
+	mb_printf (mb, "# TYPE ntripcaster_admission_bans_total counter\n");
+	mb_printf (mb, "ntripcaster_admission_bans_total %lu\n", st.bans);
+	mb_printf (mb, "# TYPE ntripcaster_admission_slots_used gauge\n");
+	mb_printf (mb, "ntripcaster_admission_slots_used %lu\n", st.tracked);
+	mb_printf (mb, "# TYPE ntripcaster_admission_untracked_total counter\n");
+	mb_printf (mb, "ntripcaster_admission_untracked_total %lu\n", st.table_full);
+}
+
+static void
+metrics_render_tls (metrics_buf_t *mb)
+{
+	tls_stats_t st;
+
+	tls_get_stats (&st);
+
+	mb_printf (mb, "# TYPE ntripcaster_tls_handshakes_total counter\n");
+	mb_printf (mb, "ntripcaster_tls_handshakes_total{result=\"ok\"} %lu\n", st.handshakes);
+	mb_printf (mb, "ntripcaster_tls_handshakes_total{result=\"failed\"} %lu\n", st.failures);
+	mb_printf (mb, "# TYPE ntripcaster_tls_kernel_sessions_total counter\n");
+	mb_printf (mb, "ntripcaster_tls_kernel_sessions_total{direction=\"send\"} %lu\n", st.ktls_send);
+	mb_printf (mb, "ntripcaster_tls_kernel_sessions_total{direction=\"recv\"} %lu\n", st.ktls_recv);
+}
+
+/* Labels of one lock profiler call site */
+static char *
+metrics_lock_labels (lockprof_site_t *site, char *buf, int len)
+{
+	char name[40], label[BUFSIZE];
+
+	mutex_to_string (site->mutex, name);
+	snprintf (buf, len, "mutex=\"%s\",site=\"%s:%d\"", metrics_label (name, label, BUFSIZE),
+		  site->file, site->line);
+	return buf;
+}
+
+/* Mutex contention per call site, with lock_profile on */
+static void
+metrics_render_locks (metrics_buf_t *mb)
+{
+	lockprof_site_t *sites;
+	unsigned long int dropped;
+	char labels[BUFSIZE + 64];
+	int i, n;
+
+	if (!info.lock_profile)
+		return;
+
+	n = lockprof_collect (&sites, &dropped);
+
+	mb_printf (mb, "# TYPE ntripcaster_lock_acquires_total counter\n");
+	for (i = 0; i < n; i++)
+		mb_printf (mb, "ntripcaster_lock_acquires_total{%s} %lu\n",
+			   metrics_lock_labels (&sites[i], labels, sizeof (labels)), sites[i].acquires);
+	mb_printf (mb, "# TYPE ntripcaster_lock_contended_total counter\n");
+	for (i = 0; i < n; i++)
+		mb_printf (mb, "ntripcaster_lock_contended_total{%s} %lu\n",
+			   metrics_lock_labels (&sites[i], labels, sizeof (labels)), sites[i].contended);
+	mb_printf (mb, "# TYPE ntripcaster_lock_wait_seconds_total counter\n");
+	for (i = 0; i < n; i++)
+		mb_printf (mb, "ntripcaster_lock_wait_seconds_total{%s} %g\n",
+			   metrics_lock_labels (&sites[i], labels, sizeof (labels)), sites[i].wait_usec / 1000000.0);
+	mb_printf (mb, "# TYPE ntripcaster_lock_wait_max_seconds gauge\n");
+	for (i = 0; i < n; i++)
+		mb_printf (mb, "ntripcaster_lock_wait_max_seconds{%s} %g\n",
+			   metrics_lock_labels (&sites[i], labels, sizeof (labels)), sites[i].max_wait_usec / 1000000.0);
+	mb_printf (mb, "# TYPE ntripcaster_lock_hold_seconds_total counter\n");
+	for (i = 0; i < n; i++)
+		mb_printf (mb, "ntripcaster_lock_hold_seconds_total{%s} %g\n",
+			   metrics_lock_labels (&sites[i], labels, sizeof (labels)), sites[i].hold_usec / 1000000.0);
+	mb_printf (mb, "# TYPE ntripcaster_lock_hold_max_seconds gauge\n");
+	for (i = 0; i < n; i++)
+		mb_printf (mb, "ntripcaster_lock_hold_max_seconds{%s} %g\n",
+			   metrics_lock_labels (&sites[i], labels, sizeof (labels)), sites[i].max_hold_usec / 1000000.0);
+	mb_printf (mb, "# TYPE ntripcaster_lock_uncounted_total counter\n");
+	mb_printf (mb, "ntripcaster_lock_uncounted_total %lu\n", dropped);
+
+	nfree (sites);
+}
+
+/* board.c. ajd *******************************************************************************/
+
+/*
+ * With workers, SO_REUSEPORT hands each scrape to any one of them. So
+ * every worker also publishes its page on a board shared by all, with a
+ * worker label on every sample, and a scrape gets the pages of all the
+ * workers merged by metric family. The board is mapped before the
+ * workers are forked. A page has one writer, readers check its sequence
+ * number before and after they copy it.
+ */
+#ifndef _WIN32
+
+#define METRICS_PAGE_BYTES (4 * 1024 * 1024)	/* Per worker, only what is written takes memory */
+#define METRICS_READ_TRIES 10
+#define METRICS_FAMILIES 256	/* Families merged per page */
+
+typedef struct metrics_page_St
+{
+	unsigned int seq;	/* Odd while the page is written */
+	pid_t pid;		/* Worker that wrote it, 0 before the first page */
+	int len;
+	char text[METRICS_PAGE_BYTES];
+} metrics_page_t;
+
+/* A "# TYPE" line and the samples under it */
+typedef struct metrics_family_St
+{
+	const char *type;
+	int type_len;
+	int name_len;
+	const char *samples;
+	int samples_len;
+	int done;
+} metrics_family_t;
+
+/* A page copied off the board for a scrape */
+typedef struct metrics_copy_St
+{
+	char *text;
+	int len;
+	int families;
+	metrics_family_t family[METRICS_FAMILIES];
+} metrics_copy_t;
+
+static metrics_page_t *metrics_board = NULL;
+static int metrics_board_pages = 0;
+static int metrics_board_warned = 0;
+
+/* Map the board for workers processes, before they are forked */
+int
+metrics_board_init (int workers)
+{
+	size_t size = (size_t) workers * sizeof (metrics_page_t);
+	void *map;
+
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		write_log (LOG_DEFAULT, "WARNING: Could not map the metrics board, metrics are per worker: %s", strerror (errno));
+		return 0;
+	}
+
+	metrics_board = (metrics_page_t *) map;
+	metrics_board_pages = workers;
+	return 1;
+}
+
+/* Copy text to mb with worker="<worker>" added to the labels of every sample */
+static void
+metrics_add_worker (metrics_buf_t *mb, const char *text, int len, int worker)
+{
+	const char *line = text, *end = text + len, *next, *brace;
+
+	while (line < end) {
+		next = memchr (line, '\n', end - line);
+		next = next ? next + 1 : end;
+
+		if (*line == '#') {
+			mb_printf (mb, "%.*s", (int) (next - line), line);
+		} else {
+			for (brace = line; brace < next && *brace != '{' && *brace != ' '; brace++)
+				;
+			if (brace < next && *brace == '{')
+				mb_printf (mb, "%.*sworker=\"%d\"%s%.*s", (int) (brace + 1 - line), line, worker,
+					   brace[1] == '}' ? "" : ",", (int) (next - brace - 1), brace + 1);
+			else
+				mb_printf (mb, "%.*s{worker=\"%d\"}%.*s", (int) (brace - line), line, worker,
+					   (int) (next - brace), brace);
+		}
+
+		line = next;
+	}
+}
+
+/* Put this worker's page on the board */
+static void
+metrics_board_publish (const char *text, int len)
+{
+	metrics_page_t *page = &metrics_board[info.worker_id];
+	metrics_buf_t mb;
+	const char *fam, *next;
+
+	mb.size = len + len / 4 + 1024;
+	mb.len = 0;
+	mb.text = (char *) nmalloc (mb.size);
+
+	metrics_add_worker (&mb, text, len, info.worker_id);
+
+	/* Too many mounts for the page, leave off whole families at the end */
+	if (mb.len > METRICS_PAGE_BYTES) {
+		int keep = 0;
+
+		for (fam = mb.text; (next = strstr (fam + 1, "\n# TYPE ")) && next + 1 - mb.text <= METRICS_PAGE_BYTES; fam = next)
+			keep = next + 1 - mb.text;
+		mb.len = keep;
+
+		if (!metrics_board_warned) {
+			write_log (LOG_DEFAULT, "WARNING: Metrics page too big for the board, leaving off what doesn't fit");
+			metrics_board_warned = 1;
+		}
+	}
+
+	ice_atomic_store (&page->seq, page->seq + 1);
+	ice_atomic_fence ();
+	memcpy (page->text, mb.text, mb.len);
+	page->len = mb.len;
+	page->pid = getpid ();
+	ice_atomic_fence ();
+	ice_atomic_store (&page->seq, page->seq + 1);
+
+	nfree (mb.text);
+}
+
+/* Copy the page of a live worker, returns its length or 0 */
+static int
+metrics_board_read (metrics_page_t *page, char **text)
+{
+	unsigned int seq;
+	int tries, len;
+	pid_t pid;
+
+	for (tries = 0; tries < METRICS_READ_TRIES; tries++) {
+		if ((seq = ice_atomic_load (&page->seq)) & 1) {
+			my_sleep (1000);
+			continue;
+		}
+
+		pid = page->pid;
+		len = page->len;
+		if (pid <= 0 || len <= 0 || len > METRICS_PAGE_BYTES || (kill (pid, 0) != 0 && errno == ESRCH))
+			return 0;
+
+		*text = (char *) nmalloc (len);
+		memcpy (*text, page->text, len);
+		ice_atomic_fence ();
+
+		if (ice_atomic_load (&page->seq) == seq)
+			return len;
+
+		nfree (*text);
+	}
+
+	return 0;
+}
+
+/* Split a page into its families, returns how many */
+static int
+metrics_split_families (const char *text, int len, metrics_family_t *fam, int max)
+{
+	const char *line = text, *end = text + len, *next;
+	int num = 0;
+
+	while (line < end) {
+		next = memchr (line, '\n', end - line);
+		next = next ? next + 1 : end;
+
+		if (next - line > 7 && strncmp (line, "# TYPE ", 7) == 0 && num < max) {
+			const char *name = line + 7;
+
+			fam[num].type = line;
+			fam[num].type_len = next - line;
+			for (fam[num].name_len = 0; name + fam[num].name_len < next && name[fam[num].name_len] != ' ';)
+				fam[num].name_len++;
+			fam[num].samples = next;
+			fam[num].samples_len = 0;
+			fam[num].done = 0;
+			num++;
+		} else if (num > 0 && *line != '#') {
+			fam[num - 1].samples_len = next - fam[num - 1].samples;
+		}
+
+		line = next;
+	}
+
+	return num;
+}
+
+static int
+metrics_same_family (metrics_family_t *a, metrics_family_t *b)
+{
+	return a->name_len == b->name_len && strncmp (a->type + 7, b->type + 7, a->name_len) == 0;
+}
+
+/*
+ * Answer a scrape with the pages of all workers. Each family keeps one
+ * TYPE line, with the samples of every worker under it.
+ */
+static void
+metrics_serve_board (connection_t *con)
+{
+	metrics_copy_t *copy;
+	metrics_buf_t mb;
+	int pages = 0, total = 0, i, j, p, q;
+
+	copy = (metrics_copy_t *) nmalloc (metrics_board_pages * sizeof (metrics_copy_t));
+
+	for (i = 0; i < metrics_board_pages; i++) {
+		metrics_copy_t *c = &copy[pages];
+
+		if ((c->len = metrics_board_read (&metrics_board[i], &c->text)) > 0) {
+			c->families = metrics_split_families (c->text, c->len, c->family, METRICS_FAMILIES);
+			total += c->len;
+			pages++;
+		}
+	}
+
+	if (pages == 0) {
+		nfree (copy);
+		write_http_header (con->sock, 503, "Service Unavailable");
+		sock_write_line (con->sock, "Connection: close\r\n");
+		return;
+	}
+
+	mb.size = total + 1;
+	mb.len = 0;
+	mb.text = (char *) nmalloc (mb.size);
+
+	for (p = 0; p < pages; p++) {
+		for (i = 0; i < copy[p].families; i++) {
+			metrics_family_t *f = &copy[p].family[i];
+
+			if (f->done)
+				continue;
+
+			mb_printf (&mb, "%.*s", f->type_len, f->type);
+
+			/* The workers run the same code, the family is usually at the same index */
+			for (q = p; q < pages; q++) {
+				for (j = 0; j < copy[q].families; j++) {
+					metrics_family_t *g = &copy[q].family[(i + j) % copy[q].families];
+
+					if (!g->done && metrics_same_family (f, g)) {
+						mb_printf (&mb, "%.*s", g->samples_len, g->samples);
+						g->done = 1;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	write_http_header (con->sock, 200, "OK");
+	sock_write_line (con->sock, "Content-Type: text/plain; version=0.0.4");
+	sock_write_line (con->sock, "Content-Length: %d", mb.len);
+	sock_write_line (con->sock, "Connection: close\r\n");
+	sock_write_bytes (con->sock, mb.text, mb.len);
+
+	nfree (mb.text);
+	for (p = 0; p < pages; p++) {
+		nfree (copy[p].text);
+	}
+	nfree (copy);
+}
+
+#else
+
+int
+metrics_board_init (int workers)
+{
+	return 0;
+}
+
+#endif
+
+/*
+ * Render a new snapshot and publish it. Called by the calendar thread.
+ */
+void
+metrics_update ()
+{
+	metrics_snapshot_t *snap, *old;
+	metrics_buf_t mb;
+	statistics_t totals;
+	char reason[BUFSIZE];
+	int i;
+
+	mb.size = 16384;
+	mb.len = 0;
+	mb.text = (char *) nmalloc (mb.size);
+
+	sum_stat_shards (&totals);
+
+	mb_printf (&mb, "# TYPE ntripcaster_info gauge\n");
+	mb_printf (&mb, "ntripcaster_info{version=\"%s\",ntrip_version=\"%s\"} 1\n", info.version, info.ntrip_version);
+	mb_printf (&mb, "# TYPE ntripcaster_uptime_seconds gauge\n");
+	mb_printf (&mb, "ntripcaster_uptime_seconds %ld\n", get_time () - info.server_start_time);
+	mb_printf (&mb, "# TYPE ntripcaster_clients gauge\n");
+	mb_printf (&mb, "ntripcaster_clients %lu\n", info.num_clients);
+	mb_printf (&mb, "# TYPE ntripcaster_sources gauge\n");
+	mb_printf (&mb, "ntripcaster_sources %lu\n", info.num_sources);
+	mb_printf (&mb, "# TYPE ntripcaster_bytes_read_total counter\n");
+	mb_printf (&mb, "ntripcaster_bytes_read_total %lu\n", totals.read_bytes);
+	mb_printf (&mb, "# TYPE ntripcaster_bytes_written_total counter\n");
+	mb_printf (&mb, "ntripcaster_bytes_written_total %lu\n", totals.write_bytes);
+	mb_printf (&mb, "# TYPE ntripcaster_client_connections_total counter\n");
+	mb_printf (&mb, "ntripcaster_client_connections_total %lu\n", totals.client_connections);
+	mb_printf (&mb, "# TYPE ntripcaster_source_connections_total counter\n");
+	mb_printf (&mb, "ntripcaster_source_connections_total %lu\n", totals.source_connections);
+	mb_printf (&mb, "# TYPE ntripcaster_log_dropped_total counter\n");
+	mb_printf (&mb, "ntripcaster_log_dropped_total %lu\n", log_dropped_records ());
+
+	metrics_render_slabs (&mb);
+	metrics_render_locks (&mb);
+	metrics_render_admission (&mb);
+	metrics_render_tls (&mb);
+
+	mb_printf (&mb, "# TYPE ntripcaster_kicks_total counter\n");
+	for (i = 0; i < KICK_MAX; i++)
+		mb_printf (&mb, "ntripcaster_kicks_total{reason=\"%s\"} %lu\n",
+			   metrics_label (kick_reason_name (i), reason, BUFSIZE), ice_atomic_load (&metrics_kicks[i]));
+
+	mb_printf (&mb, "# TYPE ntripcaster_login_latency_seconds histogram\n");
+	metrics_histogram (&mb, "ntripcaster_login_latency_seconds", "role=\"client\",", &metrics_client_login, 0.000001, 24);
+	metrics_histogram (&mb, "ntripcaster_login_latency_seconds", "role=\"source\",", &metrics_source_login, 0.000001, 24);
+
+	metrics_render_mounts (&mb);
+
+	snap = (metrics_snapshot_t *) nmalloc (sizeof (metrics_snapshot_t));
+	snap->refs = 1;
+	snap->len = mb.len;
+	snap->text = mb.text;
+
+	thread_mutex_lock (&metrics_mutex);
+	old = metrics_current;
+	metrics_current = snap;
+	thread_mutex_unlock (&metrics_mutex);
+
+	if (old)
+		metrics_release (old);
+
+#ifndef _WIN32
+	if (metrics_board)
+		metrics_board_publish (snap->text, snap->len);
+#endif
+}
+
+void
+metrics_timer (time_t stime)
+{
+	int interval = info.metrics_interval > 0 ? info.metrics_interval : DEFAULT_METRICS_INTERVAL;
+
+	if (!info.metrics || stime - metrics_last_update < interval)
+		return;
+
+	metrics_last_update = stime;
+	metrics_update ();
+}
+
+/* Get a reference to the current snapshot, or NULL if there is none */
+metrics_snapshot_t *
+metrics_acquire ()
+{
+	metrics_snapshot_t *snap;
+
+	thread_mutex_lock (&metrics_mutex);
+	if ((snap = metrics_current))
+		ice_atomic_add (&snap->refs, 1);
+	thread_mutex_unlock (&metrics_mutex);
+
+	return snap;
+}
+
+void
+metrics_release (metrics_snapshot_t *snap)
+{
+	if (ice_atomic_sub (&snap->refs, 1) == 0) {
+		nfree (snap->text);
+		nfree (snap);
+	}
+}
+
+/*
+ * Answer a GET /metrics from the last snapshot
+ */
+void
+metrics_serve (connection_t *con)
+{
+	metrics_snapshot_t *snap;
+
+	if (!info.metrics) {
+		write_http_header (con->sock, 404, "Not Found");
+		sock_write_line (con->sock, "Connection: close\r\n");
+		return;
+	}
+
+#ifndef _WIN32
+	if (metrics_board) {
+		metrics_serve_board (con);
+		return;
+	}
+#endif
+
+	if (!(snap = metrics_acquire ())) {
+		write_http_header (con->sock, 503, "Service Unavailable");
+		sock_write_line (con->sock, "Connection: close\r\n");
+		return;
+	}
+
+	write_http_header (con->sock, 200, "OK");
+	sock_write_line (con->sock, "Content-Type: text/plain; version=0.0.4");
+	sock_write_line (con->sock, "Content-Length: %d", snap->len);
+	sock_write_line (con->sock, "Connection: close\r\n");
+	sock_write_bytes (con->sock, snap->text, snap->len);
+
+	metrics_release (snap);
+}
@@ -0,0 +1,75 @@
+/* metrics.h
+ * - Metrics function headers
+ *
+ * Copyright (c) 2003
+ * German Federal Agency for Cartography and Geodesy (BKG)
+ *
+ * Developed for Networked Transport of RTCM via Internet Protocol (NTRIP)
+ * for streaming GNSS data over the Internet.
+ *
+ * Designed by Informatik Centrum Dortmund http://www.icd.de
+ *
+ * NTRIP is currently an experimental technology.
+ * The BKG disclaims any liability nor responsibility to any person or entity
+ * with respect to any loss or damage caused, or alleged to be caused,
+ * directly or indirectly by the use and application of the NTRIP technology.
+ *
+ * For latest information and updates, access:
+ * http://igs.ifag.de/index_ntrip.htm
+ *
+ * Georg Weber
+ * BKG, Frankfurt, Germany, June 2003-06-13
+ * E-mail: euref-ip@bkg.bund.de
+ *
+ * Based on the GNU General Public License published Icecast 1.3.12
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __ICECAST_METRICS_H
+#define __ICECAST_METRICS_H
+
+#define DEFAULT_METRICS_INTERVAL 5	/* Seconds between snapshots */
+#define INGEST_GAP_USEC 5000000		/* A source silent this long has a gap */
+
+/* A rendered /metrics page. Scrapes hold a reference while they write it,
+ * so they never need anything but metrics_mutex. */
+typedef struct metrics_snapshot_St
+{
+	int refs;
+	int len;
+	char *text;
+} metrics_snapshot_t;
+
+void metrics_init ();
+void metrics_timer (time_t stime);
+void metrics_update ();
+metrics_snapshot_t *metrics_acquire ();
+void metrics_release (metrics_snapshot_t *snap);
+void metrics_serve (connection_t *con);
+int metrics_board_init (int workers);
+void metrics_kick (const char *reason);
+void metrics_login_done (connection_t *con);
+void metrics_ingest (source_t *source);
+
+void latency_add (latency_hist_t *h, unsigned long int usecs);
+unsigned long int latency_percentile (latency_hist_t *h, double percentile);
+void latency_log_summary (source_t *source);
+
+int histogram_bucket (unsigned long int value);
+void histogram_add (histogram_t *h, unsigned long int value);
+void histogram_add_atomic (histogram_t *h, unsigned long int value);
+
+#endif
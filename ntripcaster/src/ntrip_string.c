@@ -76,6 +76,8 @@
 #include "utility.h"
 #include "ntrip_string.h"
 #include "sock.h"
+#include "connection.h"
+#define LOG_MODULE LOG_MOD_STRING
 #include "log.h"
 
 /* vars.c. ajd **********************************************************/
@@ -148,6 +150,8 @@ con_host (connection_t *con)
 		return null;
 	}
 
+	resolv_hostname (con);
+
 	if (con->hostname)
 		return con->hostname;
 	else if (con->host)
@@ -281,8 +285,6 @@ mutex_to_string (mutex_t *mutex, char *out)
 		strcpy (out, "Mount Point Mutex");
 	else if (mutex == &info.hostname_mutex)
 		strcpy (out, "Hostname Tree Mutex");
-	else if (mutex == &info.double_mutex)
-		strcpy (out, "Double Mutex Mutex");
 	else if (mutex == &info.thread_mutex)
 		strcpy (out, "Thread Tree Mutex");
 #ifdef DEBUG_MEMORY
@@ -585,42 +587,6 @@ int vsnprintf(char* s, int n, char* fmt, va_list stack)
 
 /* vars.c. ajd **********************************************************************/
 
-vartree_t *
-create_header_vars ()
-{
-	avl_tree *t = avl_create (compare_vars, &info);
-	return t;
-}
-
-void
-extract_header_vars (char *line, vartree_t *vars)
-{
-	char *colonptr;
-	char name[BUFSIZE];
-		
-	if (!line || !vars)
-	{
-		xa_debug (1, "ERROR: extract_header_vars() called with NULL pointers");
-		return;
-	}
-
-	colonptr = strchr (line, ':');
-	if (!colonptr && line[0])
-	{
-		xa_debug (1, "WARNING: Invalid header line [%s] without colon", line);
-		return;
-	}
-	
-	if (splitc (name, line, ':') == NULL)
-	{
-		if (line[0])
-			xa_debug (1, "WARNING: Invalid header line [%s]", line);
-		return;
-	}
-
-	add_varpair2 (vars, nstrdup (clean_string (name)), nstrdup (clean_string (line)));
-}
-
 varpair_t *
 create_varpair ()
 {
@@ -688,15 +654,6 @@ add_varpair (vartree_t *request_vars, char *varpair)
   add_varpair2 (request_vars, nstrdup (name), nstrdup (varpair));
 }
 
-const char *
-get_con_variable (connection_t *con, const char *name)
-{
-	if (!con || !con->headervars)
-		return NULL;
-
-	return (get_variable (con->headervars, name));
-}
-
 const char *
 get_variable (vartree_t *request_vars, const char *name)
 {
@@ -716,15 +673,6 @@ get_variable (vartree_t *request_vars, const char *name)
 	return vp->value;
 }
 
-void
-free_con_variables (connection_t *con)
-{
-	if (!con)
-		return;
-	free_variables (con->headervars);
-	con->headervars = NULL;
-}
-
 void
 free_variables (vartree_t *request_vars)
 {
@@ -754,3 +702,145 @@ free_variables (vartree_t *request_vars)
 	avl_destroy (request_vars, NULL);
 }
 
+/* headers.c. ajd *******************************************************************/
+
+/*
+ * Perfect hash over the headers we look for: (3 * length + first + last) & 15,
+ * lowercased. Every name hashes to its own slot, a match is then confirmed
+ * with one strncasecmp().
+ */
+#define HEADER_HASH(name, len) \
+	((3 * (len) + tolower ((unsigned char) (name)[0]) + tolower ((unsigned char) (name)[(len) - 1])) & 15)
+
+static const struct {
+	const char *name;
+	int id;
+} header_slots[16] = {
+	{ NULL, HDR_UNKNOWN },
+	{ NULL, HDR_UNKNOWN },
+	{ NULL, HDR_UNKNOWN },
+	{ "Ntrip-Version", HDR_NTRIP_VERSION },
+	{ NULL, HDR_UNKNOWN },
+	{ NULL, HDR_UNKNOWN },
+	{ "Authorization", HDR_AUTHORIZATION },
+	{ "User-Agent", HDR_USER_AGENT },
+	{ "Host", HDR_HOST },
+	{ "Referer", HDR_REFERER },
+	{ "Ntrip-GGA", HDR_NTRIP_GGA },
+	{ "Source-Agent", HDR_SOURCE_AGENT },
+	{ "Content-Type", HDR_CONTENT_TYPE },
+	{ NULL, HDR_UNKNOWN },
+	{ "Transfer-Encoding", HDR_TRANSFER_ENCODING },
+	{ "Connection", HDR_CONNECTION }
+};
+
+/* The header_id_t of name, HDR_UNKNOWN if it isn't one we know */
+int
+header_id (const char *name)
+{
+	size_t len = ice_strlen (name);
+	int slot;
+
+	if (len == 0)
+		return HDR_UNKNOWN;
+
+	slot = HEADER_HASH (name, len);
+
+	if (header_slots[slot].name && strlen (header_slots[slot].name) == len
+	    && strncasecmp (header_slots[slot].name, name, len) == 0)
+		return header_slots[slot].id;
+
+	return HDR_UNKNOWN;
+}
+
+/*
+ * Split buf into the request line and header slices, in place. Line ends
+ * and colons are overwritten, nothing is copied or allocated, so buf has
+ * to live as long as con does (it is usually con->request).
+ * Can be called again with more lines. Returns the number of new headers.
+ */
+int
+header_parse (connection_t *con, char *buf)
+{
+	header_table_t *ht;
+	char *line, *next, *colon;
+	int found = 0;
+
+	if (!con || !buf)
+	{
+		xa_debug (1, "ERROR: header_parse() called with NULL pointers");
+		return 0;
+	}
+
+	ht = &con->headers;
+
+	for (line = buf; line && *line; line = next)
+	{
+		if ((next = strchr (line, '\n')))
+			*next++ = '\0';
+
+		if (!ht->request_line)
+		{
+			ht->request_line = line;
+			continue;
+		}
+
+		if (!(colon = strchr (line, ':')))
+		{
+			if (line[0])
+				xa_debug (1, "WARNING: Invalid header line [%s] without colon", line);
+			continue;
+		}
+
+		if (ht->count >= MAX_HEADERS)
+		{
+			xa_debug (1, "WARNING: Too many headers, ignoring [%s]", line);
+			continue;
+		}
+
+		*colon = '\0';
+		ht->hdr[ht->count].name = clean_string (line);
+		ht->hdr[ht->count].value = clean_string (colon + 1);
+		ht->hdr[ht->count].id = header_id (ht->hdr[ht->count].name);
+
+		xa_debug (3, "DEBUG: Header [%s] == [%s]", ht->hdr[ht->count].name, ht->hdr[ht->count].value);
+
+		/* The last one wins, as it did with the variable tree */
+		if (ht->hdr[ht->count].id != HDR_UNKNOWN)
+			ht->known[ht->hdr[ht->count].id] = ht->count + 1;
+
+		ht->count++;
+		found++;
+	}
+
+	return found;
+}
+
+/* Value of a known header, NULL if it wasn't sent */
+const char *
+header_get (connection_t *con, int id)
+{
+	if (!con || id < 0 || id >= HDR_MAX || !con->headers.known[id])
+		return NULL;
+
+	return con->headers.hdr[con->headers.known[id] - 1].value;
+}
+
+/* Value of any header by name, case insensitive */
+const char *
+get_con_variable (connection_t *con, const char *name)
+{
+	int id, i;
+
+	if (!con || !name)
+		return NULL;
+
+	if ((id = header_id (name)) != HDR_UNKNOWN)
+		return header_get (con, id);
+
+	for (i = con->headers.count - 1; i >= 0; i--)
+		if (ice_strcasecmp (con->headers.hdr[i].name, name) == 0)
+			return con->headers.hdr[i].value;
+
+	return NULL;
+}
@@ -75,7 +75,9 @@ void add_varpair (vartree_t *request_vars, char *varpair);
 void add_varpair2 (vartree_t *request_vars, char *name, char *value);
 const char *get_variable (vartree_t *request_vars, const char *name);
 void free_variables (vartree_t *request_vars);
-vartree_t *create_header_vars ();
-void extract_header_vars (char *line, vartree_t *vars);
-void free_con_variables (connection_t *con);
+
+/* headers.h. ajd ***********************************************************/
+int header_id (const char *name);
+int header_parse (connection_t *con, char *buf);
+const char *header_get (connection_t *con, int id);
 const char *get_con_variable (connection_t *con, const char *name);
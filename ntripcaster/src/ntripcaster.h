@@ -72,7 +72,18 @@
 #define DEFAULT_FORCE_SERVERNAME 0
 #define DEFAULT_ICE_ROOT "."
 #define DEFAULT_CLIENT_TIMEOUT 0
+#define DEFAULT_LOGIN_TIMEOUT 30
+#define DEFAULT_CLIENT_IDLE_TIMEOUT 0
+#define DEFAULT_CLIENT_DEAD_TIMEOUT 60
 #define DEFAULT_LOOKUPS 0
+#define DEFAULT_DNS_CACHE_SIZE 4096
+#define DEFAULT_DNS_CACHE_TTL 3600
+#define DEFAULT_DNS_NEGATIVE_TTL 300
+#define DEFAULT_CONNECT_BURST 20
+#define DEFAULT_CONNECT_BAN_TIME 300
+#define DEFAULT_TLS_KTLS 1
+#define DEFAULT_WORKERS 1
+#define DEFAULT_IO_URING 0
 #define DEFAULT_PORT 8000
 
 #ifdef SOMAXCONN
@@ -139,7 +150,7 @@
 
 typedef enum {listener_e = 0, pulling_client_e = 2, unknown_client_e = -1 } client_type_t;
 typedef enum {icy_e = 0 } protocol_t;
-typedef enum {encoder_e = 0, puller_e = 1, on_demand_pull_e = 2, unknown_source_e = -1 } source_type_t;
+typedef enum {encoder_e = 0, puller_e = 1, on_demand_pull_e = 2, bus_e = 3, replica_e = 4, unknown_source_e = -1 } source_type_t;
 typedef enum contype_e {client_e = 0, source_e = 1, unknown_connection_e = 3 } contype_t;
 typedef enum { conf_file_e = 1, log_file_e = 2 } filetype_t;
 typedef enum { linux_gethostbyname_r_e = 1, solaris_gethostbyname_r_e = 2, standard_gethostbyname_e = 3 } resolv_type_t;
@@ -180,6 +191,55 @@ typedef struct varpair_St
 	char *value;
 } varpair_t;
 
+/* Request headers, parsed in place in the connection's request buffer */
+#define MAX_HEADERS 32
+
+typedef enum {
+	HDR_UNKNOWN = -1,
+	HDR_HOST = 0,
+	HDR_USER_AGENT,
+	HDR_AUTHORIZATION,
+	HDR_REFERER,
+	HDR_SOURCE_AGENT,
+	HDR_NTRIP_VERSION,
+	HDR_NTRIP_GGA,
+	HDR_CONNECTION,
+	HDR_TRANSFER_ENCODING,
+	HDR_CONTENT_TYPE,
+	HDR_MAX
+} header_id_t;
+
+typedef struct header_St
+{
+	const char *name;	/* Both point into the request buffer */
+	const char *value;
+	int id;			/* header_id_t */
+} header_t;
+
+typedef struct header_table_St
+{
+	char *request_line;	/* "GET /MOUNT HTTP/1.0" or "SOURCE pass /MOUNT" */
+	int count;
+	unsigned char known[HDR_MAX];	/* Index + 1 into hdr, 0 if not sent */
+	header_t hdr[MAX_HEADERS];
+} header_table_t;
+
+/* Socket options per role, set by sock_apply_policy(). -1 leaves the
+ * system default. */
+typedef enum { SOCK_ROLE_CLIENT = 0, SOCK_ROLE_SOURCE, SOCK_ROLE_RELAY, SOCK_ROLE_MAX } sock_role_t;
+
+typedef struct sock_policy_St
+{
+	int nodelay;		/* TCP_NODELAY */
+	int notsent_lowat;	/* TCP_NOTSENT_LOWAT, bytes */
+	int sndbuf;		/* SO_SNDBUF, bytes */
+	int rcvbuf;		/* SO_RCVBUF, bytes */
+	int keepidle;		/* TCP_KEEPIDLE, seconds */
+	int keepintvl;		/* TCP_KEEPINTVL, seconds */
+	int keepcnt;		/* TCP_KEEPCNT */
+	int user_timeout;	/* TCP_USER_TIMEOUT, milliseconds */
+} sock_policy_t;
+
 typedef struct request_St
 {
 	char path[BUFSIZE];
@@ -194,6 +254,7 @@ typedef struct chunkSt
 	int len;
 	int metalen;
 	int clients_left;
+	long long arrival;	/* get_mono_usec() when the first byte came in */
 } chunk_t;
 
 typedef struct statistics_St
@@ -208,39 +269,103 @@ typedef struct statistics_St
 	unsigned long int source_connect_time; /* Total sum of the time each source has been connected (minutes) */
 } statistics_t;
 
+/* Log2 bucketed histogram, see metrics.c */
+#define HISTOGRAM_BUCKETS 32
+
+typedef struct histogram_St
+{
+	unsigned long int bucket[HISTOGRAM_BUCKETS];	/* Values below 2^i */
+	unsigned long int sum;
+	unsigned long int samples;
+} histogram_t;
+
+/* Latency histogram with LATENCY_SUB_BITS bits of precision per power of
+ * two, values in microseconds. See metrics.c */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_MAX_BITS 32
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+typedef struct latency_hist_St
+{
+	unsigned long int bucket[LATENCY_BUCKETS];
+	unsigned long int samples;
+	unsigned long int sum;
+	unsigned long int max;
+} latency_hist_t;
+
 typedef struct audiocast_St {
 	char *name; //		 Name of Server
 	char *mount;	//	 Name of source
 } audiocast_t;
 
+/* Fan-out state of one client. The source thread walks these densely
+ * and only goes to the connection when something happens to the client. */
+#define CLIENT_SLOT_NEW 1	/* Has no start chunk yet */
+#define CLIENT_SLOT_DEAD 2	/* Kicked, closed on the next kick_dead_clients() */
+
+typedef struct client_slot_St {
+	SOCKET fd;
+	int cid;		/* Chunk the client is on */
+	int offset;		/* Bytes of that chunk already sent */
+	int flags;
+} client_slot_t;
+
+/* Clients of a source, the caller must have the source mutex */
+typedef struct client_set_St {
+	client_slot_t *slot;		/* Hot */
+	struct connectionSt **con;	/* Cold, same index as slot */
+	int count;
+	int size;
+} client_set_t;
+
 typedef struct source_St {
 	int connected;
 	source_type_t type;
 	protocol_t protocol;
 	mutex_t mutex;
 	audiocast_t audiocast;
-	avl_tree *clients;             /* Tree of clients */
+	client_set_t clients;
 	icethread_t thread;              /* Pointer to running thread */
 	statistics_t stats;
 	unsigned long int num_clients;
+	unsigned long int admitted_clients;	/* Held against max_clients_per_source */
 	chunk_t chunk[CHUNKLEN];
 	int cid;
 	int priority;
 	char *source_agent;
+	int handoff;			/* Hand over to a new process, see upgrade_source() */
+	struct uring_St *uring;		/* The source thread's, NULL to send() */
+	int held;			/* Chunks read since the last fan-out pass */
+	struct bus_mount_St *bus;	/* Mount bus slot it publishes to, or mirrors for bus_e */
+	unsigned int bus_gen;		/* Claim of the slot it mirrors */
+	unsigned int bus_next;		/* Next chunk to mirror */
+	time_t bus_idle;		/* Mirror had clients last */
 
+	/* Metrics, only written by the source thread */
+	long long last_ingest;		/* get_mono_usec() of the last chunk */
+	long long max_ingest_gap;
+	unsigned long int ingest_gaps;
+	histogram_t fanout_lag;		/* Chunks clients are behind */
+	latency_hist_t latency;		/* Chunk arrival to client send completion */
 } source_t;
 
 typedef struct client_St {
 	unsigned int use_udp:1;
 	unsigned int use_icy:1;
  	int errors;             /* Used at first to mark position in buf, later to mark error */
-	int offset;
-	int cid;
+	int slot;		/* Index in source->clients, -1 if not in it */
 	int alive;
 	client_type_t type;
 	unsigned long int write_bytes;	/* Number of bytes written to client */
+	unsigned long int idle_bytes;	/* write_bytes at the last idle check */
+	unsigned long int idle_source_bytes;	/* Bytes the source had read at the last idle check */
+	time_t idle_since;
+	unsigned long int acked_bytes;	/* write_bytes the peer had acknowledged at the last sweep */
+	time_t acked_since;		/* When acked_bytes last moved */
 	int virgin;
 	source_t *source;        /* Pointer back to the source */
+	const char *kick_reason;	/* Reason of the first kick */
+	struct connectionSt *reap_next;	/* Reap list, see kick_dead_clients() */
 } client_t;
 
 typedef struct connectionSt {
@@ -253,10 +378,14 @@ typedef struct connectionSt {
 	struct sockaddr_in *sin;
 	mysocklen_t sinlen;
 	SOCKET sock;
+	int tls;		/* Came in on a tls_port */
+	int admitted;		/* Counted by admit_connection(), to release when freed */
 	time_t connect_time;
+	long long connect_usec;	/* get_mono_usec() at accept */
 	char *host;
 	char *hostname;
-	vartree_t *headervars;
+	char request[BUFSIZE];	/* Login request as read, lives as long as the connection */
+	header_table_t headers;
 	char *user;
 } connection_t;
 
@@ -264,6 +393,8 @@ typedef struct {
 	char *runpath;			/* argv[0] */
 	int port[MAXLISTEN];
 	SOCKET listen_sock[MAXLISTEN];	/* Socket to listen to */
+	int tls_port[MAXLISTEN];	/* Ports that speak TLS only */
+	SOCKET tls_listen_sock[MAXLISTEN];
 	char *etcdir;		/* Name of config file directory */
 	char *logdir;
 	avl_tree *sources;
@@ -287,17 +418,40 @@ typedef struct {
 	double bandwidth_usage;
 	double sleep_ratio;
 	int reverse_lookups;
+	int dns_cache_size;		/* Resolver cache entries */
+	int dns_cache_ttl;		/* Seconds to keep an answer */
+	int dns_negative_ttl;		/* Seconds to keep a failed lookup */
+	char *socket_policy[SOCK_ROLE_MAX];	/* Per role socket options, i.e "nodelay:1,sndbuf:65536" */
+	sock_policy_t sock_policy[SOCK_ROLE_MAX];	/* Parsed from socket_policy by sock_update_policies() */
+	char *tls_certificate;		/* PEM certificate chain for the tls_port listeners */
+	char *tls_key;			/* PEM private key, NULL if it's in tls_certificate */
+	char *tls_ciphers;		/* OpenSSL cipher list for TLS 1.2, NULL for its default */
+	int tls_ktls;			/* Hand the record layer to the kernel where it can */
+	int max_connections_per_ip;	/* 0 for no limit */
+	int connect_rate;		/* Connects per minute and address, 0 for no limit */
+	int connect_burst;
+	int connect_ban_time;		/* Seconds */
+	int workers;			/* Processes sharing the ports, read at startup */
+	int worker_id;			/* Number of this worker, 0 for the first process */
+	char *replication_password;	/* Edges log in with it, NULL for no replication */
+	char *replicate_from;		/* host:port of the parent caster, read at startup */
+	char *replicate_password;
+	char *replicate_mounts;		/* Mounts to replicate, comma separated, NULL or * for all */
+	int io_uring;			/* Batch the fan-out sends through io_uring where there is one */
 	int force_servername;
 	int mount_fallback;
 	icethread_t main_thread;
 #ifndef _WIN32
 	pthread_attr_t defaultattr;
 #endif
+	/* Lock order: source_mutex, then one source's mutex, then any of the
+	 * leaf locks (misc, pool, pending, log). Never take source_mutex with
+	 * a source mutex held, and never hold two source mutexes. Streaming
+	 * only ever needs its own source mutex. */
 	mutex_t source_mutex;
 	mutex_t misc_mutex;
 	mutex_t mount_mutex;
 	mutex_t hostname_mutex;
-	mutex_t double_mutex;
 	mutex_t thread_mutex;
 	mutex_t mutex_mutex;
 #ifdef DEBUG_MEMORY
@@ -318,7 +472,6 @@ typedef struct {
 	unsigned long int id;
 	int kick_clients;
 	avl_tree *my_hostnames;
-	statistics_t hourly_stats;
 	statistics_t daily_stats;
 	statistics_t total_stats;
 	char *location;
@@ -326,6 +479,15 @@ typedef struct {
 	char *server_url;
 	int consoledebuglevel;
 	int logfiledebuglevel;
+	char *debug_modules; /* Per module debug levels, i.e "sock:4,source:3" */
+	char *sessionlogfilename; /* Binary session log, NULL for none */
+	int sessionlog;
+	int metrics; /* Serve GET /metrics */
+	int metrics_interval; /* Seconds between metrics snapshots */
+	int login_timeout;	/* Seconds to send the request headers in */
+	int client_idle_timeout; /* Seconds a client may stall, 0 is forever */
+	int client_dead_timeout; /* Seconds a client may leave data unacknowledged, 0 is forever */
+	int lock_profile;	/* Count mutex contention per call site */
 
 	int console_mode;
 
@@ -0,0 +1,229 @@
+/* sessiondump.c
+ * - Converts binary session logs to CSV or JSON
+ *
+ * Copyright (c) 2003
+ * German Federal Agency for Cartography and Geodesy (BKG)
+ *
+ * Developed for Networked Transport of RTCM via Internet Protocol (NTRIP)
+ * for streaming GNSS data over the Internet.
+ *
+ * Designed by Informatik Centrum Dortmund http://www.icd.de
+ *
+ * NTRIP is currently an experimental technology.
+ * The BKG disclaims any liability nor responsibility to any person or entity
+ * with respect to any loss or damage caused, or alleged to be caused,
+ * directly or indirectly by the use and application of the NTRIP technology.
+ *
+ * For latest information and updates, access:
+ * http://igs.ifag.de/index_ntrip.htm
+ *
+ * Georg Weber
+ * BKG, Frankfurt, Germany, June 2003-06-13
+ * E-mail: euref-ip@bkg.bund.de
+ *
+ * Based on the GNU General Public License published Icecast 1.3.12
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include "sessionlog.h"
+
+#define RECORDS_PER_READ 256
+
+typedef enum { csv_e, json_e } format_t;
+
+static const char *session_type_names[] = { "other", "client", "source" };
+
+/* Print s as a CSV field, quoted if need be */
+static void
+print_csv_string (const char *s)
+{
+	if (!strpbrk (s, ",\"\r\n")) {
+		fputs (s, stdout);
+		return;
+	}
+
+	putchar ('"');
+	for (; *s; s++) {
+		if (*s == '"')
+			putchar ('"');
+		putchar (*s);
+	}
+	putchar ('"');
+}
+
+/* Print s as a JSON string */
+static void
+print_json_string (const char *s)
+{
+	putchar ('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf ("\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			printf ("\\u%04x", (unsigned char) *s);
+		else
+			putchar (*s);
+	}
+	putchar ('"');
+}
+
+static void
+format_time (int64_t tt, char *buf, int len)
+{
+	time_t t = (time_t) tt;
+	struct tm *tm = gmtime (&t);
+
+	if (!tm || strftime (buf, len, "%Y-%m-%dT%H:%M:%SZ", tm) == 0)
+		snprintf (buf, len, "%lld", (long long) tt);
+}
+
+static void
+print_record (session_record_t *rec, format_t format)
+{
+	char user[SESSION_USER_LEN + 1], mount[SESSION_MOUNT_LEN + 1];
+	char start[40], end[40], addr[20];
+	struct in_addr in;
+	const char *type = rec->type <= SESSION_SOURCE ? session_type_names[rec->type] : "other";
+	const char *reason = rec->reason < KICK_MAX ? kick_reason_names[rec->reason] : kick_reason_names[KICK_OTHER];
+
+	/* The strings may fill their fields completely */
+	memcpy (user, rec->user, SESSION_USER_LEN);
+	user[SESSION_USER_LEN] = '\0';
+	memcpy (mount, rec->mount, SESSION_MOUNT_LEN);
+	mount[SESSION_MOUNT_LEN] = '\0';
+
+	in.s_addr = rec->addr;
+	snprintf (addr, 20, "%s", inet_ntoa (in));
+
+	format_time (rec->start, start, 40);
+	format_time (rec->end, end, 40);
+
+	if (format == csv_e) {
+		printf ("%llu,%s,%d,%d,", (unsigned long long) rec->id, type, (signed char) rec->role, rec->connected);
+		print_csv_string (user);
+		putchar (',');
+		print_csv_string (mount);
+		printf (",%s,%u,%s,%s,%lld,%llu,%u,", addr, rec->port, start, end,
+			(long long) (rec->end - rec->start), (unsigned long long) rec->bytes, rec->reason);
+		print_csv_string (reason);
+		putchar ('\n');
+	} else {
+		printf ("{\"id\":%llu,\"type\":\"%s\",\"role\":%d,\"connected\":%s,\"user\":",
+			(unsigned long long) rec->id, type, (signed char) rec->role, rec->connected ? "true" : "false");
+		print_json_string (user);
+		printf (",\"mount\":");
+		print_json_string (mount);
+		printf (",\"addr\":\"%s\",\"port\":%u,\"start\":\"%s\",\"end\":\"%s\",\"duration\":%lld,\"bytes\":%llu,\"reason_code\":%u,\"reason\":",
+			addr, rec->port, start, end, (long long) (rec->end - rec->start), (unsigned long long) rec->bytes, rec->reason);
+		print_json_string (reason);
+		printf ("}\n");
+	}
+}
+
+/* Returns 0 on success, -1 if file is not a usable session log */
+static int
+dump_file (const char *file, format_t format)
+{
+	session_log_header_t header;
+	session_record_t recs[RECORDS_PER_READ];
+	size_t i, n;
+	FILE *fp = strcmp (file, "-") == 0 ? stdin : fopen (file, "rb");
+
+	if (!fp) {
+		fprintf (stderr, "sessiondump: Could not open %s\n", file);
+		return -1;
+	}
+
+	if (fread (&header, sizeof (header), 1, fp) != 1 || memcmp (header.magic, SESSION_LOG_MAGIC, 8) != 0) {
+		fprintf (stderr, "sessiondump: %s is not a session log\n", file);
+		goto fail;
+	}
+
+	if (header.byteorder != SESSION_LOG_BYTEORDER || header.record_size != sizeof (session_record_t)) {
+		fprintf (stderr, "sessiondump: %s was written by an incompatible caster (byte order %08x, record size %u)\n",
+			 file, header.byteorder, header.record_size);
+		goto fail;
+	}
+
+	while ((n = fread (recs, sizeof (session_record_t), RECORDS_PER_READ, fp)) > 0)
+		for (i = 0; i < n; i++)
+			print_record (&recs[i], format);
+
+	if (fp != stdin)
+		fclose (fp);
+	return 0;
+
+ fail:
+	if (fp != stdin)
+		fclose (fp);
+	return -1;
+}
+
+static void
+usage ()
+{
+	fprintf (stderr, "Usage: sessiondump [-c|-j] [file...]\n");
+	fprintf (stderr, "  -c  Output CSV (default)\n");
+	fprintf (stderr, "  -j  Output JSON, one object per line\n");
+	fprintf (stderr, "Reads standard input if no file is given\n");
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	format_t format = csv_e;
+	int i, res = 0, files = 0;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp (argv[i], "-c") == 0)
+			format = csv_e;
+		else if (strcmp (argv[i], "-j") == 0)
+			format = json_e;
+		else if (argv[i][0] == '-' && argv[i][1])
+			usage ();
+	}
+
+	if (format == csv_e)
+		printf ("id,type,role,connected,user,mount,addr,port,start,end,duration,bytes,reason_code,reason\n");
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] == '-' && argv[i][1])
+			continue;
+		files++;
+		if (dump_file (argv[i], format) < 0)
+			res = 1;
+	}
+
+	if (!files && dump_file ("-", format) < 0)
+		res = 1;
+
+	return res;
+}
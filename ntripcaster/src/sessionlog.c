@@ -0,0 +1,76 @@
+/* sessionlog.c
+ * - Kick reason names, shared by the caster and sessiondump
+ *
+ * Copyright (c) 2003
+ * German Federal Agency for Cartography and Geodesy (BKG)
+ *
+ * Developed for Networked Transport of RTCM via Internet Protocol (NTRIP)
+ * for streaming GNSS data over the Internet.
+ *
+ * Designed by Informatik Centrum Dortmund http://www.icd.de
+ *
+ * NTRIP is currently an experimental technology.
+ * The BKG disclaims any liability nor responsibility to any person or entity
+ * with respect to any loss or damage caused, or alleged to be caused,
+ * directly or indirectly by the use and application of the NTRIP technology.
+ *
+ * For latest information and updates, access:
+ * http://igs.ifag.de/index_ntrip.htm
+ *
+ * Georg Weber
+ * BKG, Frankfurt, Germany, June 2003-06-13
+ * E-mail: euref-ip@bkg.bund.de
+ *
+ * Based on the GNU General Public License published Icecast 1.3.12
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "sessionlog.h"
+
+const char *kick_reason_names[KICK_MAX] = {
+	"Other",
+	"Server shutting down",
+	"Client signed off",
+	"No Mountpoint supplied",
+	"Bad Password",
+	"Invalid Mount Point",
+	"No NTRIP source",
+	"Server Full (too many streams)",
+	"Client timeout exceeded, removing source",
+	"Lost all clients to new source",
+	"Source signed off (killed itself)",
+	"Source died",
+	"Client cannot sustain sufficient bandwidth",
+	"Too many errors (client not receiving data fast enough)",
+	"Smaller source stream signed off",
+	"Stream ended",
+	"Not authorized",
+	"Sourcetable transferred",
+	"No NTRIP client",
+	"Transfer Sourcetable",
+	"Server Full (too many listeners)",
+	"Socket error",
+	"Invalid header",
+	"Access Denied (tcp wrappers) [generic connection]",
+	"Metrics transferred",
+	"Login timeout",
+	"Client idle timeout",
+	"Request too long",
+	"Dead peer (no ACK progress)",
+	"Peer timed out",
+	"TLS handshake failed",
+	"Handed over to new process"
+};
@@ -0,0 +1,123 @@
+/* sessionlog.h
+ * - Binary session log layout, shared by the caster and sessiondump
+ *
+ * Copyright (c) 2003
+ * German Federal Agency for Cartography and Geodesy (BKG)
+ *
+ * Developed for Networked Transport of RTCM via Internet Protocol (NTRIP)
+ * for streaming GNSS data over the Internet.
+ *
+ * Designed by Informatik Centrum Dortmund http://www.icd.de
+ *
+ * NTRIP is currently an experimental technology.
+ * The BKG disclaims any liability nor responsibility to any person or entity
+ * with respect to any loss or damage caused, or alleged to be caused,
+ * directly or indirectly by the use and application of the NTRIP technology.
+ *
+ * For latest information and updates, access:
+ * http://igs.ifag.de/index_ntrip.htm
+ *
+ * Georg Weber
+ * BKG, Frankfurt, Germany, June 2003-06-13
+ * E-mail: euref-ip@bkg.bund.de
+ *
+ * Based on the GNU General Public License published Icecast 1.3.12
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#ifndef __ICECAST_SESSIONLOG_H
+#define __ICECAST_SESSIONLOG_H
+
+#include <stdint.h>
+
+/* A session log is a session_log_header_t followed by fixed size
+ * session_record_t's, one for every client, source and rejected login,
+ * written when the session ends. All fields are in host byte order,
+ * except addr. */
+
+#define SESSION_LOG_MAGIC "NTRSLOG1"
+#define SESSION_LOG_BYTEORDER 0x01020304
+#define SESSION_USER_LEN 32
+#define SESSION_MOUNT_LEN 64
+
+typedef struct session_log_header_St
+{
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t record_size;
+} session_log_header_t;
+
+typedef enum { SESSION_OTHER = 0, SESSION_CLIENT = 1, SESSION_SOURCE = 2 } session_type_t;
+
+typedef struct session_record_St
+{
+	uint64_t id;
+	int64_t start;		/* Seconds since the epoch */
+	int64_t end;
+	uint64_t bytes;		/* Written to a client, read from a source */
+	uint32_t addr;		/* IPv4, network byte order */
+	uint16_t port;
+	uint8_t type;		/* session_type_t */
+	uint8_t role;		/* client_type_t or source_type_t */
+	uint16_t reason;	/* kick_reason_t */
+	uint8_t connected;	/* 0 if the login was rejected */
+	uint8_t reserved[5];
+	char user[SESSION_USER_LEN];
+	char mount[SESSION_MOUNT_LEN];
+} session_record_t;
+
+/* Kick reasons. The strings are what is passed to kick_connection() and
+ * kick_not_connected(), add new ones at the end. */
+typedef enum {
+	KICK_OTHER = 0,
+	KICK_SHUTDOWN,
+	KICK_CLIENT_SIGNED_OFF,
+	KICK_NO_MOUNT,
+	KICK_BAD_PASSWORD,
+	KICK_INVALID_MOUNT,
+	KICK_NO_NTRIP_SOURCE,
+	KICK_TOO_MANY_STREAMS,
+	KICK_SOURCE_TIMEOUT,
+	KICK_LOST_CLIENTS,
+	KICK_SOURCE_SIGNED_OFF,
+	KICK_SOURCE_DIED,
+	KICK_BANDWIDTH,
+	KICK_TOO_MANY_ERRORS,
+	KICK_SMALLER_STREAM,
+	KICK_STREAM_ENDED,
+	KICK_NOT_AUTHORIZED,
+	KICK_SOURCETABLE,
+	KICK_NO_NTRIP_CLIENT,
+	KICK_TRANSFER_SOURCETABLE,
+	KICK_TOO_MANY_LISTENERS,
+	KICK_SOCKET_ERROR,
+	KICK_INVALID_HEADER,
+	KICK_ACCESS_DENIED,
+	KICK_METRICS,
+	KICK_LOGIN_TIMEOUT,
+	KICK_CLIENT_IDLE,
+	KICK_REQUEST_TOO_LONG,
+	KICK_DEAD_PEER,
+	KICK_PEER_TIMED_OUT,
+	KICK_TLS_HANDSHAKE,
+	KICK_HANDED_OVER,
+	KICK_MAX
+} kick_reason_t;
+
+/* Log text of every kick reason, indexed by kick_reason_t */
+extern const char *kick_reason_names[KICK_MAX];
+
+#endif
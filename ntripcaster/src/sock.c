@@ -51,6 +51,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #include "definitions.h"
 
@@ -72,6 +73,19 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
 #else
 #include <winsock.h>
 #include <io.h>
@@ -88,11 +102,17 @@ int allow_severity = LOG_INFO;
 int deny_severity = LOG_WARNING;
 #endif
 
+#ifdef HAVE_OPENSSL
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+#endif
+
 #include "avl.h"
 #include "threads.h"
 #include "ntripcaster.h"
 #include "sock.h"
 #include "connection.h"
+#define LOG_MODULE LOG_MOD_SOCK
 #include "log.h"
 #include "main.h"
 #include "utility.h"
@@ -113,6 +133,8 @@ extern struct in_addr localaddr;
 	avl_tree *sock_sockets;
 #endif
 
+static int sock_send (SOCKET sockfd, const char *buff, int len);
+
 #if defined(_WIN32) || !defined(HAVE_INET_ATON)
 
 int inet_aton(const char *s, struct in_addr *a)
@@ -221,6 +243,170 @@ int sock_set_no_linger(SOCKET sockfd)
 }
 #endif
 
+/* Settings of sock_policy_t, by name */
+typedef struct sock_policy_option_St
+{
+	const char *name;
+	size_t offset;
+} sock_policy_option_t;
+
+static const sock_policy_option_t sock_policy_options[] = {
+	{ "nodelay", offsetof (sock_policy_t, nodelay) },
+	{ "notsent_lowat", offsetof (sock_policy_t, notsent_lowat) },
+	{ "sndbuf", offsetof (sock_policy_t, sndbuf) },
+	{ "rcvbuf", offsetof (sock_policy_t, rcvbuf) },
+	{ "keepidle", offsetof (sock_policy_t, keepidle) },
+	{ "keepintvl", offsetof (sock_policy_t, keepintvl) },
+	{ "keepcnt", offsetof (sock_policy_t, keepcnt) },
+	{ "user_timeout", offsetof (sock_policy_t, user_timeout) },
+	{ NULL, 0 }
+};
+static const char *sock_role_names[SOCK_ROLE_MAX] = { "client", "source", "relay" };
+
+/*
+ * Set up info.sock_policy from the built in defaults and the
+ * "socket_client", "socket_source" and "socket_relay" settings,
+ * i.e "nodelay:1,notsent_lowat:16384,user_timeout:30000".
+ * Each policy is built aside and stored whole, so a rehash never shows
+ * sock_apply_policy() a half filled one.
+ */
+void
+sock_update_policies ()
+{
+	char *options, *name, *next, *value;
+	int role, i;
+
+	for (role = 0; role < SOCK_ROLE_MAX; role++) {
+		sock_policy_t policy;
+
+		/* Small messages that should leave at once, and a send queue
+		   short enough for client_errors() to notice slow readers */
+		memset (&policy, -1, sizeof (sock_policy_t));
+		policy.nodelay = 1;
+		if (role != SOCK_ROLE_SOURCE)
+			policy.notsent_lowat = 16384;
+
+		/* Let the kernel give up on vanished clients about as soon as
+		   the sweep would, also while their mount is quiet */
+		if (role != SOCK_ROLE_SOURCE && info.client_dead_timeout > 0) {
+			policy.user_timeout = info.client_dead_timeout * 1000;
+			policy.keepidle = info.client_dead_timeout / 2 > 0 ? info.client_dead_timeout / 2 : 1;
+			policy.keepintvl = info.client_dead_timeout / 6 > 0 ? info.client_dead_timeout / 6 : 1;
+			policy.keepcnt = 3;
+		}
+#ifdef _WIN32
+		if (role != SOCK_ROLE_SOURCE)
+			policy.sndbuf = 16384;
+#endif
+
+		if (!info.socket_policy[role]) {
+			info.sock_policy[role] = policy;
+			continue;
+		}
+
+		options = nstrdup (info.socket_policy[role]);
+
+		for (name = strtok_r (options, ", ", &next); name; name = strtok_r (NULL, ", ", &next)) {
+			if (!(value = strchr (name, ':'))) {
+				write_log (LOG_DEFAULT, "WARNING: No value given for %s socket option %s", sock_role_names[role], name);
+				continue;
+			}
+
+			*value++ = '\0';
+
+			for (i = 0; sock_policy_options[i].name; i++)
+				if (ice_strcmp (name, sock_policy_options[i].name) == 0)
+					break;
+
+			if (sock_policy_options[i].name)
+				*(int *) ((char *) &policy + sock_policy_options[i].offset) = atoi (value);
+			else
+				write_log (LOG_DEFAULT, "WARNING: Unknown %s socket option %s", sock_role_names[role], name);
+		}
+
+		nfree (options);
+		info.sock_policy[role] = policy;
+	}
+}
+
+static void
+sock_set_option (SOCKET sockfd, int level, int option, int value, const char *name)
+{
+	if (value < 0)
+		return;
+
+	if (setsockopt (sockfd, level, option, (void *) &value, sizeof (int)) == -1)
+		xa_debug (1, "WARNING: Setting %s to %d on socket %d failed [%d:%s]", name, value, sockfd, errno, strerror (errno));
+}
+
+/*
+ * Set the socket options of role on sockfd, once it's known what the
+ * connection is. Everything not in the policy is left alone.
+ */
+void
+sock_apply_policy (SOCKET sockfd, sock_role_t role)
+{
+	sock_policy_t policy = info.sock_policy[role];
+
+	xa_debug (3, "DEBUG: Applying %s socket policy to socket %d", sock_role_names[role], sockfd);
+
+	sock_set_option (sockfd, IPPROTO_TCP, TCP_NODELAY, policy.nodelay, "TCP_NODELAY");
+#ifdef TCP_NOTSENT_LOWAT
+	sock_set_option (sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, policy.notsent_lowat, "TCP_NOTSENT_LOWAT");
+#endif
+	sock_set_option (sockfd, SOL_SOCKET, SO_SNDBUF, policy.sndbuf, "SO_SNDBUF");
+	sock_set_option (sockfd, SOL_SOCKET, SO_RCVBUF, policy.rcvbuf, "SO_RCVBUF");
+#ifdef TCP_KEEPIDLE
+	sock_set_option (sockfd, IPPROTO_TCP, TCP_KEEPIDLE, policy.keepidle, "TCP_KEEPIDLE");
+#endif
+#ifdef TCP_KEEPINTVL
+	sock_set_option (sockfd, IPPROTO_TCP, TCP_KEEPINTVL, policy.keepintvl, "TCP_KEEPINTVL");
+#endif
+#ifdef TCP_KEEPCNT
+	sock_set_option (sockfd, IPPROTO_TCP, TCP_KEEPCNT, policy.keepcnt, "TCP_KEEPCNT");
+#endif
+#ifdef TCP_USER_TIMEOUT
+	sock_set_option (sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, policy.user_timeout, "TCP_USER_TIMEOUT");
+#endif
+}
+
+/*
+ * Bytes written to sockfd that the peer hasn't acknowledged yet,
+ * or -1 if the system can't tell.
+ */
+int
+sock_unacked (SOCKET sockfd)
+{
+#if defined(SIOCOUTQ) || defined(TIOCOUTQ)
+	int pending = 0;
+
+# ifdef SIOCOUTQ
+	if (ioctl (sockfd, SIOCOUTQ, &pending) == 0)
+# else
+	if (ioctl (sockfd, TIOCOUTQ, &pending) == 0)
+# endif
+		return pending;
+#endif
+	return -1;
+}
+
+/*
+ * Milliseconds since the peer last acknowledged anything on sockfd,
+ * window probes included, or -1 if the system can't tell.
+ */
+long
+sock_last_ack_msecs (SOCKET sockfd)
+{
+#if defined(TCP_INFO) && defined(__linux__)
+	struct tcp_info ti;
+	socklen_t len = sizeof (ti);
+
+	if (getsockopt (sockfd, IPPROTO_TCP, TCP_INFO, (void *) &ti, &len) == 0)
+		return (long) ti.tcpi_last_ack_recv;
+#endif
+	return -1;
+}
+
 /* 
  * Set or the socket to blocking or nonblocking. 
  * Assert Class: 1 
@@ -428,6 +614,8 @@ int sock_close(SOCKET sockfd)
 	sock_del (sockfd);
 #endif
 
+	tls_close (sockfd);
+
 #ifdef _WIN32
 	if (sockfd > 1)	
 		return closesocket(sockfd);
@@ -438,6 +626,23 @@ int sock_close(SOCKET sockfd)
 #endif
 }
 
+/*
+ * Make the thread that uses sockfd see it as closed, so it closes it
+ * itself. Closing it from another thread would free its TLS session
+ * under a read or write in progress, and the number could be reused.
+ */
+int
+sock_shutdown (SOCKET sockfd)
+{
+	xa_debug (4, "DEBUG: sock_shutdown: Shutting down socket %d", sockfd);
+
+#ifdef _WIN32
+	return shutdown (sockfd, SD_BOTH);
+#else
+	return shutdown (sockfd, SHUT_RDWR);
+#endif
+}
+
 /* 
  * Write len bytes from buff to the client. Kick him on network errors.
  * Return the number of bytes written and -1 on error.
@@ -479,7 +684,8 @@ sock_write_bytes_or_kick(SOCKET sockfd, connection_t * clicon,
 			 res, err);
 
 		if (!is_recoverable(errno)) {
-			kick_connection(clicon, "Client signed off");
+			/* TCP_USER_TIMEOUT or the keepalive probes gave up on it */
+			kick_connection(clicon, err == ETIMEDOUT ? "Peer timed out" : "Client signed off");
 			return -1;
 		}
 	}
@@ -510,7 +716,7 @@ int sock_write_bytes(SOCKET sockfd, const char *buff, int len)
 	}
 
 	for(t=0 ; len > 0 ; ) {
-		int n=send(sockfd, buff+t, len, 0);
+		int n=sock_send(sockfd, buff+t, len);
 		
 		if (n < 0)
 		    return (t == 0) ? n : t;
@@ -552,8 +758,8 @@ int sock_write_string(SOCKET sockfd, const char *buff)
 	} else {
 		while (write_bytes < len) {
 			res =
-				send(sockfd, &buff[write_bytes],
-				     len - write_bytes, 0);
+				sock_send(sockfd, &buff[write_bytes],
+					  len - write_bytes);
 			if (res < 0 && !is_recoverable(errno))
 				return 0;
 			if (res > 0)
@@ -631,7 +837,7 @@ int sock_read_lines_np(SOCKET sockfd, char *buff, const int len)
 	errno = 0;
 #endif
 
-	read_bytes = recv(sockfd, &c, 1, 0);
+	read_bytes = sock_recv(sockfd, &c, 1, 0);
 
 	if (read_bytes < 0) {
 		xa_debug(1, "DEBUG: Socket error on socket %d %d", sockfd,
@@ -650,7 +856,7 @@ int sock_read_lines_np(SOCKET sockfd, char *buff, const int len)
 #else
 		errno = 0;
 #endif
-		read_bytes = recv(sockfd, &c, 1, 0);
+		read_bytes = sock_recv(sockfd, &c, 1, 0);
 		if (read_bytes < 0) {
 			xa_debug(1, "DEBUG: Socket error on socket %d %d",
 				 sockfd, errno);
@@ -693,7 +899,7 @@ int sock_read_lines(SOCKET sockfd, char *buff, const int len)
 	errno = 0;
 #endif
 
-	read_bytes = recv(sockfd, &c[0], 1, 0);
+	read_bytes = sock_recv(sockfd, &c[0], 1, 0);
 
 	if (read_bytes < 0) {
 		xa_debug(1, "DEBUG: Socket error on socket %d %d", sockfd,
@@ -712,7 +918,7 @@ int sock_read_lines(SOCKET sockfd, char *buff, const int len)
 #else
 		errno = 0;
 #endif
-		read_bytes = recv(sockfd, &c[0], 1, 0);
+		read_bytes = sock_recv(sockfd, &c[0], 1, 0);
 		if (read_bytes < 0) {
 			xa_debug(1, "DEBUG: Socket error on socket %d %d",
 				 sockfd, errno);
@@ -769,6 +975,11 @@ SOCKET sock_get_server_socket(const int port)
 		     sizeof (tmp)) != 0)
 			write_log(LOG_DEFAULT,
 				  "ERROR: setsockopt() failed to set SO_REUSEADDR flag. (mostly harmless)");
+#ifdef SO_REUSEPORT
+		/* Every worker has a socket of its own on the port */
+		if (info.workers > 1 && setsockopt (sockfd, SOL_SOCKET, SO_REUSEPORT, (const void *) &tmp, sizeof (tmp)) != 0)
+			write_log(LOG_DEFAULT, "ERROR: setsockopt() failed to set SO_REUSEPORT, the workers can't share port %d", port);
+#endif
 	}
 #endif
 
@@ -1078,3 +1289,586 @@ char *sock_get_local_ipaddress()
 	return nstrdup("dynamic");
 #endif
 }
+
+/* tls.c. ajd *******************************************************************/
+
+/*
+ * TLS for the tls_port listeners. The login thread runs the handshake
+ * with tls_handshake(), after that the session is looked up by socket
+ * in every sock_* read and write, so nothing above this layer needs to
+ * know. With kernel TLS the kernel holds the record keys once the
+ * handshake is done and writes go out with a plain send(), without an
+ * extra copy per client. A session is only ever used by one thread at a
+ * time, as the connection is handed on from the login thread to its
+ * handler and on to the source thread.
+ */
+#ifdef HAVE_OPENSSL
+
+typedef struct tls_session_St
+{
+	SSL *ssl;
+	int ktls_send;		/* The kernel encrypts, send() directly */
+	int ktls_recv;
+} tls_session_t;
+
+static SSL_CTX *tls_ctx = NULL;
+static tls_session_t **tls_sessions = NULL;	/* Indexed by socket */
+static int tls_sessions_size = 0;
+static tls_stats_t tls_stats;
+
+/* Log what OpenSSL has queued up for this thread */
+static void
+tls_log_errors (const char *what)
+{
+	unsigned long err;
+	char buf[256];
+
+	while ((err = ERR_get_error ()) != 0) {
+		ERR_error_string_n (err, buf, sizeof (buf));
+		write_log (LOG_DEFAULT, "ERROR: %s: %s", what, buf);
+	}
+}
+
+int
+tls_init ()
+{
+	struct rlimit rl;
+	long options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+
+	if (tls_ctx)
+		return 1;
+
+	if (!info.tls_certificate) {
+		write_log (LOG_DEFAULT, "ERROR: tls_port needs a tls_certificate");
+		return 0;
+	}
+
+	tls_ctx = SSL_CTX_new (TLS_server_method ());
+	if (!tls_ctx) {
+		tls_log_errors ("Cannot create the TLS context");
+		return 0;
+	}
+
+	SSL_CTX_set_min_proto_version (tls_ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	/* Rovers just hang up, that's a close and not an error */
+	options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+	if (info.tls_ktls)
+		options |= SSL_OP_ENABLE_KTLS;
+#endif
+	SSL_CTX_set_options (tls_ctx, options);
+	/* The fan-out retries a short write from where the chunk is now */
+	SSL_CTX_set_mode (tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	if (info.tls_ciphers && SSL_CTX_set_cipher_list (tls_ctx, info.tls_ciphers) != 1) {
+		tls_log_errors ("Bad tls_ciphers");
+		goto fail;
+	}
+
+	if (SSL_CTX_use_certificate_chain_file (tls_ctx, info.tls_certificate) != 1) {
+		tls_log_errors (info.tls_certificate);
+		goto fail;
+	}
+
+	if (SSL_CTX_use_PrivateKey_file (tls_ctx, info.tls_key ? info.tls_key : info.tls_certificate, SSL_FILETYPE_PEM) != 1
+	    || SSL_CTX_check_private_key (tls_ctx) != 1) {
+		tls_log_errors (info.tls_key ? info.tls_key : info.tls_certificate);
+		goto fail;
+	}
+
+	if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < 1048576)
+		tls_sessions_size = (int) rl.rlim_cur;
+	else
+		tls_sessions_size = 65536;
+
+	tls_sessions = (tls_session_t **) nmalloc (tls_sessions_size * sizeof (tls_session_t *));
+	memset (tls_sessions, 0, tls_sessions_size * sizeof (tls_session_t *));
+	memset (&tls_stats, 0, sizeof (tls_stats));
+
+	return 1;
+
+ fail:
+	SSL_CTX_free (tls_ctx);
+	tls_ctx = NULL;
+	return 0;
+}
+
+static tls_session_t *
+tls_session (SOCKET sockfd)
+{
+	if (!tls_sessions || sockfd < 0 || sockfd >= tls_sessions_size)
+		return NULL;
+	return ice_atomic_load (&tls_sessions[sockfd]);
+}
+
+/* Turn the result of a failed SSL call into what recv() and send() would say */
+static int
+tls_result (tls_session_t *ts, int ret)
+{
+	switch (SSL_get_error (ts->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0 || is_recoverable (errno))
+				errno = ECONNRESET;
+			return -1;
+		default:
+			ERR_clear_error ();
+			errno = ECONNRESET;
+			return -1;
+	}
+}
+
+int
+tls_start (SOCKET sockfd)
+{
+	tls_session_t *ts;
+
+	if (!tls_ctx || sockfd < 0 || sockfd >= tls_sessions_size)
+		return 0;
+
+	ts = (tls_session_t *) nmalloc (sizeof (tls_session_t));
+	ts->ssl = SSL_new (tls_ctx);
+	ts->ktls_send = ts->ktls_recv = 0;
+
+	if (!ts->ssl || SSL_set_fd (ts->ssl, sockfd) != 1) {
+		tls_log_errors ("Cannot start a TLS session");
+		if (ts->ssl)
+			SSL_free (ts->ssl);
+		nfree (ts);
+		return 0;
+	}
+
+	SSL_set_accept_state (ts->ssl);
+	ice_atomic_store (&tls_sessions[sockfd], ts);
+	return 1;
+}
+
+/*
+ * Take the handshake as far as the socket allows. Returns 1 once it's
+ * done, 0 while it has to wait for *events on the socket and -1 if it
+ * failed.
+ */
+int
+tls_handshake (SOCKET sockfd, short *events)
+{
+	tls_session_t *ts = tls_session (sockfd);
+	int ret;
+
+	if (!ts)
+		return -1;
+
+	ERR_clear_error ();
+	ret = SSL_do_handshake (ts->ssl);
+
+	if (ret == 1) {
+		ts->ktls_send = BIO_get_ktls_send (SSL_get_wbio (ts->ssl)) > 0;
+		ts->ktls_recv = BIO_get_ktls_recv (SSL_get_rbio (ts->ssl)) > 0;
+		ice_atomic_add (&tls_stats.handshakes, 1);
+		if (ts->ktls_send)
+			ice_atomic_add (&tls_stats.ktls_send, 1);
+		if (ts->ktls_recv)
+			ice_atomic_add (&tls_stats.ktls_recv, 1);
+		xa_debug (2, "DEBUG: TLS on socket %d with %s %s, kernel TLS send %d receive %d", sockfd,
+			  SSL_get_version (ts->ssl), SSL_get_cipher_name (ts->ssl), ts->ktls_send, ts->ktls_recv);
+		return 1;
+	}
+
+	switch (SSL_get_error (ts->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			*events = POLLIN;
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			*events = POLLOUT;
+			return 0;
+		default:
+			ice_atomic_add (&tls_stats.failures, 1);
+			if (info.logfiledebuglevel >= 2)
+				tls_log_errors ("TLS handshake");
+			else
+				ERR_clear_error ();
+			return -1;
+	}
+}
+
+/* Drop the session of sockfd, the socket is about to be closed */
+void
+tls_close (SOCKET sockfd)
+{
+	tls_session_t *ts = tls_session (sockfd);
+
+	if (!ts)
+		return;
+
+	ice_atomic_store (&tls_sessions[sockfd], NULL);
+
+	/* A close_notify if it fits, never wait for the peer's */
+	if (SSL_is_init_finished (ts->ssl)) {
+		sock_set_blocking (sockfd, SOCK_NONBLOCK);
+		ERR_clear_error ();
+		SSL_shutdown (ts->ssl);
+	}
+
+	ERR_clear_error ();
+	SSL_free (ts->ssl);
+	nfree (ts);
+}
+
+void
+tls_get_stats (tls_stats_t *stats)
+{
+	stats->handshakes = ice_atomic_load (&tls_stats.handshakes);
+	stats->failures = ice_atomic_load (&tls_stats.failures);
+	stats->ktls_send = ice_atomic_load (&tls_stats.ktls_send);
+	stats->ktls_recv = ice_atomic_load (&tls_stats.ktls_recv);
+}
+
+#else
+
+int
+tls_init ()
+{
+	write_log (LOG_DEFAULT, "ERROR: tls_port needs a caster built with --with-openssl");
+	return 0;
+}
+
+int
+tls_start (SOCKET sockfd)
+{
+	return 0;
+}
+
+int
+tls_handshake (SOCKET sockfd, short *events)
+{
+	return -1;
+}
+
+void
+tls_close (SOCKET sockfd)
+{
+}
+
+void
+tls_get_stats (tls_stats_t *stats)
+{
+	memset (stats, 0, sizeof (tls_stats_t));
+}
+
+#endif
+
+/*
+ * recv() for every socket, through the TLS session if it has one.
+ * Only MSG_PEEK is understood there.
+ */
+int
+sock_recv (SOCKET sockfd, char *buff, int len, int flags)
+{
+#ifdef HAVE_OPENSSL
+	tls_session_t *ts = tls_session (sockfd);
+
+	if (ts) {
+		int ret;
+
+		ERR_clear_error ();
+		ret = (flags & MSG_PEEK) ? SSL_peek (ts->ssl, buff, len) : SSL_read (ts->ssl, buff, len);
+		return ret > 0 ? ret : tls_result (ts, ret);
+	}
+#endif
+	return recv (sockfd, buff, len, flags);
+}
+
+/* send() for every socket, the kernel encrypts itself with kernel TLS */
+static int
+sock_send (SOCKET sockfd, const char *buff, int len)
+{
+#ifdef HAVE_OPENSSL
+	tls_session_t *ts = tls_session (sockfd);
+
+	if (ts && !ts->ktls_send) {
+		int ret;
+
+		ERR_clear_error ();
+		ret = SSL_write (ts->ssl, buff, len);
+		if (ret > 0)
+			return ret;
+		ret = tls_result (ts, ret);
+		if (ret == 0)
+			errno = EPIPE;
+		return -1;
+	}
+#endif
+	return send (sockfd, buff, len, 0);
+}
+
+/* Do writes to sockfd go to the kernel as they are, i.e no userspace TLS? */
+int
+sock_direct (SOCKET sockfd)
+{
+#ifdef HAVE_OPENSSL
+	tls_session_t *ts = tls_session (sockfd);
+
+	if (ts && !ts->ktls_send)
+		return 0;
+#endif
+	return 1;
+}
+
+/*
+ * Bytes waiting to be read from sockfd, 0 if the system can't tell or
+ * TLS sits in between.
+ */
+int
+sock_pending (SOCKET sockfd)
+{
+#if defined(FIONREAD) && !defined(_WIN32)
+	int pending = 0;
+
+# ifdef HAVE_OPENSSL
+	if (tls_session (sockfd))
+		return 0;
+# endif
+	if (ioctl (sockfd, FIONREAD, &pending) == 0)
+		return pending;
+#endif
+	return 0;
+}
+
+/* uring.c. ajd *************************************************************************/
+
+/*
+ * A small io_uring for batching sends, one per source thread. Callers
+ * queue a sendmsg() per socket, uring_submit() hands them all to the
+ * kernel in one io_uring_enter() and waits for them. The sends don't
+ * wait for room in the socket (MSG_DONTWAIT), so waiting for all of
+ * them takes no longer than doing them one by one. Without io_uring in
+ * the kernel or the headers uring_create() returns NULL, and the
+ * callers send() as before.
+ */
+#ifdef HAVE_LINUX_IO_URING_H
+
+struct uring_St
+{
+	int fd;
+	unsigned int entries;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned int queued;		/* SQEs since the last submit */
+	struct msghdr *msg;		/* One per SQE */
+	struct iovec *iov;		/* iovs per SQE */
+	int iovs;
+};
+
+static int uring_state = 0;	/* 1 works, -1 doesn't, 0 not tried yet */
+
+static void
+uring_unmap (uring_t *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap (ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap (ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap (ring->sq_ring, ring->sq_ring_size);
+}
+
+/* A ring for up to entries sendmsg()s of up to iovs pieces each, NULL if there is no io_uring */
+uring_t *
+uring_create (unsigned int entries, int iovs)
+{
+	struct io_uring_params p;
+	uring_t *ring;
+	char *sq, *cq;
+	int fd, first;
+
+	if (!info.io_uring || ice_atomic_load (&uring_state) < 0)
+		return NULL;
+
+	memset (&p, 0, sizeof (p));
+	fd = syscall (__NR_io_uring_setup, entries, &p);
+
+	first = ice_atomic_load (&uring_state) == 0;
+	if (fd < 0) {
+		if (ice_atomic_swap (&uring_state, -1) == 0)
+			write_log (LOG_DEFAULT, "No io_uring (%s), the fan-out sends with send()", strerror (errno));
+		return NULL;
+	}
+
+	ring = (uring_t *) nmalloc (sizeof (uring_t));
+	memset (ring, 0, sizeof (uring_t));
+	ring->fd = fd;
+	ring->entries = p.sq_entries;
+	ring->iovs = iovs;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else
+		ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *) mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ice_atomic_swap (&uring_state, -1) == 0)
+			write_log (LOG_DEFAULT, "No io_uring (%s), the fan-out sends with send()", strerror (errno));
+		uring_unmap (ring);
+		close (fd);
+		nfree (ring);
+		return NULL;
+	}
+
+	sq = (char *) ring->sq_ring;
+	cq = (char *) ring->cq_ring;
+	ring->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	ring->msg = (struct msghdr *) nmalloc (ring->entries * sizeof (struct msghdr));
+	ring->iov = (struct iovec *) nmalloc (ring->entries * iovs * sizeof (struct iovec));
+
+	if (first && ice_atomic_swap (&uring_state, 1) == 0)
+		write_log (LOG_DEFAULT, "The fan-out sends through io_uring");
+
+	return ring;
+}
+
+void
+uring_destroy (uring_t *ring)
+{
+	if (!ring)
+		return;
+
+	uring_unmap (ring);
+	close (ring->fd);
+	nfree (ring->msg);
+	nfree (ring->iov);
+	nfree (ring);
+}
+
+/* Queue a sendmsg() of the iovcnt pieces in iov to sockfd. Returns 0 if the ring is full */
+int
+uring_sendmsg (uring_t *ring, SOCKET sockfd, const struct iovec *iov, int iovcnt, unsigned long int tag)
+{
+	unsigned int tail = *ring->sq_tail, i = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[i];
+	struct msghdr *msg = &ring->msg[i];
+	struct iovec *v = &ring->iov[i * ring->iovs];
+
+	if (ring->queued == ring->entries)
+		return 0;
+
+	if (iovcnt > ring->iovs)
+		iovcnt = ring->iovs;
+	memcpy (v, iov, iovcnt * sizeof (struct iovec));
+
+	memset (msg, 0, sizeof (struct msghdr));
+	msg->msg_iov = v;
+	msg->msg_iovlen = iovcnt;
+
+	memset (sqe, 0, sizeof (struct io_uring_sqe));
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = sockfd;
+	sqe->addr = (unsigned long) msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+	sqe->user_data = tag;
+
+	ring->sq_array[i] = i;
+	__atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+
+	return 1;
+}
+
+/*
+ * Send what's queued and wait for it, done() gets the tag and the
+ * result of every send, bytes or -errno. Returns 0 if the ring failed,
+ * the sends it couldn't make get -EAGAIN.
+ */
+int
+uring_submit (uring_t *ring, void (*done) (void *arg, unsigned long int tag, int res), void *arg)
+{
+	unsigned int want = ring->queued, submitted = 0, reaped = 0, head, tail;
+	struct io_uring_cqe *cqe;
+	int ret, ok = 1;
+
+	while (ok && reaped < want) {
+		ret = syscall (__NR_io_uring_enter, ring->fd, want - submitted, want - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR) {
+			write_log (LOG_DEFAULT, "WARNING: io_uring_enter() failed: %s", strerror (errno));
+			ok = 0;
+		}
+		if (ret > 0)
+			submitted += ret;
+
+		/* On failure too, what the kernel took is done, sends don't wait */
+		head = *ring->cq_head;
+		tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			done (arg, (unsigned long int) cqe->user_data, cqe->res);
+			reaped++;
+		}
+		__atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	/* The ones the kernel didn't take, the caller drops the ring */
+	if (!ok) {
+		unsigned int i, tail = *ring->sq_tail;
+
+		for (i = submitted; i < want; i++)
+			done (arg, (unsigned long int) ring->sqes[ring->sq_array[(tail - want + i) & *ring->sq_mask]].user_data, -EAGAIN);
+	}
+
+	ring->queued = 0;
+	return ok;
+}
+
+#else
+
+uring_t *
+uring_create (unsigned int entries, int iovs)
+{
+	return NULL;
+}
+
+void
+uring_destroy (uring_t *ring)
+{
+}
+
+int
+uring_sendmsg (uring_t *ring, SOCKET sockfd, const struct iovec *iov, int iovcnt, unsigned long int tag)
+{
+	return 0;
+}
+
+int
+uring_submit (uring_t *ring, void (*done) (void *arg, unsigned long int tag, int res), void *arg)
+{
+	return 0;
+}
+
+#endif
@@ -73,9 +73,14 @@ int inet_aton(const char *s, struct in_addr *a);
 /* Misc socket functions */
 int sock_set_keepalive(SOCKET sockfd, const int keepalive);
 int sock_set_no_linger (SOCKET sockfd);
+void sock_update_policies ();
+void sock_apply_policy (SOCKET sockfd, sock_role_t role);
+int sock_unacked (SOCKET sockfd);
+long sock_last_ack_msecs (SOCKET sockfd);
 int sock_valid (const SOCKET sockfd);
 int sock_set_blocking(SOCKET sockfd, const int block);
 int sock_close(SOCKET sockfd);
+int sock_shutdown (SOCKET sockfd);
 SOCKET sock_socket (int domain, int type, int protocol);
 SOCKET sock_accept (SOCKET s, struct sockaddr *addr, mysocklen_t *addrlen);
 SOCKET sock_create_udp_socket ();
@@ -94,9 +99,37 @@ int sock_write_line (SOCKET sockfd, const char *fmt, ...);
 int sock_write_string (SOCKET sokfd, const char *buff);
 
 /* Socket read functions */
+int sock_recv (SOCKET sockfd, char *buff, int len, int flags);
 int sock_read_lines(SOCKET sockfd, char *string, const int len);
 int sock_read_lines_np(SOCKET sockfd, char *string, const int len);
 
+/* TLS listeners */
+typedef struct tls_stats_St
+{
+	unsigned long int handshakes;
+	unsigned long int failures;
+	unsigned long int ktls_send;	/* Sessions the kernel encrypts for */
+	unsigned long int ktls_recv;
+} tls_stats_t;
+
+int tls_init ();
+int tls_start (SOCKET sockfd);
+int tls_handshake (SOCKET sockfd, short *events);
+void tls_close (SOCKET sockfd);
+void tls_get_stats (tls_stats_t *stats);
+
+int sock_direct (SOCKET sockfd);
+int sock_pending (SOCKET sockfd);
+
+/* Batched sends through io_uring */
+struct iovec;
+typedef struct uring_St uring_t;
+
+uring_t *uring_create (unsigned int entries, int iovs);
+void uring_destroy (uring_t *ring);
+int uring_sendmsg (uring_t *ring, SOCKET sockfd, const struct iovec *iov, int iovcnt, unsigned long int tag);
+int uring_submit (uring_t *ring, void (*done) (void *arg, unsigned long int tag, int res), void *arg);
+
 /* Libwrap functions */
 int sock_check_libwrap(const SOCKET sock, const contype_t contype);
 const char *sock_get_libwrap_type (const contype_t contype);
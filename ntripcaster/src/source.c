@@ -70,7 +70,15 @@
 #ifndef _WIN32
 #include <sys/socket.h> 
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <limits.h>
+# ifdef __linux__
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+# endif
 #else
 #include <io.h>
 #include <winsock.h>
@@ -86,28 +94,30 @@
 #include "ntrip_string.h"
 #include "source.h"
 #include "sock.h"
+#define LOG_MODULE LOG_MOD_SOURCE
 #include "log.h"
 #include "connection.h"
 #include "main.h"
 #include "timer.h"
+#include "metrics.h"
 #include "client.h"
 
 /* in microseconds */
 #define READ_RETRY_DELAY 400
 #define READ_TIMEOUT 16000
 
+#define FANOUT_BATCH 128	/* Clients sent to per io_uring_enter() */
+#define FANOUT_IOV 8		/* Chunks per sendmsg() */
+
 extern int running;
 extern server_info_t info;
 
 void source_login(connection_t *con, char *expr)
 {
-	char line[BUFSIZE], command[BUFSIZE], arg[BUFSIZE];
-	char pass[BUFSIZE] ="";
-	int go_on = 2;
+	char *pass, *mount;
 	int connected = 1;
-	int password_accepted = 0;
 	source_t *source;
-	char *res;
+	const char *agent;
 
 	if (con->type == unknown_connection_e)
 	{
@@ -120,81 +130,55 @@ void source_login(connection_t *con, char *expr)
 	source = con->food.source;
 	source->source_agent = NULL;
 
-	do {
-		command[0] = '\0';
-		arg[0] = '\0';
+	/* For encoders that send the SOURCE line on its own, the login thread
+	   has read the headers after it into expr as well */
+	header_parse (con, expr);
 
-		if (splitc(line, expr, '\n') == NULL) {
-			strncpy (line, expr, BUFSIZE);
-			go_on = go_on - 1;
+	/* SOURCE <password> <mountpoint> */
+	pass = con->headers.request_line;
+	if (pass && ice_strncmp (pass, "SOURCE", 6) == 0)
+		pass += 6;
+	pass = pass ? clean_string (pass) : NULL;
+	mount = pass ? strchr (pass, ' ') : NULL;
 
-			if ((go_on > 0) && (!source->protocol == icy_e && source->type == encoder_e))
-			{
-				sock_read_lines_np (con->sock, expr, BUFSIZE);
-			}
-		}
-		
-		/* The delimiter on the first line is ' ', on the following lines ':' */
-		if (go_on == 2)
-			res = splitc (command, line, ' ');
-		else
-			res = splitc (command, line, ':');
-		
-		if (!res)
-		{
-			strncpy (command, line, BUFSIZE);
-			arg[0] = '\0';
-		} else {
-			strncpy (arg, line, BUFSIZE);
-		}
-		
-		if (line[0])
-			xa_debug (2, "DEBUG: Source line: [%s] [%s]", command, arg);
+	if (!mount) {
+		sock_write_line (con->sock, "ERROR - Missing Mountpoint\r\n");
+		kick_connection (con, "No Mountpoint supplied");
+		return;
+	}
 
-		if (ice_strncmp(command, "SOURCE", 6) == 0)
-		{
-			if (splitc(pass, arg, ' ') == NULL) {
-				sock_write_line (con->sock, "ERROR - Missing Mountpoint\r\n");
-				kick_connection (con, "No Mountpoint supplied");
-				connected = 0;
-				return;
-			}
-			
-			if (!password_match(info.encoder_pass, pass)) {
-				sock_write_line (con->sock, "ERROR - Bad Password\r\n");
-				kick_connection (con, "Bad Password");
-				return;
-			} else
-				password_accepted = 1;
+	*mount++ = '\0';
+	mount = clean_string (mount);
+	xa_debug (2, "DEBUG: Source login on mountpoint [%s]", mount);
 
-		
-			if (!source->audiocast.mount)
-				source->audiocast.mount = my_strdup(arg);
+	if (!password_match(info.encoder_pass, pass)) {
+		sock_write_line (con->sock, "ERROR - Bad Password\r\n");
+		kick_connection (con, "Bad Password");
+		return;
+	}
 
-			{
-				char slash[BUFSIZE];
-				if (source->audiocast.mount[0] != '/')
-				{
-					snprintf(slash, BUFSIZE, "/%s", source->audiocast.mount);
-					nfree (source->audiocast.mount);
-					source->audiocast.mount = my_strdup (slash);
-				}
-			}
-			
-			if (mount_exists (source->audiocast.mount) || (source->audiocast.mount[0] == '\0')) {
-				sock_write_line (con->sock, "ERROR - Mount Point Taken or Invalid\r\n");
-				kick_connection (con, "Invalid Mount Point");
-				return;
-			}
-			if (source->type == encoder_e) go_on = 1;
-		}
+	if (!source->audiocast.mount)
+		source->audiocast.mount = my_strdup(mount);
 
-		else if (strncasecmp(command, "Source-Agent", 12) == 0)
+	{
+		char slash[BUFSIZE];
+		if (source->audiocast.mount[0] != '/')
 		{
-			source->source_agent = my_strdup(arg);
+			snprintf(slash, BUFSIZE, "/%s", source->audiocast.mount);
+			nfree (source->audiocast.mount);
+			source->audiocast.mount = my_strdup (slash);
 		}
-	} while ((go_on > 0) && connected);
-	
+	}
+
+	if (mount_exists (source->audiocast.mount) || (source->audiocast.mount[0] == '\0')) {
+		sock_write_line (con->sock, "ERROR - Mount Point Taken or Invalid\r\n");
+		kick_connection (con, "Invalid Mount Point");
+		return;
+	}
+
+	if ((agent = header_get (con, HDR_SOURCE_AGENT)))
+		source->source_agent = my_strdup (agent);
+
 	if (!source->source_agent || strncasecmp(source->source_agent, "ntrip", 5) != 0) {
 		sock_write_line (con->sock, "Not authorized (no NTRIP source)\r\n");
 		kick_connection (con, "No NTRIP source");
@@ -203,16 +187,23 @@ void source_login(connection_t *con, char *expr)
 
 	if (connected) {
 
-		if ((info.num_sources + 1) > info.max_sources)
+		if (!bus_claim (con)) {
+			sock_write_line (con->sock, "ERROR - Mount Point Taken or Invalid\r\n");
+			kick_connection (con, "Invalid Mount Point");
+			return;
+		}
+
+		if (!add_source ())
 		{
 			sock_write_line (con->sock, "ERROR - Too many sources\r\n");
 			kick_connection (con, "Server Full (too many streams)");
 			return;
 		}
 
-		add_source ();
 		sock_write_line (con->sock, "OK");
+		sock_apply_policy (con->sock, source->type == encoder_e ? SOCK_ROLE_SOURCE : SOCK_ROLE_RELAY);
 		source->connected = SOURCE_CONNECTED;
+		metrics_login_done (con);
 
 		write_log (LOG_DEFAULT, "Accepted encoder on mountpoint %s from %s. %d sources connected",
 			   source->audiocast.mount, con_host (con), info.num_sources);
@@ -240,10 +231,9 @@ void *
 source_func(void *conarg)
 {
 	source_t *source;
-	avl_traverser trav = {0};
-	connection_t *clicon, *con = (connection_t *)conarg;
+	connection_t *reap, *con = (connection_t *)conarg;
 	mythread_t *mt;
-	int i;
+	int i, j;
 
 	source = con->food.source;
 	con->food.source->thread = thread_self();
@@ -253,11 +243,23 @@ source_func(void *conarg)
 
 	sock_set_blocking(con->sock, SOCK_NONBLOCK);
 
+	source->uring = uring_create (FANOUT_BATCH, FANOUT_IOV);
+
 	while (thread_alive (mt) && ((source->connected == SOURCE_CONNECTED) || (source->connected == SOURCE_PAUSED)))
 	{
+		if (ice_atomic_load (&source->handoff) && upgrade_source (con))
+			break;
+
 		source_get_new_clients (source);
 
 		add_chunk(con);
+
+		/* A burst from the source goes out in one sendmsg() per client */
+		if (source->uring && source->held < FANOUT_IOV - 1 && !ice_atomic_load (&source->handoff)
+		    && sock_pending (con->sock) >= SOURCE_READSIZE) {
+			source->held++;
+			continue;
+		}
 		
 		for (i = 0; i < 10; i++) {
 			
@@ -266,14 +268,14 @@ source_func(void *conarg)
 
 			thread_mutex_lock(&source->mutex);
 			
-			zero_trav (&trav);
-			
-			while ((clicon = avl_traverse(source->clients, &trav)) != NULL) {
+			if (source->uring)
+				write_chunks_uring (source);
+			else for (j = 0; j < source->clients.count; j++) {
 			  
 				if (source->connected == SOURCE_KILLED || source->connected == SOURCE_PAUSED)
 					break;
 				
-				source_write_to_client (source, clicon);
+				source_write_to_client (source, j);
 				
 			}
 			
@@ -282,26 +284,41 @@ source_func(void *conarg)
 			if (mt->ping == 1)
 				mt->ping = 0;
 		}
-
-		thread_mutex_lock (&info.double_mutex);
+		source->held = 0;
 
 		thread_mutex_lock (&source->mutex);
-		kick_dead_clients (source);
+		reap = kick_dead_clients (source);
 		thread_mutex_unlock (&source->mutex);
 
-		thread_mutex_unlock(&info.double_mutex);
+		reap_clients (reap);
 	}
 
-	thread_mutex_lock (&info.double_mutex);
+	uring_destroy (source->uring);
+	source->uring = NULL;
+
+	/* Drop the clients while the source is still around, but without the locks */
+	thread_mutex_lock (&source->mutex);
+
+	source_get_new_clients (source);
+
+	for (j = 0; j < source->clients.count; j++)
+		kick_connection (source->clients.con[j], "Stream ended");
+	reap = kick_dead_clients (source);
+
+	thread_mutex_unlock (&source->mutex);
+
+	reap_clients (reap);
+
 	thread_mutex_lock (&info.source_mutex);
 	thread_mutex_lock (&source->mutex);
 	
 	source_get_new_clients (source);
 
+	latency_log_summary (source);
+
 	close_connection (con, &info);
 
 	thread_mutex_unlock (&info.source_mutex);
-	thread_mutex_unlock (&info.double_mutex);
 
 	thread_exit (0);
 	return NULL;
@@ -310,7 +327,7 @@ source_func(void *conarg)
 source_t *
 create_source()
 {
-	source_t *source = (source_t *)nmalloc(sizeof(source_t));
+	source_t *source = (source_t *) slab_alloc (&source_slab);
 	memset(source,0,sizeof(source_t));
 	source->type = unknown_source_e;
 	return source;
@@ -330,10 +347,14 @@ put_source(connection_t *con)
 	thread_create_mutex(&source->mutex);
 	source->audiocast.mount = NULL;
 	source->cid = 0;
-	source->clients = avl_create (compare_connection, &info);
+	client_set_init (&source->clients);
 	source->num_clients = 0;
+	source->admitted_clients = 0;
 	source->priority = 0;
 	source->source_agent = NULL;
+	source->bus = NULL;
+	source->uring = NULL;
+	source->held = 0;
 
 	for (i = 0; i < CHUNKLEN; i++)
 	{
@@ -346,17 +367,20 @@ put_source(connection_t *con)
 	con->type = source_e;
 }
 
-void
+/* Returns 0 when max_sources are connected already */
+int
 add_source ()
 {
-	info.num_sources++;
-	info.hourly_stats.source_connections++;
+	if (!util_reserve (&info.num_sources, info.max_sources))
+		return 0;
+	stats_count (source_connections, 1);
+	return 1;
 }
 
 void
 del_source ()
 {
-	info.num_sources--;
+	util_release (&info.num_sources);
 }
 
 /* Must have mount, source and double mutex to call this */
@@ -385,6 +409,10 @@ find_mount_with_req (request_t *req)
 	{
 		true = 0;
 
+		/* A kicked source stays in the tree until its thread notices, but takes no listeners */
+		if (con->food.source->connected == SOURCE_KILLED)
+			continue;
+
 		xa_debug(2, "DEBUG: Looking on mount [%s]", con->food.source->audiocast.mount);
 
 /* old mount search. ajd
@@ -438,19 +466,21 @@ add_chunk (connection_t *con)
 	int len;
 	int tries;
 
-	if (con->food.source->chunk[con->food.source->cid].clients_left > 0)
-	{
 #ifndef OPTIMIZE
+	if (con->food.source->chunk[con->food.source->cid].clients_left > 0)
 		xa_debug (2, "DEBUG: Kicking trailing clients [%d] on id %d", con->food.source->chunk[con->food.source->cid].clients_left, 
 			con->food.source->cid);
 #endif
-		thread_mutex_lock (&info.double_mutex);
-		thread_mutex_lock (&con->food.source->mutex);
+	/* Every chunk, a client about to be lapped would look caught up after the lap */
+	thread_mutex_lock (&con->food.source->mutex);
 
-		kick_clients_on_cid (con->food.source);
+	kick_clients_on_cid (con->food.source);
 
-		thread_mutex_unlock (&con->food.source->mutex);
-		thread_mutex_unlock (&info.double_mutex);
+	thread_mutex_unlock (&con->food.source->mutex);
+
+	if (con->food.source->type == bus_e) {
+		bus_read_chunk (con);
+		return;
 	}
 	
 	len = 0;
@@ -463,7 +493,7 @@ add_chunk (connection_t *con)
 	        sock_set_blocking(con->sock, SOCK_BLOCK);
 #endif
 
-		len = recv(con->sock, con->food.source->chunk[con->food.source->cid].data + read_bytes, SOURCE_READSIZE - read_bytes, 0);
+		len = sock_recv(con->sock, con->food.source->chunk[con->food.source->cid].data + read_bytes, SOURCE_READSIZE - read_bytes, 0);
 		
 		xa_debug (5, "DEBUG: Source received %d bytes in try %d, total %d, errno: %d", len, tries, read_bytes, errno);
 
@@ -484,32 +514,28 @@ add_chunk (connection_t *con)
 
 				if (pending_source_signoff (con))
 				{
-					thread_mutex_lock (&info.double_mutex);
 					thread_mutex_lock (&con->food.source->mutex);
 					kick_connection (con, "Client timeout exceeded, removing source");
 					thread_mutex_unlock (&con->food.source->mutex);
-					thread_mutex_unlock (&info.double_mutex);
 					return;
 				} else {
-					thread_mutex_lock (&info.double_mutex);
 					thread_mutex_lock (&con->food.source->mutex);
 					kick_connection (con, "Lost all clients to new source");
 					thread_mutex_unlock (&con->food.source->mutex);
-					thread_mutex_unlock (&info.double_mutex);
 					return;
 				}
 			} else {
-				thread_mutex_lock (&info.double_mutex);
 				thread_mutex_lock (&con->food.source->mutex);
 				kick_connection (con, "Source signed off (killed itself)");
 				thread_mutex_unlock (&con->food.source->mutex);
-				thread_mutex_unlock (&info.double_mutex);
 				return;
 			}
 		} else if (len > 0) {
+			if (read_bytes == 0)
+				con->food.source->chunk[con->food.source->cid].arrival = get_mono_usec ();
 			read_bytes += len;
 			stat_add_read(&con->food.source->stats, len);
-			info.hourly_stats.read_bytes += len;
+			stats_count (read_bytes, len);
 		} else {
 			my_sleep(READ_RETRY_DELAY * 1000);
 		}
@@ -527,11 +553,9 @@ add_chunk (connection_t *con)
 		if (info.client_timeout > 0) {
 			/* Sleep for client_timeout seconds. If during that time this source is set to SOURCE_KILLED, return false */
 			if (pending_source_signoff(con)) {
-				thread_mutex_lock (&info.double_mutex);
 				thread_mutex_lock(&con->food.source->mutex);
 				kick_connection(con, "Client timeout exceeded, removing source");
 				thread_mutex_unlock(&con->food.source->mutex);
-				thread_mutex_unlock (&info.double_mutex);
 				return;
 			} else {
 				thread_mutex_lock(&con->food.source->mutex);
@@ -540,11 +564,9 @@ add_chunk (connection_t *con)
 				return;
 			}
 		} else {
-			thread_mutex_lock (&info.double_mutex);
 			thread_mutex_lock(&con->food.source->mutex);
 			kick_connection(con, "Source died");
 			thread_mutex_unlock(&con->food.source->mutex);
-			thread_mutex_unlock (&info.double_mutex);
 			return;
 		}
 	}
@@ -553,107 +575,111 @@ add_chunk (connection_t *con)
 	xa_debug (4, "-------add_chunk: Chunk %d was [%d] bytes", con->food.source->cid, read_bytes );
 #endif
 	
+	metrics_ingest (con->food.source);
+
 	con->food.source->chunk[con->food.source->cid].len = read_bytes;
 	con->food.source->chunk[con->food.source->cid].clients_left = con->food.source->num_clients;
+	if (con->food.source->bus)
+		bus_publish (con);
+	replica_publish (con);
 	con->food.source->cid = (con->food.source->cid + 1) % CHUNKLEN;
 	
 }
 
 void
-write_chunk(source_t *source, connection_t *clicon)
+write_chunk(source_t *source, int i)
 {
-	int i = 0;
-	long int write_bytes = 0, len = 0;
+	client_slot_t *slot = &source->clients.slot[i];
+	int try;
+	long int write_bytes = 0, len = 0, sent_bytes = 0;
 
 	/* Try to write 2 times */
-	for (i = 0; i < 2; i++)
+	for (try = 0; try < 2; try++)
 	{
-		if (source->cid == clicon->food.client->cid) /* No more data available */
-			return;
+		if (source->cid == slot->cid) /* No more data available */
+			break;
+
+		if (try == 0)
+			histogram_add (&source->fanout_lag, (source->cid - slot->cid + CHUNKLEN) % CHUNKLEN);
 
 		/* This is how much we should be writing to the client */
-		len = source->chunk[clicon->food.client->cid].len - clicon->food.client->offset;
+		len = source->chunk[slot->cid].len - slot->offset;
 		
-		xa_debug (5, "DEBUG: write_chunk(): Try: %d, writing chunk %d to client %d, len(%d) - offset(%d) == %d", i, clicon->food.client->cid, clicon->id, 
-			  source->chunk[clicon->food.client->cid].len, clicon->food.client->offset, len);
+		xa_debug (5, "DEBUG: write_chunk(): Try: %d, writing chunk %d to client %d, len(%d) - offset(%d) == %d", try, slot->cid, source->clients.con[i]->id, 
+			  source->chunk[slot->cid].len, slot->offset, len);
 		
-		if (len < 0 || source->chunk[clicon->food.client->cid].len == 0)
+		if (len < 0 || source->chunk[slot->cid].len == 0)
 		{
 #ifndef OPTIMIZE
-			xa_debug (5, "DEBUG: write_chunk: Empty chunk [%d] [%d]", source->chunk[clicon->food.client->cid].len,
-				  clicon->food.client->offset );
+			xa_debug (5, "DEBUG: write_chunk: Empty chunk [%d] [%d]", source->chunk[slot->cid].len,
+				  slot->offset );
 #endif
-			source->chunk[clicon->food.client->cid].clients_left--;
-			clicon->food.client->cid = (clicon->food.client->cid + 1) % CHUNKLEN;
-			clicon->food.client->offset = 0;
+			source->chunk[slot->cid].clients_left--;
+			slot->cid = (slot->cid + 1) % CHUNKLEN;
+			slot->offset = 0;
 			continue; /* Perhaps for some reason the source read a zero sized chunk but the next one is ok */
 		} 
 		
-		write_bytes = write_data (clicon, source);
+		write_bytes = write_data (source, i);
 
 		if (write_bytes < 0)
 		{
 #ifndef OPTIMIZE
-			xa_debug (5, "DEBUG: client: [%2d] errors: [%3d]", clicon->id, client_errors (clicon->food.client));
+			xa_debug (5, "DEBUG: client: [%2d] errors: [%3d]", source->clients.con[i]->id, client_slot_errors (source, slot));
 #endif
 			if (is_recoverable (0 - write_bytes))
 				continue;
 			break; /* Safe to assume that the client is kicked out due to socket error */
 		}
 
-		clicon->food.client->write_bytes += write_bytes;
-		info.hourly_stats.write_bytes += write_bytes;
-		stat_add_write (&source->stats, write_bytes);
+		sent_bytes += write_bytes;
 		
-		if (write_bytes + clicon->food.client->offset >= source->chunk[clicon->food.client->cid].len) {
-			source->chunk[clicon->food.client->cid].clients_left--;
-			clicon->food.client->cid = (clicon->food.client->cid + 1) % CHUNKLEN;
-			clicon->food.client->offset = 0;
+		if (write_bytes + slot->offset >= source->chunk[slot->cid].len) {
+			long long sent = get_mono_usec () - source->chunk[slot->cid].arrival;
+
+			latency_add (&source->latency, sent > 0 ? sent : 0);
+			source->chunk[slot->cid].clients_left--;
+			slot->cid = (slot->cid + 1) % CHUNKLEN;
+			slot->offset = 0;
 		} else {
 			
-			clicon->food.client->offset += write_bytes;
+			slot->offset += write_bytes;
 #ifndef OPTIMIZE
-			xa_debug (5, "DEBUG: client %d only read %d of %d bytes", clicon->id, write_bytes, 
-				  source->chunk[clicon->food.client->cid].len - clicon->food.client->offset);
+			xa_debug (5, "DEBUG: client %d only read %d of %d bytes", source->clients.con[i]->id, write_bytes, 
+				  source->chunk[slot->cid].len - slot->offset);
 #endif
 		}
 	}
+
+	/* The only write to the cold client per pass */
+	if (sent_bytes > 0) {
+		source->clients.con[i]->food.client->write_bytes += sent_bytes;
+		stats_count (write_bytes, sent_bytes);
+		stat_add_write (&source->stats, sent_bytes);
+	}
 	
-	xa_debug (4, "DEBUG: client %d tried %d times, now has %d errors %d chunks behind source", clicon->id, i,
-		  client_errors (clicon->food.client), source->cid < clicon->food.client->cid ? source->cid+CHUNKLEN - clicon->food.client->cid : source->cid - clicon->food.client->cid);
-	
-	if (clicon->food.client->alive == CLIENT_DEAD)
-		return;
+	xa_debug (4, "DEBUG: client %d tried %d times, now has %d errors %d chunks behind source", source->clients.con[i]->id, try,
+		  client_slot_errors (source, slot), source->cid < slot->cid ? source->cid+CHUNKLEN - slot->cid : source->cid - slot->cid);
 }
 
 void 
 kick_clients_on_cid(source_t *source)
 {
-	avl_traverser trav = {0};
-	connection_t *clicon;
-
-	unsigned int max = avl_count (source->clients) * avl_count (source->clients) + 2;
+	client_set_t *set = &source->clients;
+	int i;
 
 	xa_debug (3, "Clearing cid %d", source->cid);
 
-	zero_trav (&trav);
-
 #if !defined(SAVE_CPU) || !defined(OPTIMIZE)
-	xa_debug (5, "DEBUG: In function kick_clients_on_cid. Source has %d clients", max);
+	xa_debug (5, "DEBUG: In function kick_clients_on_cid. Source has %d clients", set->count);
 #endif
-	while (max >= 0)
+	for (i = 0; i < set->count; i++)
 	{
-		clicon = avl_traverse (source->clients, &trav);
-		if (!clicon)
-			break;
-		
-		if (client_errors (clicon->food.client) >= (CHUNKLEN - 1) && clicon->food.client->alive != CLIENT_DEAD)
-		    
-		{
-			kick_connection (clicon, "Client cannot sustain sufficient bandwidth");
-			zero_trav (&trav); /* Start from the top of the tree */
-		}
-		max--;
+		if (set->slot[i].flags & (CLIENT_SLOT_NEW | CLIENT_SLOT_DEAD))
+			continue;
+
+		if (client_slot_errors (source, &set->slot[i]) >= (CHUNKLEN - 1))
+			kick_connection (set->con[i], "Client cannot sustain sufficient bandwidth");
 	}
 	source->chunk[source->cid].clients_left = 0;
 #if !defined(SAVE_CPU) || !defined(OPTIMIZE)
@@ -664,67 +690,66 @@ kick_clients_on_cid(source_t *source)
 /* 
  * Can't be removing clients inside the loop which handles all the
  * write_chunk()s, instead we kick all the dead ones for each chunk. 
+ * They are unlinked in one pass and returned as a list, which the
+ * caller hands to reap_clients() once it has dropped its locks.
  */
-void 
+connection_t *
 kick_dead_clients(source_t *source)
 {
-	avl_traverser trav = {0};
-	connection_t *clicon = NULL;
-
-	int max = avl_count (source->clients) * avl_count (source->clients) + 2;
+	client_set_t *set = &source->clients;
+	connection_t *clicon, *reap = NULL;
+	int i;
 	
 #if !defined(SAVE_CPU) || !defined(OPTIMIZE)
-	xa_debug (5, "DEBUG: In function kick_dead_clients. Will run %d laps", max);
+	xa_debug (5, "DEBUG: In function kick_dead_clients. Source has %d clients", set->count);
 #endif
 
 	/* Check for too many errors */
-	while ((clicon = avl_traverse (source->clients, &trav))) {
-		if (client_errors (clicon->food.client) >= (CHUNKLEN - 1)) {
-				kick_connection (clicon, "Too many errors (client not receiving data fast enough)");
-		}
+	for (i = 0; i < set->count; i++) {
+		if (set->slot[i].flags & (CLIENT_SLOT_NEW | CLIENT_SLOT_DEAD))
+			continue;
+
+		if (client_slot_errors (source, &set->slot[i]) >= (CHUNKLEN - 1))
+			kick_connection (set->con[i], "Too many errors (client not receiving data fast enough)");
 	}
 	
-	zero_trav (&trav);
-
-	while (max >= 0) 
+	/* Backwards, so the client swapped into a hole has been looked at already */
+	for (i = set->count - 1; i >= 0; i--)
 	{
-		clicon = avl_traverse (source->clients, &trav);
-		if (!clicon)
-			break;
+		clicon = set->con[i];
 		
-		if (clicon->food.client->alive == CLIENT_MOVE) {
-				kick_connection (clicon, "Smaller source stream signed off");
-			/* No zero_trav() here cause it's not removed from the list (close_connection() does that) */
-		}
+		if (clicon->food.client->alive == CLIENT_MOVE)
+			kick_connection (clicon, "Smaller source stream signed off");
 		
-		if (clicon->food.client->alive == CLIENT_DEAD) {
-			close_connection (clicon, &info);
-			zero_trav (&trav);
+		if (set->slot[i].flags & CLIENT_SLOT_DEAD) {
+			unlink_client (clicon);
+			clicon->food.client->reap_next = reap;
+			reap = clicon;
 		}
-		
-		max--;
 	}
 
 #if !defined(SAVE_CPU) || !defined(OPTIMIZE)
-	xa_debug (5, "DEBUG: leaving function kick_dead_clients, %d laps left", max);
+	xa_debug (5, "DEBUG: leaving function kick_dead_clients, %d clients left", set->count);
 #endif
+	return reap;
 }
 
 int
-write_data (connection_t *clicon, source_t *source)
+write_data (source_t *source, int i)
 {
+	client_slot_t *slot = &source->clients.slot[i];
+	chunk_t *chunk = &source->chunk[slot->cid];
 	int write_bytes;
 	
-	if (source->chunk[clicon->food.client->cid].len - clicon->food.client->offset <= 0)
+	if (chunk->len - slot->offset <= 0)
 		return 0;
 	
-	write_bytes = sock_write_bytes_or_kick(clicon->sock, clicon, &source->chunk[clicon->food.client->cid].data[clicon->food.client->offset], 
-					       source->chunk[clicon->food.client->cid].len - clicon->food.client->offset);
+	write_bytes = sock_write_bytes_or_kick (slot->fd, source->clients.con[i], &chunk->data[slot->offset], 
+					       chunk->len - slot->offset);
 	
 #ifndef OPTIMIZE
-	xa_debug (4, "DEBUG: client %d in write_data(). Function write() returned %d of %d bytes, client on chunk %d (+%d), source on chunk %d", clicon->id, write_bytes,
-		  source->chunk[clicon->food.client->cid].len - clicon->food.client->offset, clicon->food.client->cid, clicon->food.client->offset,
-		  source->cid);
+	xa_debug (4, "DEBUG: client %d in write_data(). Function write() returned %d of %d bytes, client on chunk %d (+%d), source on chunk %d", source->clients.con[i]->id, write_bytes,
+		  chunk->len - slot->offset, slot->cid, slot->offset, source->cid);
 #endif
 	if (write_bytes < 0)
 		return 0 - errno;
@@ -732,7 +757,7 @@ write_data (connection_t *clicon, source_t *source)
 }
 
 const char source_protos[2][12] = { "icy", "x-audiocast" };
-const char source_types[5][16] = { "encoder", "pulling relay", "on demand relay", "file transfer", "unknown source" };
+const char source_types[6][16] = { "encoder", "pulling relay", "on demand relay", "mirror", "replica", "unknown source" };
 
 const char *
 sourcetype_to_string (source_type_t type)
@@ -748,42 +773,45 @@ sourcetype_to_string (source_type_t type)
 int
 start_chunk (source_t *source)
 {
-	return source->cid > 0 ? source->cid - 1 : CHUNKLEN - 1;
+	/* A client joining in a held burst gets all of it */
+	return (source->cid - 1 - source->held + 2 * CHUNKLEN) % CHUNKLEN;
 }
 
-void
-source_write_to_client (source_t *source, connection_t *clicon)
+/* Start a new client on its first chunk. Returns 0 if slot i gets nothing now */
+static int
+source_start_client (source_t *source, int i)
 {
+	client_slot_t *slot = &source->clients.slot[i];
 	client_t *client;
 
-	if (!clicon || !source) {
-		xa_debug (1, "WARNING: source_write_to_client() called with NULL pointers");
-		return;
-	}
+	if (slot->flags & CLIENT_SLOT_DEAD)
+		return 0;
 	
-	client = clicon->food.client;
+	if (slot->flags & CLIENT_SLOT_NEW) {
+		client = source->clients.con[i]->food.client;
 
-	if (client->alive == CLIENT_DEAD)
-		return;
-	
-	if (client->virgin == CLIENT_PAUSED || client->virgin == -1)
-		return;
-	
-	if (client->virgin == CLIENT_UNPAUSED)	{
-		client->cid = start_chunk (source);
-		client->offset = find_frame_ofs (source);
-		client->virgin = 0;
-	}
-	
-	if (client->virgin == 1) {
-		client->cid = start_chunk (source); 
-		client->offset = find_frame_ofs(source);
-		xa_debug (2, "Client got offset %d", client->offset);
+		if (client->virgin == CLIENT_PAUSED || client->virgin == -1)
+			return 0;
+
+		slot->cid = start_chunk (source);
+		slot->offset = find_frame_ofs (source);
+		slot->flags &= ~CLIENT_SLOT_NEW;
+
+		if (client->virgin == 1) {
+			xa_debug (2, "Client got offset %d", slot->offset);
+			source->num_clients = source->num_clients + (unsigned long int)1;
+		}
 		client->virgin = 0;
-		source->num_clients = source->num_clients + (unsigned long int)1;
 	}
-	
-  write_chunk (source, clicon);
+
+	return 1;
+}
+
+void
+source_write_to_client (source_t *source, int i)
+{
+	if (source_start_client (source, i))
+		write_chunk (source, i);
 }
 
 void
@@ -793,7 +821,1683 @@ source_get_new_clients (source_t *source)
 	
 	while ((clicon = pool_get_my_clients (source))) {
 		xa_debug (1, "DEBUG: source_get_new_clients(): Accepted client %d", clicon->id);
-		avl_insert (source->clients, clicon);
+		client_set_add (source, clicon);
+	}
+}
+
+/* fanout.c. ajd ****************************************************************************/
+
+/*
+ * The fan-out pass with io_uring. A client gets the chunks it is behind,
+ * up to FANOUT_IOV of them, in one sendmsg(), and the sendmsgs of up to
+ * FANOUT_BATCH clients go to the kernel in one io_uring_enter(). Only
+ * the source thread writes the chunks, so they stay put until the sends
+ * are back. Clients with a userspace TLS session get write_chunk().
+ */
+
+/* A sendmsg() to client tag is back, move it on like write_chunk() does */
+static void
+write_chunks_done (void *arg, unsigned long int tag, int res)
+{
+	source_t *source = (source_t *) arg;
+	client_slot_t *slot = &source->clients.slot[tag];
+	connection_t *clicon = source->clients.con[tag];
+	chunk_t *chunk;
+	long long sent;
+	int len, bytes = res;
+
+	if (res < 0) {
+		/* TCP_USER_TIMEOUT or the keepalive probes gave up on it */
+		if (!is_recoverable (-res))
+			kick_connection (clicon, res == -ETIMEDOUT ? "Peer timed out" : "Client signed off");
+		return;
+	}
+
+	while (slot->cid != source->cid) {
+		chunk = &source->chunk[slot->cid];
+		len = chunk->len - slot->offset;
+
+		if (len > 0) {
+			if (bytes < len) {
+				slot->offset += bytes;
+				break;
+			}
+			bytes -= len;
+			sent = get_mono_usec () - chunk->arrival;
+			latency_add (&source->latency, sent > 0 ? sent : 0);
+		}
+
+		chunk->clients_left--;
+		slot->cid = (slot->cid + 1) % CHUNKLEN;
+		slot->offset = 0;
+	}
+
+	if (res > 0) {
+		clicon->food.client->write_bytes += res;
+		stats_count (write_bytes, res);
+		stat_add_write (&source->stats, res);
+	}
+}
+
+static void
+write_chunks_flush (source_t *source)
+{
+	if (!uring_submit (source->uring, write_chunks_done, source)) {
+		uring_destroy (source->uring);
+		source->uring = NULL;
+	}
+}
+
+/* One pass over the clients like source_write_to_client(), must have the source mutex */
+void
+write_chunks_uring (source_t *source)
+{
+	client_set_t *set = &source->clients;
+	client_slot_t *slot;
+	chunk_t *chunk;
+	struct iovec iov[FANOUT_IOV];
+	int j, n, c, offset;
+
+	for (j = 0; j < set->count; j++) {
+		if (source->connected == SOURCE_KILLED || source->connected == SOURCE_PAUSED)
+			break;
+
+		slot = &set->slot[j];
+		if (!source_start_client (source, j) || slot->cid == source->cid)
+			continue;
+
+		if (!source->uring || !sock_direct (slot->fd)) {
+			write_chunk (source, j);
+			continue;
+		}
+
+		histogram_add (&source->fanout_lag, (source->cid - slot->cid + CHUNKLEN) % CHUNKLEN);
+
+		n = 0;
+		offset = slot->offset;
+		for (c = slot->cid; c != source->cid && n < FANOUT_IOV; c = (c + 1) % CHUNKLEN) {
+			chunk = &source->chunk[c];
+			if (chunk->len - offset > 0) {
+				iov[n].iov_base = chunk->data + offset;
+				iov[n].iov_len = chunk->len - offset;
+				n++;
+			}
+			offset = 0;
+		}
+
+		/* Only empty chunks, write_chunk() steps over them */
+		if (n == 0) {
+			write_chunk (source, j);
+			continue;
+		}
+
+		if (!uring_sendmsg (source->uring, slot->fd, iov, n, j)) {
+			write_chunks_flush (source);
+			if (!source->uring || !uring_sendmsg (source->uring, slot->fd, iov, n, j))
+				write_chunk (source, j);
+		}
+	}
+
+	if (source->uring)
+		write_chunks_flush (source);
+}
+
+/* clientset.c. ajd ****************************************************************************/
+
+void
+client_set_init (client_set_t *set)
+{
+	set->slot = NULL;
+	set->con = NULL;
+	set->count = 0;
+	set->size = 0;
+}
+
+void
+client_set_destroy (client_set_t *set)
+{
+	if (set->slot) {
+		nfree (set->slot);
+	}
+	if (set->con) {
+		nfree (set->con);
+	}
+	set->count = 0;
+	set->size = 0;
+}
+
+/* Append a client to the source, must have the source mutex */
+void
+client_set_add (source_t *source, connection_t *clicon)
+{
+	client_set_t *set = &source->clients;
+	client_slot_t *slot;
+
+	if (set->count == set->size) {
+		int size = set->size > 0 ? set->size * 2 : CLIENT_SET_MIN;
+		client_slot_t *grown = (client_slot_t *) nmalloc (size * sizeof (client_slot_t));
+		connection_t **grown_con = (connection_t **) nmalloc (size * sizeof (connection_t *));
+
+		if (set->count > 0) {
+			memcpy (grown, set->slot, set->count * sizeof (client_slot_t));
+			memcpy (grown_con, set->con, set->count * sizeof (connection_t *));
+		}
+		if (set->slot) {
+			nfree (set->slot);
+		}
+		if (set->con) {
+			nfree (set->con);
+		}
+
+		set->slot = grown;
+		set->con = grown_con;
+		set->size = size;
+	}
+
+	slot = &set->slot[set->count];
+	slot->fd = clicon->sock;
+	slot->cid = -1;
+	slot->offset = 0;
+	slot->flags = CLIENT_SLOT_NEW;
+	if (clicon->food.client->alive == CLIENT_DEAD)
+		slot->flags |= CLIENT_SLOT_DEAD;
+
+	set->con[set->count] = clicon;
+	clicon->food.client->slot = set->count++;
+}
+
+/* Swap the last client into the hole, must have the source mutex */
+int
+client_set_remove (source_t *source, connection_t *clicon)
+{
+	client_set_t *set = &source->clients;
+	int i = clicon->food.client->slot, last;
+
+	if (i < 0 || i >= set->count || set->con[i] != clicon)
+		return 0;
+
+	last = --set->count;
+	if (i != last) {
+		set->slot[i] = set->slot[last];
+		set->con[i] = set->con[last];
+		set->con[i]->food.client->slot = i;
+	}
+	clicon->food.client->slot = -1;
+
+	return 1;
+}
+
+/* Mirror a kick into the hot state, must have the source mutex */
+void
+client_set_kill (connection_t *clicon)
+{
+	client_t *client = clicon->food.client;
+
+	if (client->source && client->slot >= 0 && client->slot < client->source->clients.count
+	    && client->source->clients.con[client->slot] == clicon)
+		client->source->clients.slot[client->slot].flags |= CLIENT_SLOT_DEAD;
+}
+
+/* Minutes all clients of the set have been connected */
+time_t
+client_set_time (client_set_t *set)
+{
+	time_t t = get_time (), tc = 0;
+	int i;
+
+	for (i = 0; i < set->count; i++)
+		tc += (t - set->con[i]->connect_time);
+	return tc / 60;
+}
+
+/* bus.c. ajd ****************************************************************************/
+
+/*
+ * The mount bus, shared between the workers (see workers.c in main.c).
+ * A source publishes its chunks into a slot of a shared memory table,
+ * one ring per mount. A client that asks a worker for a mount another
+ * worker has gets a bus_e source there, that copies the ring into its
+ * own chunks and serves them like any source. A slot has one writer and
+ * readers check the number of a chunk before and after they copy it,
+ * so the streams take no lock across processes. Claiming and releasing
+ * a slot goes through the bus lock.
+ */
+#ifndef _WIN32
+
+#define BUS_MOUNTLEN 256
+#define BUS_WAIT 1000		/* Milliseconds a mirror waits for a chunk before it looks at the owner */
+#define BUS_IDLE 60		/* Seconds a mirror stays up without clients */
+
+typedef struct bus_chunk_St
+{
+	unsigned int seq;	/* Number of the chunk, 0 while it's written */
+	int len;
+	char data[SOURCE_BUFFSIZE + MAXMETADATALENGTH];
+} bus_chunk_t;
+
+typedef struct bus_mount_St
+{
+	pid_t owner;		/* Worker with the source, 0 if the slot is free */
+	unsigned long int holder;	/* Connection id of the source in the owner */
+	unsigned int gen;	/* Changes when the mount goes, mirrors end */
+	char mount[BUS_MOUNTLEN];
+	unsigned int seq;	/* Chunks published, mirrors wait on it */
+	int waiters;
+	bus_chunk_t chunk[CHUNKLEN];
+} bus_mount_t;
+
+typedef struct bus_St
+{
+	pthread_mutex_t lock;	/* Process shared and robust, for claims only */
+	int mounts;
+	bus_mount_t mount[1];
+} bus_t;
+
+static bus_t *bus = NULL;
+
+/* Map the bus before the workers are forked, they inherit it */
+int
+bus_init (int mounts)
+{
+	pthread_mutexattr_t attr;
+	size_t size = sizeof (bus_t) + (mounts - 1) * sizeof (bus_mount_t);
+	void *map;
+
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		write_log (LOG_DEFAULT, "ERROR: Could not map %lu bytes for the mount bus: %s", (unsigned long) size, strerror (errno));
+		return 0;
 	}
+
+	bus = (bus_t *) map;
+	bus->mounts = mounts;
+
+	pthread_mutexattr_init (&attr);
+	pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init (&bus->lock, &attr);
+	pthread_mutexattr_destroy (&attr);
+
+	write_log (LOG_DEFAULT, "Mount bus with %d slots, %lu kbytes", mounts, (unsigned long) (size / 1024));
+	return 1;
+}
+
+static void
+bus_lock ()
+{
+	/* A worker died holding it, the slots are consistent anyway */
+	if (pthread_mutex_lock (&bus->lock) == EOWNERDEAD)
+		pthread_mutex_consistent (&bus->lock);
+}
+
+static void
+bus_unlock ()
+{
+	pthread_mutex_unlock (&bus->lock);
+}
+
+static int
+bus_owner_alive (bus_mount_t *slot)
+{
+	pid_t owner = ice_atomic_load (&slot->owner);
+
+	return owner > 0 && (kill (owner, 0) == 0 || errno != ESRCH);
+}
+
+static void
+bus_wake (bus_mount_t *slot)
+{
+#ifdef __linux__
+	syscall (SYS_futex, &slot->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* Wait up to BUS_WAIT for slot to get past chunk seq */
+static void
+bus_wait (bus_mount_t *slot, unsigned int seq)
+{
+#ifdef __linux__
+	struct timespec ts;
+
+	ts.tv_sec = BUS_WAIT / 1000;
+	ts.tv_nsec = (BUS_WAIT % 1000) * 1000000L;
+
+	__atomic_add_fetch (&slot->waiters, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&slot->seq, __ATOMIC_SEQ_CST) == seq)
+		syscall (SYS_futex, &slot->seq, FUTEX_WAIT, seq, &ts, NULL, 0);
+	__atomic_sub_fetch (&slot->waiters, 1, __ATOMIC_SEQ_CST);
+#else
+	my_sleep (READ_RETRY_DELAY * 100);
+#endif
 }
 
+/*
+ * Claim the slot of a source that is logging in. Returns 0 if another
+ * worker has the mount. A source of this worker waiting for a reconnect
+ * gives the slot to the new one, mirrors go on as if nothing happened.
+ */
+int
+bus_claim (connection_t *con)
+{
+	source_t *source = con->food.source;
+	bus_mount_t *slot, *take = NULL;
+	pid_t me = getpid ();
+	int i;
+
+	if (!bus)
+		return 1;
+
+	if (ice_strlen (source->audiocast.mount) >= BUS_MOUNTLEN)
+		return 0;
+
+	bus_lock ();
+
+	for (i = 0; i < bus->mounts; i++) {
+		slot = &bus->mount[i];
+
+		if (slot->owner && !bus_owner_alive (slot)) {
+			slot->owner = 0;
+			slot->gen++;
+		}
+
+		if (!slot->owner) {
+			if (!take)
+				take = slot;
+			continue;
+		}
+
+		if (strcmp (slot->mount, source->audiocast.mount) == 0) {
+			take = slot->owner == me ? slot : NULL;
+			break;
+		}
+	}
+
+	if (take && take->owner != me) {
+		take->gen++;
+		strcpy (take->mount, source->audiocast.mount);
+		ice_atomic_store (&take->owner, me);
+	}
+	if (take)
+		take->holder = con->id;
+
+	bus_unlock ();
+
+	source->bus = take;
+	return take != NULL;
+}
+
+/* The source con is gone, if it still has its slot it's free now */
+void
+bus_release (connection_t *con)
+{
+	source_t *source = con->food.source;
+	bus_mount_t *slot = source->bus;
+
+	if (!slot || source->type != encoder_e)
+		return;
+
+	bus_lock ();
+
+	if (slot->owner == getpid () && slot->holder == con->id) {
+		ice_atomic_store (&slot->owner, 0);
+		ice_atomic_add (&slot->gen, 1);
+	}
+
+	bus_unlock ();
+
+	bus_wake (slot);
+	source->bus = NULL;
+}
+
+/* Publish the chunk the source thread just read */
+void
+bus_publish (connection_t *con)
+{
+	source_t *source = con->food.source;
+	bus_mount_t *slot = source->bus;
+	chunk_t *chunk = &source->chunk[source->cid];
+	bus_chunk_t *bc;
+	unsigned int n;
+
+	if (slot->holder != con->id)
+		return;
+
+	n = slot->seq + 1;
+	if (n == 0)
+		n = 1;
+	bc = &slot->chunk[n % CHUNKLEN];
+
+	__atomic_store_n (&bc->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	memcpy (bc->data, chunk->data, chunk->len);
+	bc->len = chunk->len;
+	__atomic_store_n (&bc->seq, n, __ATOMIC_RELEASE);
+
+	__atomic_store_n (&slot->seq, n, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&slot->waiters, __ATOMIC_SEQ_CST) > 0)
+		bus_wake (slot);
+}
+
+/*
+ * A mirror of path if another worker has it, must have info.source_mutex.
+ * Returns its connection, or NULL if no one has the mount.
+ */
+connection_t *
+bus_mirror (const char *path)
+{
+	bus_mount_t *slot = NULL;
+	connection_t *con;
+	source_t *source;
+	unsigned int gen = 0, seq = 0;
+	pid_t me = getpid ();
+	int i;
+
+	if (!bus || !path || !path[0])
+		return NULL;
+
+	bus_lock ();
+
+	for (i = 0; i < bus->mounts; i++) {
+		if (bus->mount[i].owner && bus->mount[i].owner != me && strcmp (bus->mount[i].mount, path) == 0) {
+			slot = &bus->mount[i];
+			gen = slot->gen;
+			seq = slot->seq;
+			break;
+		}
+	}
+
+	bus_unlock ();
+
+	if (!slot || !bus_owner_alive (slot) || !add_source ())
+		return NULL;
+
+	con = create_connection ();
+	con->sock = INVALID_SOCKET;
+	con->id = new_id ();
+	con->connect_time = get_time ();
+	con->connect_usec = get_mono_usec ();
+	con->host = nstrdup ("mount bus");
+
+	put_source (con);
+	source = con->food.source;
+	source->type = bus_e;
+	source->audiocast.mount = my_strdup (path);
+	source->bus = slot;
+	source->bus_gen = gen;
+	source->bus_next = seq + 1;
+	source->bus_idle = con->connect_time;
+	source->connected = SOURCE_CONNECTED;
+
+	avl_insert (info.sources, con);
+
+	write_log (LOG_DEFAULT, "Mirroring mountpoint %s of worker process %d", path, (int) slot->owner);
+
+	thread_create ("Source Thread", source_func, (void *) con);
+
+	return con;
+}
+
+/* The mirror had no clients for BUS_IDLE seconds, kick it */
+static int
+bus_mirror_idle (connection_t *con)
+{
+	source_t *source = con->food.source;
+	time_t now = get_time ();
+	int idle;
+
+	if (ice_atomic_load (&source->admitted_clients) > 0) {
+		source->bus_idle = now;
+		return 0;
+	}
+
+	if (now - source->bus_idle < BUS_IDLE)
+		return 0;
+
+	/* client_login() admits under the source mutex, no client slips in */
+	thread_mutex_lock (&info.source_mutex);
+	thread_mutex_lock (&source->mutex);
+
+	idle = ice_atomic_load (&source->admitted_clients) == 0;
+	if (idle)
+		kick_connection (con, "Stream ended");
+
+	thread_mutex_unlock (&source->mutex);
+	thread_mutex_unlock (&info.source_mutex);
+
+	return idle;
+}
+
+/* add_chunk() for bus_e sources, copy the next chunk off the bus */
+void
+bus_read_chunk (connection_t *con)
+{
+	source_t *source = con->food.source;
+	bus_mount_t *slot = source->bus;
+	chunk_t *chunk = &source->chunk[source->cid];
+	bus_chunk_t *bc;
+	unsigned int seq, n;
+	int len;
+
+	for (;;) {
+		if (source->connected == SOURCE_KILLED || bus_mirror_idle (con))
+			return;
+
+		if (ice_atomic_load (&slot->gen) != source->bus_gen || !bus_owner_alive (slot)) {
+			thread_mutex_lock (&source->mutex);
+			kick_connection (con, "Stream ended");
+			thread_mutex_unlock (&source->mutex);
+			return;
+		}
+
+		seq = __atomic_load_n (&slot->seq, __ATOMIC_SEQ_CST);
+		if ((int) (seq - source->bus_next) >= 0)
+			break;
+
+		bus_wait (slot, seq);
+	}
+
+	/* Lapped by the writer, go on from the newest */
+	if (seq - source->bus_next >= CHUNKLEN - 1)
+		source->bus_next = seq;
+
+	n = source->bus_next;
+	bc = &slot->chunk[n % CHUNKLEN];
+
+	if (__atomic_load_n (&bc->seq, __ATOMIC_ACQUIRE) != n)
+		return;
+	len = bc->len;
+	if (len < 0 || len > SOURCE_BUFFSIZE + MAXMETADATALENGTH)
+		return;
+	memcpy (chunk->data, bc->data, len);
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	if (__atomic_load_n (&bc->seq, __ATOMIC_RELAXED) != n) {
+		source->bus_next = __atomic_load_n (&slot->seq, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	source->bus_next = n + 1;
+	chunk->arrival = get_mono_usec ();
+	stat_add_read (&source->stats, len);
+	metrics_ingest (source);
+
+	chunk->len = len;
+	chunk->clients_left = source->num_clients;
+	replica_publish (con);
+	source->cid = (source->cid + 1) % CHUNKLEN;
+}
+
+#else
+
+int
+bus_init (int mounts)
+{
+	return 0;
+}
+
+int
+bus_claim (connection_t *con)
+{
+	return 1;
+}
+
+void
+bus_release (connection_t *con)
+{
+}
+
+void
+bus_publish (connection_t *con)
+{
+}
+
+connection_t *
+bus_mirror (const char *path)
+{
+	return NULL;
+}
+
+void
+bus_read_chunk (connection_t *con)
+{
+}
+
+#endif
+
+/* replica.c. ajd ************************************************************************/
+
+/*
+ * Caster to caster replication. An edge caster (replicate_from) logs in
+ * to its parent with "REPLICATE <password> <mounts>" and gets the mounts
+ * it asked for over that one connection, as frames tagged with the
+ * mount: UP when a source comes, its DATA, DOWN when it goes, and the
+ * STR lines of the parent's sourcetable as TABLE whenever they change.
+ * On the parent the source threads queue their chunks for the edges as
+ * they queue them for clients, the edge's Replication Thread sends them
+ * on and looks for new and lost sources every REPLICA_POLL
+ * milliseconds. The edge feeds each mount through a
+ * socketpair to a replica_e source, that reads it like an encoder and
+ * serves its clients the usual way, and merges the STR lines into a
+ * sourcetable of its own.
+ */
+#define SOURCETABLE_FILE "../conf/sourcetable.dat"
+#define SOURCETABLE_REPLICA "../conf/sourcetable.replica"	/* Ours with the parent's mounts, on an edge */
+
+/* The sourcetable to serve, NULL if there is none */
+FILE *
+sourcetable_open ()
+{
+	FILE *ifp = NULL;
+
+	if (info.replicate_from)
+		ifp = fopen (SOURCETABLE_REPLICA, "r");
+
+	return ifp ? ifp : fopen (SOURCETABLE_FILE, "r");
+}
+
+#ifndef _WIN32
+
+#define REPLICA_POLL 20		/* Milliseconds between the parent's looks at the sources */
+#define REPLICA_QUEUE (1024 * 1024)	/* Bytes queued for an edge before it's too slow */
+#define REPLICA_PING 10		/* Seconds the parent may send nothing */
+#define REPLICA_TIMEOUT 30	/* Seconds the edge waits for a frame */
+#define REPLICA_RETRY 1000	/* Milliseconds before the edge's first reconnect, doubling */
+#define REPLICA_RETRY_MAX 60000	/* Longest wait between the edge's connects */
+#define REPLICA_TABLE_CHECK 5	/* Seconds between looks at the sourcetable files */
+#define REPLICA_PORT 2101	/* Of the parent if replicate_from has none */
+#define REPLICA_MAXFRAME (4 * 1024 * 1024)
+#define REPLICA_MOUNTLEN 255
+
+/* Frame header: type, mount length, 2 spare, payload length in network
+ * order. The mount and the payload follow. */
+#define REPLICA_HEADER 8
+
+#define REPLICA_UP 1		/* Payload is the source agent */
+#define REPLICA_DATA 2
+#define REPLICA_DOWN 3
+#define REPLICA_TABLE 4		/* STR lines, no mount */
+#define REPLICA_KEEPALIVE 5
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+typedef struct replica_buf_St
+{
+	char *data;
+	int len;
+	int size;
+} replica_buf_t;
+
+/* A source an edge was told about with UP */
+typedef struct replica_cursor_St
+{
+	unsigned long int id;		/* Connection id of the source */
+	char *mount;
+	int seen;			/* Still there when last looked */
+} replica_cursor_t;
+
+/* An edge on the parent, all of it under replica_mutex */
+typedef struct replica_feed_St
+{
+	const char *mounts;
+	replica_cursor_t *cursor;
+	int count;
+	int size;
+	replica_buf_t out;		/* Frames for the edge */
+	int tail;			/* Offset of the last frame in out if it's DATA, else -1 */
+	unsigned long int tail_id;	/* Its source */
+	int overflow;			/* Queued more than REPLICA_QUEUE */
+	struct replica_feed_St *next;
+} replica_feed_t;
+
+static mutex_t replica_mutex;		/* Leaf lock */
+static thread_cond_t replica_cond;	/* Something was queued for an edge */
+static replica_feed_t *replica_feeds = NULL;
+static int replica_feed_count = 0;
+
+/* A mount the edge gets from its parent */
+typedef struct replica_mount_St
+{
+	char *mount;
+	SOCKET fd;			/* Our end of the replica source's socketpair, INVALID_SOCKET if not served here */
+	unsigned long int id;		/* Connection id of the replica source, while fd is valid */
+	unsigned long int dropped;	/* Bytes the replica source was too slow for */
+	char *rest;			/* What the replica source had no room for of the last frame */
+	int rest_len;
+} replica_mount_t;
+
+typedef struct replica_edge_St
+{
+	SOCKET sock;
+	replica_mount_t *mount;
+	int count;
+	int size;
+	char *table;			/* STR lines of the parent */
+	time_t table_local;		/* mtime of our sourcetable when it was merged */
+} replica_edge_t;
+
+static time_t
+sourcetable_mtime (const char *path)
+{
+	struct stat st;
+
+	return stat (path, &st) == 0 ? st.st_mtime : 0;
+}
+
+static void
+replica_grow (replica_buf_t *buf, int more)
+{
+	char *grown;
+
+	if (buf->len + more <= buf->size)
+		return;
+
+	while (buf->len + more > buf->size)
+		buf->size = buf->size ? buf->size * 2 : 16384;
+
+	grown = (char *) nmalloc (buf->size);
+	if (buf->len > 0)
+		memcpy (grown, buf->data, buf->len);
+	if (buf->data) {
+		nfree (buf->data);
+	}
+	buf->data = grown;
+}
+
+/* Add a frame to buf, returns where it starts so replica_extend() can add to it */
+static int
+replica_put (replica_buf_t *buf, int type, const char *mount, const char *payload, int len)
+{
+	int start = buf->len, namelen = mount ? ice_strlen (mount) : 0;
+	unsigned int nlen = htonl (len);
+	char *p;
+
+	replica_grow (buf, REPLICA_HEADER + namelen + len);
+
+	p = buf->data + start;
+	p[0] = type;
+	p[1] = namelen;
+	p[2] = p[3] = 0;
+	memcpy (p + 4, &nlen, 4);
+	if (namelen > 0)
+		memcpy (p + REPLICA_HEADER, mount, namelen);
+	if (len > 0)
+		memcpy (p + REPLICA_HEADER + namelen, payload, len);
+
+	buf->len += REPLICA_HEADER + namelen + len;
+	return start;
+}
+
+/* Add len bytes to the payload of the last frame in buf, which starts at start */
+static void
+replica_extend (replica_buf_t *buf, int start, const char *data, int len)
+{
+	unsigned int nlen;
+
+	replica_grow (buf, len);
+	memcpy (buf->data + buf->len, data, len);
+	buf->len += len;
+
+	memcpy (&nlen, buf->data + start + 4, 4);
+	nlen = htonl (ntohl (nlen) + len);
+	memcpy (buf->data + start + 4, &nlen, 4);
+}
+
+/* Is mount in the comma separated list mounts? NULL and * are all of them */
+static int
+replica_wants (const char *mounts, const char *mount)
+{
+	const char *p, *end;
+	int len;
+
+	if (!mounts || strcmp (mounts, "*") == 0)
+		return 1;
+
+	if (mount[0] == '/')
+		mount++;
+	len = ice_strlen (mount);
+
+	for (p = mounts; *p; p = *end ? end + 1 : end) {
+		end = strchr (p, ',');
+		if (!end)
+			end = p + strlen (p);
+		if (*p == '/')
+			p++;
+		if (end - p == len && strncmp (p, mount, len) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* A TABLE frame with the STR lines we serve */
+static void
+replica_put_table (replica_buf_t *buf)
+{
+	FILE *ifp = sourcetable_open ();
+	char line[2000];
+	int start, len;
+
+	start = replica_put (buf, REPLICA_TABLE, NULL, NULL, 0);
+
+	if (!ifp)
+		return;
+
+	while (fgets (line, sizeof (line), ifp)) {
+		if (strncmp (line, "STR", 3) != 0)
+			continue;
+		len = ice_strlen (line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			len--;
+		line[len++] = '\n';
+		replica_extend (buf, start, line, len);
+	}
+
+	fclose (ifp);
+}
+
+/* Does the edge of feed get source? */
+static int
+replica_feeds_source (replica_feed_t *feed, source_t *source)
+{
+	return source->connected == SOURCE_CONNECTED && source->audiocast.mount
+		&& ice_strlen (source->audiocast.mount) <= REPLICA_MOUNTLEN && replica_wants (feed->mounts, source->audiocast.mount);
+}
+
+static replica_cursor_t *
+replica_cursor (replica_feed_t *feed, unsigned long int id)
+{
+	int i;
+
+	for (i = 0; i < feed->count; i++)
+		if (feed->cursor[i].id == id)
+			return &feed->cursor[i];
+
+	return NULL;
+}
+
+static replica_cursor_t *
+replica_cursor_add (replica_feed_t *feed, connection_t *scon)
+{
+	replica_cursor_t *cur, *grown;
+
+	if (feed->count == feed->size) {
+		feed->size = feed->size ? feed->size * 2 : 16;
+		grown = (replica_cursor_t *) nmalloc (feed->size * sizeof (replica_cursor_t));
+		if (feed->count > 0)
+			memcpy (grown, feed->cursor, feed->count * sizeof (replica_cursor_t));
+		if (feed->cursor) {
+			nfree (feed->cursor);
+		}
+		feed->cursor = grown;
+	}
+
+	cur = &feed->cursor[feed->count++];
+	cur->id = scon->id;
+	cur->mount = nstrdup (scon->food.source->audiocast.mount);
+	cur->seen = 0;
+
+	return cur;
+}
+
+/*
+ * Tell the edge about the sources that came and went since the last
+ * look. UP goes into the queue before the source's first chunk for the
+ * edge, and no chunk follows DOWN. The DOWNs go first, so a source that
+ * reconnected is retired on the edge before the new one comes up.
+ */
+static void
+replica_look (replica_feed_t *feed)
+{
+	avl_traverser trav = {0};
+	connection_t *scon;
+	source_t *source;
+	replica_cursor_t *cur;
+	int i;
+
+	thread_mutex_lock (&info.source_mutex);
+	internal_lock_mutex (&replica_mutex);
+
+	for (i = 0; i < feed->count; i++)
+		feed->cursor[i].seen = 0;
+
+	while ((scon = avl_traverse (info.sources, &trav))) {
+		source = scon->food.source;
+
+		if (replica_feeds_source (feed, source) && (cur = replica_cursor (feed, scon->id)))
+			cur->seen = 1;
+	}
+
+	/* Sources that are gone */
+	for (i = feed->count - 1; i >= 0; i--) {
+		if (feed->cursor[i].seen)
+			continue;
+		replica_put (&feed->out, REPLICA_DOWN, feed->cursor[i].mount, NULL, 0);
+		feed->tail = -1;
+		nfree (feed->cursor[i].mount);
+		feed->cursor[i] = feed->cursor[--feed->count];
+	}
+
+	/* Sources that are new */
+	zero_trav (&trav);
+	while ((scon = avl_traverse (info.sources, &trav))) {
+		source = scon->food.source;
+
+		if (replica_feeds_source (feed, source) && !replica_cursor (feed, scon->id)) {
+			cur = replica_cursor_add (feed, scon);
+			cur->seen = 1;
+			replica_put (&feed->out, REPLICA_UP, source->audiocast.mount, source->source_agent, ice_strlen (source->source_agent));
+			feed->tail = -1;
+		}
+	}
+
+	thread_mutex_unlock (&info.source_mutex);
+	internal_unlock_mutex (&replica_mutex);
+}
+
+/* The source thread of con read the chunk at cid, queue it for the edges that know the source */
+void
+replica_publish (connection_t *con)
+{
+	source_t *source = con->food.source;
+	chunk_t *chunk = &source->chunk[source->cid];
+	replica_feed_t *feed;
+	int queued = 0;
+
+	if (ice_atomic_load (&replica_feed_count) == 0 || chunk->len <= 0)
+		return;
+
+	internal_lock_mutex (&replica_mutex);
+
+	for (feed = replica_feeds; feed; feed = feed->next) {
+		if (feed->overflow || !replica_cursor (feed, con->id))
+			continue;
+
+		if (feed->out.len + chunk->len > REPLICA_QUEUE) {
+			feed->overflow = 1;
+		} else if (feed->tail >= 0 && feed->tail_id == con->id) {
+			replica_extend (&feed->out, feed->tail, chunk->data, chunk->len);
+		} else {
+			feed->tail = replica_put (&feed->out, REPLICA_DATA, source->audiocast.mount, chunk->data, chunk->len);
+			feed->tail_id = con->id;
+		}
+		queued = 1;
+	}
+
+	internal_unlock_mutex (&replica_mutex);
+
+	if (queued)
+		thread_cond_broadcast (&replica_cond);
+}
+
+/* REPLICATE <password> <mounts> from an edge caster, serve it until it goes */
+void
+replica_login (connection_t *con, char *expr)
+{
+	replica_feed_t *feed, **fp;
+	replica_buf_t buf = { NULL, 0, 0 }, swap;
+	mythread_t *mt;
+	char *pass, *mounts, *reason = "Replica signed off";
+	time_t now, last_send, last_check = 0, table_time = -1, stamp;
+	long long last_look = 0, usec;
+	int i, overflow;
+
+	header_parse (con, expr);
+
+	/* REPLICATE <password> <mounts> */
+	pass = con->headers.request_line;
+	if (pass && ice_strncmp (pass, "REPLICATE", 9) == 0)
+		pass += 9;
+	pass = pass ? clean_string (pass) : NULL;
+	mounts = pass ? strchr (pass, ' ') : NULL;
+
+	if (mounts) {
+		*mounts++ = '\0';
+		mounts = clean_string (mounts);
+	}
+	if (!mounts || !mounts[0])
+		mounts = "*";
+
+	if (!info.replication_password || !pass || !password_match (info.replication_password, pass)) {
+		sock_write_line (con->sock, "ERROR - Bad Password\r\n");
+		kick_not_connected (con, "Bad Password");
+		return;
+	}
+
+	sock_write_line (con->sock, "OK");
+	sock_apply_policy (con->sock, SOCK_ROLE_RELAY);
+
+	write_log (LOG_DEFAULT, "Accepted replica %d from %s for mounts %s", con->id, con_host (con), mounts);
+
+	thread_rename ("Replication Thread");
+	mt = thread_get_mythread ();
+	last_send = get_time ();
+
+	feed = (replica_feed_t *) nmalloc (sizeof (replica_feed_t));
+	memset (feed, 0, sizeof (replica_feed_t));
+	feed->mounts = mounts;
+	feed->tail = -1;
+
+	internal_lock_mutex (&replica_mutex);
+	feed->next = replica_feeds;
+	replica_feeds = feed;
+	ice_atomic_add (&replica_feed_count, 1);
+	internal_unlock_mutex (&replica_mutex);
+
+	while (thread_alive (mt) && running == SERVER_RUNNING) {
+		usec = get_mono_usec ();
+		if (usec - last_look >= REPLICA_POLL * 1000) {
+			last_look = usec;
+			replica_look (feed);
+		}
+
+		/* Take what the source threads queued */
+		internal_lock_mutex (&replica_mutex);
+		if (feed->out.len == 0 && !feed->overflow)
+			thread_cond_timedwait (&replica_cond, &replica_mutex, REPLICA_POLL);
+		swap = feed->out;
+		feed->out = buf;
+		feed->tail = -1;
+		buf = swap;
+		overflow = feed->overflow;
+		internal_unlock_mutex (&replica_mutex);
+
+		if (overflow) {
+			reason = "Replica cannot sustain sufficient bandwidth";
+			break;
+		}
+
+		now = get_time ();
+
+		if (now - last_check >= REPLICA_TABLE_CHECK) {
+			last_check = now;
+			stamp = info.replicate_from && sourcetable_mtime (SOURCETABLE_REPLICA) ? sourcetable_mtime (SOURCETABLE_REPLICA)
+				: sourcetable_mtime (SOURCETABLE_FILE);
+			if (stamp != table_time) {
+				table_time = stamp;
+				replica_put_table (&buf);
+			}
+		}
+
+		if (buf.len == 0 && now - last_send >= REPLICA_PING)
+			replica_put (&buf, REPLICA_KEEPALIVE, NULL, NULL, 0);
+
+		if (buf.len > 0) {
+			if (sock_write_bytes (con->sock, buf.data, buf.len) != buf.len)
+				break;
+			stats_count (write_bytes, buf.len);
+			last_send = now;
+			buf.len = 0;
+		}
+
+		if (mt->ping == 1)
+			mt->ping = 0;
+	}
+
+	internal_lock_mutex (&replica_mutex);
+	for (fp = &replica_feeds; *fp != feed; fp = &(*fp)->next)
+		;
+	*fp = feed->next;
+	ice_atomic_sub (&replica_feed_count, 1);
+	internal_unlock_mutex (&replica_mutex);
+
+	for (i = 0; i < feed->count; i++) {
+		nfree (feed->cursor[i].mount);
+	}
+	if (feed->cursor) {
+		nfree (feed->cursor);
+	}
+	if (feed->out.data) {
+		nfree (feed->out.data);
+	}
+	nfree (feed);
+	if (buf.data) {
+		nfree (buf.data);
+	}
+
+	kick_not_connected (con, reason);
+}
+
+/* Read len bytes from the parent, 0 if it's gone, silent for timeout seconds or we stop */
+static int
+replica_read (SOCKET sock, char *buf, int len, int timeout)
+{
+	struct pollfd pfd;
+	time_t until = get_time () + timeout;
+	int got;
+
+	while (len > 0) {
+		if (running != SERVER_RUNNING || get_time () > until)
+			return 0;
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll (&pfd, 1, 1000) <= 0)
+			continue;
+
+		got = sock_recv (sock, buf, len, 0);
+		if (got == 0 || (got < 0 && !is_recoverable (errno)))
+			return 0;
+		if (got > 0) {
+			buf += got;
+			len -= got;
+		}
+	}
+
+	return 1;
+}
+
+/* Log in to the parent, returns the socket or INVALID_SOCKET */
+static SOCKET
+replica_connect (const char *host, int port)
+{
+	SOCKET sock;
+	char line[BUFSIZE];
+	int len;
+
+	sock = sock_connect_wto (host, port, 10);
+	if (!sock_valid (sock)) {
+		write_log (LOG_DEFAULT, "WARNING: Replication: could not connect to %s:%d", host, port);
+		return INVALID_SOCKET;
+	}
+
+	sock_set_blocking (sock, SOCK_NONBLOCK);
+	sock_apply_policy (sock, SOCK_ROLE_RELAY);
+
+	snprintf (line, BUFSIZE, "REPLICATE %s %s\r\nUser-Agent: NTRIP NtripCaster/%s\r\n\r\n", info.replicate_password,
+		  info.replicate_mounts ? info.replicate_mounts : "*", info.version);
+
+	len = sock_write_bytes (sock, line, ice_strlen (line));
+	if (len < 0 || (size_t) len != ice_strlen (line)) {
+		sock_close (sock);
+		return INVALID_SOCKET;
+	}
+
+	/* The answer line, byte by byte as the frames follow right after it */
+	len = 0;
+	while (len < BUFSIZE - 1 && replica_read (sock, line + len, 1, REPLICA_TIMEOUT) && line[len] != '\n')
+		len++;
+	line[len] = '\0';
+
+	if (ice_strncmp (line, "OK", 2) != 0) {
+		write_log (LOG_DEFAULT, "WARNING: Replication: %s:%d refused with [%s]", host, port, clean_string (line));
+		sock_close (sock);
+		return INVALID_SOCKET;
+	}
+
+	return sock;
+}
+
+static replica_mount_t *
+replica_find (replica_edge_t *edge, const char *mount)
+{
+	int i;
+
+	for (i = 0; i < edge->count; i++)
+		if (strcmp (edge->mount[i].mount, mount) == 0)
+			return &edge->mount[i];
+
+	return NULL;
+}
+
+/* Stop feeding the replica source of m, it sees the end of its stream */
+static void
+replica_close (replica_mount_t *m)
+{
+	if (!sock_valid (m->fd))
+		return;
+
+	sock_close (m->fd);
+	m->fd = INVALID_SOCKET;
+
+	if (m->rest) {
+		nfree (m->rest);
+	}
+	m->rest_len = 0;
+
+	if (m->dropped > 0)
+		write_log (LOG_DEFAULT, "WARNING: Replication: dropped %lu bytes on mountpoint %s", m->dropped, m->mount);
+	m->dropped = 0;
+}
+
+/*
+ * Stop feeding the replica source of m, and kick it if it's still up.
+ * It may stay in the source tree until its thread sees the kick, as a
+ * killed replica_e source, which replica_taken() doesn't count.
+ */
+static void
+replica_retire (replica_mount_t *m)
+{
+	avl_traverser trav = {0};
+	connection_t *scon;
+	int live = sock_valid (m->fd);
+
+	replica_close (m);
+
+	/* Gone already, or ended here */
+	if (!live)
+		return;
+
+	thread_mutex_lock (&info.source_mutex);
+
+	while ((scon = avl_traverse (info.sources, &trav))) {
+		if (scon->id == m->id) {
+			if (scon->food.source->connected == SOURCE_CONNECTED)
+				kick_connection (scon, "Stream ended");
+			break;
+		}
+	}
+
+	thread_mutex_unlock (&info.source_mutex);
+}
+
+/* Is mount served here? Retired replica sources on their way out don't count */
+static int
+replica_taken (const char *mount)
+{
+	avl_traverser trav = {0};
+	connection_t *scon;
+	source_t *source;
+	int taken = 0;
+
+	thread_mutex_lock (&info.source_mutex);
+
+	while (!taken && (scon = avl_traverse (info.sources, &trav))) {
+		source = scon->food.source;
+		if (ice_strcmp ((char *) mount, source->audiocast.mount) == 0 && source->connected != SOURCE_PENDING
+		    && !(source->type == replica_e && source->connected == SOURCE_KILLED))
+			taken = 1;
+	}
+
+	thread_mutex_unlock (&info.source_mutex);
+
+	return taken;
+}
+
+/* The parent has a new source, start its replica source */
+static void
+replica_up (replica_edge_t *edge, const char *mount, const char *agent)
+{
+	replica_mount_t *m, *grown;
+	connection_t *con;
+	source_t *source;
+	int pair[2];
+
+	if ((m = replica_find (edge, mount))) {
+		replica_retire (m);
+	} else {
+		if (edge->count == edge->size) {
+			edge->size = edge->size ? edge->size * 2 : 16;
+			grown = (replica_mount_t *) nmalloc (edge->size * sizeof (replica_mount_t));
+			if (edge->count > 0)
+				memcpy (grown, edge->mount, edge->count * sizeof (replica_mount_t));
+			if (edge->mount) {
+				nfree (edge->mount);
+			}
+			edge->mount = grown;
+		}
+		m = &edge->mount[edge->count++];
+		m->mount = nstrdup (mount);
+		m->fd = INVALID_SOCKET;
+		m->dropped = 0;
+		m->rest = NULL;
+		m->rest_len = 0;
+	}
+
+	if (!mount[0] || replica_taken (mount)) {
+		write_log (LOG_DEFAULT, "Replication: mountpoint %s is taken here, not replicating it", mount);
+		return;
+	}
+
+	if (!add_source ()) {
+		write_log (LOG_DEFAULT, "WARNING: Replication: too many sources for mountpoint %s", mount);
+		return;
+	}
+
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		write_log (LOG_DEFAULT, "ERROR: Replication: socketpair() failed: %s", strerror (errno));
+		del_source ();
+		return;
+	}
+
+	con = create_connection ();
+	con->sock = pair[0];
+	con->id = new_id ();
+	con->connect_time = get_time ();
+	con->connect_usec = get_mono_usec ();
+	con->host = nstrdup (info.replicate_from);
+
+	put_source (con);
+	source = con->food.source;
+	source->type = replica_e;
+	source->audiocast.mount = my_strdup (mount);
+	source->source_agent = my_strdup (agent);
+	source->connected = SOURCE_CONNECTED;
+
+	thread_mutex_lock (&info.source_mutex);
+	avl_insert (info.sources, con);
+	thread_mutex_unlock (&info.source_mutex);
+
+	sock_set_blocking (pair[1], SOCK_NONBLOCK);
+	m->fd = pair[1];
+	m->id = con->id;
+
+	write_log (LOG_DEFAULT, "Replicating mountpoint %s from %s. %d sources connected", mount, info.replicate_from, info.num_sources);
+
+	thread_create ("Source Thread", source_func, (void *) con);
+}
+
+static void
+replica_down (replica_edge_t *edge, const char *mount)
+{
+	replica_mount_t *m = replica_find (edge, mount);
+
+	if (!m)
+		return;
+
+	replica_retire (m);
+	nfree (m->mount);
+	*m = edge->mount[--edge->count];
+}
+
+/* Send to the replica source, -1 if it is gone */
+static int
+replica_send (replica_mount_t *m, const char *data, int len)
+{
+	int sent = send (m->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	if (sent < 0 && !is_recoverable (errno)) {
+		/* Kicked here */
+		write_log (LOG_DEFAULT, "Replication: mountpoint %s ended here, not replicating it any more", m->mount);
+		replica_close (m);
+		return -1;
+	}
+
+	return sent > 0 ? sent : 0;
+}
+
+/*
+ * Pass a frame on to the replica source. What it has no room for is kept
+ * and goes first with the next frame, the stream is only ever cut between
+ * frames: a frame that comes while the last one isn't through is lost.
+ */
+static void
+replica_data (replica_edge_t *edge, const char *mount, const char *data, int len)
+{
+	replica_mount_t *m = replica_find (edge, mount);
+	int sent;
+
+	if (!m || !sock_valid (m->fd) || len <= 0)
+		return;
+
+	if (m->rest_len > 0) {
+		if ((sent = replica_send (m, m->rest, m->rest_len)) < 0)
+			return;
+		m->rest_len -= sent;
+		memmove (m->rest, m->rest + sent, m->rest_len);
+
+		if (m->rest_len > 0) {
+			if (m->dropped == 0)
+				write_log (LOG_DEFAULT, "WARNING: Replication: source on mountpoint %s falls behind, dropping data", mount);
+			m->dropped += len;
+			return;
+		}
+		nfree (m->rest);
+	}
+
+	if ((sent = replica_send (m, data, len)) < 0 || sent == len)
+		return;
+
+	m->rest_len = len - sent;
+	m->rest = (char *) nmalloc (m->rest_len);
+	memcpy (m->rest, data + sent, m->rest_len);
+}
+
+/* Does table have a line for the mount of STR line line? Other lines count as listed */
+static int
+replica_listed (const char *table, const char *line, int len)
+{
+	const char *end, *p;
+	int keylen;
+
+	if (len < 4 || strncmp (line, "STR;", 4) != 0)
+		return 1;
+
+	end = memchr (line + 4, ';', len - 4);
+	if (!end)
+		return 1;
+	keylen = end - line + 1;
+
+	for (p = table; p && *p; p = strchr (p, '\n'), p = p ? p + 1 : NULL)
+		if (strncmp (p, line, keylen) == 0)
+			return 1;
+
+	return 0;
+}
+
+/* Write our sourcetable with the parent's mounts that it doesn't list */
+static void
+replica_merge_table (replica_edge_t *edge)
+{
+	FILE *ifp, *ofp;
+	char *local = NULL, *line, *next;
+	long size = 0;
+	int len;
+
+	edge->table_local = sourcetable_mtime (SOURCETABLE_FILE);
+
+	if ((ifp = fopen (SOURCETABLE_FILE, "r"))) {
+		if (fseek (ifp, 0, SEEK_END) == 0 && (size = ftell (ifp)) > 0) {
+			rewind (ifp);
+			local = (char *) nmalloc (size + 1);
+			size = fread (local, 1, size, ifp);
+			local[size] = '\0';
+		}
+		fclose (ifp);
+	}
+
+	if (!(ofp = fopen (SOURCETABLE_REPLICA ".tmp", "w"))) {
+		write_log (LOG_DEFAULT, "WARNING: Replication: could not write %s: %s", SOURCETABLE_REPLICA, strerror (errno));
+		if (local) {
+			nfree (local);
+		}
+		return;
+	}
+
+	if (local && size > 0) {
+		fwrite (local, 1, size, ofp);
+		if (local[size - 1] != '\n')
+			fputc ('\n', ofp);
+	}
+
+	for (line = edge->table; line && *line; line = next) {
+		next = strchr (line, '\n');
+		len = next ? (int) (next - line) : (int) ice_strlen (line);
+		next = next ? next + 1 : line + len;
+		if (!replica_listed (local, line, len)) {
+			fwrite (line, 1, len, ofp);
+			fputc ('\n', ofp);
+		}
+	}
+
+	fclose (ofp);
+	if (rename (SOURCETABLE_REPLICA ".tmp", SOURCETABLE_REPLICA) < 0)
+		write_log (LOG_DEFAULT, "WARNING: Replication: could not write %s: %s", SOURCETABLE_REPLICA, strerror (errno));
+
+	if (local) {
+		nfree (local);
+	}
+}
+
+/* Take frames from the parent until it's gone */
+static void
+replica_follow (replica_edge_t *edge, mythread_t *mt)
+{
+	unsigned char hdr[REPLICA_HEADER];
+	char name[REPLICA_MOUNTLEN + 1], *payload = NULL;
+	unsigned int len, size = 0;
+	time_t now, last_check = get_time ();
+
+	while (thread_alive (mt) && running == SERVER_RUNNING) {
+		if (!replica_read (edge->sock, (char *) hdr, REPLICA_HEADER, REPLICA_TIMEOUT))
+			break;
+
+		memcpy (&len, hdr + 4, 4);
+		len = ntohl (len);
+		if (len > REPLICA_MAXFRAME) {
+			write_log (LOG_DEFAULT, "WARNING: Replication: frame of %u bytes from %s", len, info.replicate_from);
+			break;
+		}
+
+		if (len + 1 > size) {
+			if (payload) {
+				nfree (payload);
+			}
+			size = len + 1;
+			payload = (char *) nmalloc (size);
+		}
+
+		if (!replica_read (edge->sock, name, hdr[1], REPLICA_TIMEOUT) || !replica_read (edge->sock, payload, len, REPLICA_TIMEOUT))
+			break;
+		name[hdr[1]] = '\0';
+		payload[len] = '\0';
+
+		switch (hdr[0]) {
+			case REPLICA_UP:
+				replica_up (edge, name, payload);
+				break;
+			case REPLICA_DATA:
+				replica_data (edge, name, payload, len);
+				break;
+			case REPLICA_DOWN:
+				replica_down (edge, name);
+				break;
+			case REPLICA_TABLE:
+				if (edge->table) {
+					nfree (edge->table);
+				}
+				edge->table = nstrdup (payload);
+				replica_merge_table (edge);
+				break;
+			default:
+				/* REPLICA_KEEPALIVE, and what a newer parent may send */
+				break;
+		}
+
+		now = get_time ();
+		if (now - last_check >= REPLICA_TABLE_CHECK) {
+			last_check = now;
+			if (edge->table && sourcetable_mtime (SOURCETABLE_FILE) != edge->table_local)
+				replica_merge_table (edge);
+		}
+
+		if (mt->ping == 1)
+			mt->ping = 0;
+	}
+
+	if (payload) {
+		nfree (payload);
+	}
+}
+
+void *
+replica_thread (void *arg)
+{
+	replica_edge_t edge;
+	mythread_t *mt;
+	char host[BUFSIZE], *colon;
+	int port = REPLICA_PORT, attempt = 0;
+	long wait;
+
+	thread_init ();
+
+	mt = thread_get_mythread ();
+	memset (&edge, 0, sizeof (edge));
+
+	snprintf (host, BUFSIZE, "%s", info.replicate_from);
+	if ((colon = strrchr (host, ':'))) {
+		*colon = '\0';
+		port = atoi (colon + 1);
+	}
+
+	while (thread_alive (mt) && running == SERVER_RUNNING) {
+		edge.sock = replica_connect (host, port);
+
+		if (sock_valid (edge.sock)) {
+			attempt = 0;
+			write_log (LOG_DEFAULT, "Replicating mounts %s from %s", info.replicate_mounts ? info.replicate_mounts : "*",
+				   info.replicate_from);
+
+			replica_follow (&edge, mt);
+
+			while (edge.count > 0)
+				replica_down (&edge, edge.mount[0].mount);
+			sock_close (edge.sock);
+
+			if (running == SERVER_RUNNING)
+				write_log (LOG_DEFAULT, "WARNING: Replication: lost %s, reconnecting", info.replicate_from);
+		}
+
+		/* Back off while the parent is down, in steps that notice a shutdown */
+		wait = timer_backoff (attempt++, REPLICA_RETRY, REPLICA_RETRY_MAX);
+		for (; wait > 0 && thread_alive (mt) && running == SERVER_RUNNING; wait -= 1000) {
+			my_sleep ((wait < 1000 ? wait : 1000) * 1000);
+			if (mt->ping == 1)
+				mt->ping = 0;
+		}
+	}
+
+	if (edge.mount) {
+		nfree (edge.mount);
+	}
+	if (edge.table) {
+		nfree (edge.table);
+	}
+
+	thread_exit (0);
+	return NULL;
+}
+
+/* Set up replication, and start replicating from replicate_from if it's set */
+void
+replica_start ()
+{
+	thread_create_mutex (&replica_mutex);
+	thread_cond_create (&replica_cond);
+
+	if (!info.replicate_from)
+		return;
+
+	if (!info.replicate_password) {
+		write_log (LOG_DEFAULT, "ERROR: replicate_from needs replicate_password, not replicating");
+		return;
+	}
+
+	/* The parent's mounts of the last run are stale */
+	unlink (SOURCETABLE_REPLICA);
+
+	write_log (LOG_DEFAULT, "Starting Replication Thread...");
+	thread_create ("Replication Thread", replica_thread, NULL);
+}
+
+#else
+
+void
+replica_login (connection_t *con, char *expr)
+{
+	write_400 (con);
+	kick_not_connected (con, "Invalid header");
+}
+
+void
+replica_publish (connection_t *con)
+{
+}
+
+void
+replica_start ()
+{
+}
+
+#endif
@@ -46,17 +46,43 @@ void source_login(connection_t *con, char *line);
 void kick_source(source_t *sor, char *why);
 void *source_func(void *con);
 void put_source(connection_t *con);
-void add_source ();
+int add_source ();
 void del_source ();
 connection_t *find_mount_with_req (request_t *req);
 void add_chunk (connection_t *sourcecon);
-void write_chunk (source_t *source, connection_t *clicon);
+void write_chunk (source_t *source, int i);
+void write_chunks_uring (source_t *source);
 void kick_clients_on_cid (source_t *source);
-void kick_dead_clients (source_t *source);
-int write_data (connection_t *clicon, source_t *source);
+connection_t *kick_dead_clients (source_t *source);
+int write_data (source_t *source, int i);
 int finish_meta_frame (connection_t *clicon);
 const char *sourcetype_to_string (source_type_t type);
 int start_chunk (source_t *source);
-void source_write_to_client (source_t *source, connection_t *clicon);
+void source_write_to_client (source_t *source, int i);
 void source_get_new_clients (source_t *source);
+
+/* clientset.h. ajd ****************************************************************************/
+#define CLIENT_SET_MIN 16
+
+/* Chunks the client in slot s is behind the source */
+#define client_slot_errors(source, s) ((CHUNKLEN - ((s)->cid - (source)->cid)) % CHUNKLEN)
+
+void client_set_init (client_set_t *set);
+void client_set_destroy (client_set_t *set);
+void client_set_add (source_t *source, connection_t *clicon);
+int client_set_remove (source_t *source, connection_t *clicon);
+void client_set_kill (connection_t *clicon);
+time_t client_set_time (client_set_t *set);
+
+int bus_init (int mounts);
+int bus_claim (connection_t *con);
+void bus_release (connection_t *con);
+void bus_publish (connection_t *con);
+connection_t *bus_mirror (const char *path);
+void bus_read_chunk (connection_t *con);
+
+void replica_login (connection_t *con, char *expr);
+void replica_publish (connection_t *con);
+void replica_start ();
+FILE *sourcetable_open ();
 #endif
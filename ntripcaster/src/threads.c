@@ -75,6 +75,7 @@
 # endif
 #else
 #include <pthread.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #endif
@@ -82,6 +83,7 @@
 #include "avl.h"
 #include "threads.h"
 #include "ntripcaster.h"
+#define LOG_MODULE LOG_MOD_THREADS
 #include "log.h"
 #include "utility.h"
 #include "ntrip_string.h"
@@ -100,6 +102,20 @@ extern server_info_t info;
 
 mutex_t library_mutex = {MUTEX_STATE_UNINIT};
 
+/* The calling thread's entry in info.threads. It is looked up once and
+ * kept in thread local storage, so the tree is only touched when a thread
+ * is created, first asks for itself, and exits. */
+static THREAD_LOCAL mythread_t *thread_me = NULL;
+
+static mutex_t lockprof_mutex = {MUTEX_STATE_UNINIT};
+
+static void lockprof_lock (mutex_t *mutex, int line, const char *file);
+static void lockprof_unlock (mutex_t *mutex);
+
+/* Take and give back a mutex, through the profiler when it is on */
+#define mutex_acquire(m, l, f) do { if (info.lock_profile) lockprof_lock (m, l, f); else internal_lock_mutex (m); } while (0)
+#define mutex_release(m) do { if ((m)->prof_site) lockprof_unlock (m); internal_unlock_mutex (m); } while (0)
+
 #ifdef DEBUG_MEMORY
 void thread_mem_check(mythread_t *thread)
 {
@@ -276,7 +292,7 @@ void
 thread_mutex_lock_c (mutex_t *mutex, int line, char *file)
 {
 #ifdef OPTIMIZE
-	internal_lock_mutex(mutex);
+	mutex_acquire (mutex, line, file);
 	return;
 #else
 
@@ -313,19 +329,16 @@ thread_mutex_lock_c (mutex_t *mutex, int line, char *file)
 				locks++;
 		}
 
-		if (locks > 0) /* Has already got a mutex locked */
+		if (locks > 0 && mutex == &info.source_mutex) /* Source tree mutex has to come first */
 		{
-			if (info.double_mutex.thread_id != mt->id) /* Tries to lock two mutexes, but has not got the double mutex */
-			{
-				write_log (LOG_DEFAULT, "WARNING: (%d != %d) Thread %d [%s] tries to lock a second mutex [%s] in file %s line %d, without locking double mutex!",
-					   info.double_mutex.thread_id, mt->id, mt->id, mt->name, mutex_to_string (mutex, name), file, line);
-			}
+			write_log (LOG_DEFAULT, "WARNING: Thread %d [%s] locks [%s] in file %s line %d while holding %d other mutexes, breaking the lock order!",
+				   mt->id, mt->name, mutex_to_string (mutex, name), file, line, locks);
 		}
 		internal_unlock_mutex (&info.mutex_mutex);
 	}
 # endif
 	
-	internal_lock_mutex(mutex);
+	mutex_acquire (mutex, line, file);
 
 # ifndef SAVE_CPU
 #  ifdef DEBUG_MUTEXES
@@ -347,7 +360,7 @@ void
 thread_mutex_unlock_c(mutex_t *mutex, int line, char *file)
 {
 #ifdef OPTIMIZE
-	internal_unlock_mutex(mutex);
+	mutex_release (mutex);
 	return;
 #else
 	
@@ -364,7 +377,6 @@ thread_mutex_unlock_c(mutex_t *mutex, int line, char *file)
 # ifdef DEBUG_MUTEXES
 	if (mt)
 	{
-		int locks = 0;
 		avl_traverser trav = {0};
 		mutex_t *tmutex;
 		internal_lock_mutex (&info.mutex_mutex);
@@ -379,20 +391,14 @@ thread_mutex_unlock_c(mutex_t *mutex, int line, char *file)
 					internal_unlock_mutex (&info.mutex_mutex);
 					return;
 				}
-			} else if (tmutex->thread_id == mt->id)
-				locks++;
+			}
 		}
 
-		if ((locks > 0) && (info.double_mutex.thread_id != mt->id)) /* Don't have double mutex, has more than this mutex left */
-		{
-			write_log (LOG_DEFAULT, "WARNING: (%d != %d) Thread %d [%s] tries to unlock a mutex [%s] in file %s line %d, without owning double mutex!",
-				   info.double_mutex.thread_id, mt->id, mt->id, mt->name, mutex_to_string (mutex, name), file, line);
-		}
 		internal_unlock_mutex (&info.mutex_mutex);
 	}
 # endif
 
-	internal_unlock_mutex(mutex);
+	mutex_release (mutex);
 
 # ifndef SAVE_CPU
 #  ifdef DEBUG_MUTEXES
@@ -434,10 +440,14 @@ thread_exit_c (int val, int line, char *file)
 	
 	if (mt)	{
 		xa_debug(2, "DEBUG: Removing thread %d started at [%s:%d], reason: 'Thread Exited'", mt->id, mt->file, mt->line);
+		log_thread_release ();
+		slab_thread_release ();
+		lockprof_thread_release ();
 
 		internal_lock_mutex(&info.thread_mutex);
 		out = avl_delete (info.threads, mt);
 		internal_unlock_mutex(&info.thread_mutex);
+		thread_me = NULL;
 
 		if (out) {
 			if (out->id == 0)
@@ -505,6 +515,8 @@ thread_catch_signals ()
 	sigaddset (&ss, SIGHUP);
 	sigaddset (&ss, SIGCHLD);
 	sigaddset (&ss, SIGINT);
+	sigaddset (&ss, SIGUSR1);
+	sigaddset (&ss, SIGUSR2);
 
 #ifdef SIGPIPE
 	sigaddset (&ss, SIGPIPE);
@@ -573,56 +585,58 @@ thread_mutex_new ()
 	return info.mutexid;
 }
 
-mythread_t *
-thread_get_mythread()
+static mythread_t *
+thread_lookup ()
 {
 	avl_traverser trav = {0};
 	mythread_t *mt;
 	icethread_t t = thread_self ();
 
 	internal_lock_mutex(&info.thread_mutex);
-
-	if (info.threads == NULL)
-	{
-		fprintf (stderr, "WARNING: Thread tree is empty, this must be wrong!");
-		internal_unlock_mutex (&info.thread_mutex);
-		return NULL;
-	}
 	
 	while ((mt = avl_traverse(info.threads, &trav))) {
 		if (thread_equal(t, mt->thread)) {
 			internal_unlock_mutex(&info.thread_mutex);
+			thread_me = mt;
 			return mt;
 		}
 	}
 	internal_unlock_mutex (&info.thread_mutex);
-	write_log (LOG_DEFAULT, "WARNING: Nonexistant thread alive...");
 	return NULL;
 }
 
 mythread_t *
-thread_check_created()
+thread_get_mythread()
 {
-	avl_traverser trav = {0};
 	mythread_t *mt;
-	icethread_t t = thread_self ();
+
+	if (thread_me)
+		return thread_me;
 
 	if (info.threads == NULL)
 	{
 		fprintf (stderr, "WARNING: Thread tree is empty, this must be wrong!");
 		return NULL;
 	}
-
-	internal_lock_mutex(&info.thread_mutex);
 	
-	while ((mt = avl_traverse(info.threads, &trav))) {
-		if (thread_equal(t, mt->thread)) {
-			internal_unlock_mutex(&info.thread_mutex);
-			return mt;
-		}
+	if (!(mt = thread_lookup ()))
+		write_log (LOG_DEFAULT, "WARNING: Nonexistant thread alive...");
+	return mt;
+}
+
+mythread_t *
+thread_check_created()
+{
+	if (thread_me)
+		return thread_me;
+
+	if (info.threads == NULL)
+	{
+		fprintf (stderr, "WARNING: Thread tree is empty, this must be wrong!");
+		return NULL;
 	}
-	internal_unlock_mutex (&info.thread_mutex);
-	return NULL;
+
+	return thread_lookup ();
 }
 
 void 
@@ -680,6 +694,54 @@ void internal_unlock_mutex(mutex_t *mutex)
 #endif
 }
 
+void 
+thread_cond_create (thread_cond_t *cond)
+{
+#ifdef _WIN32
+	cond->event = CreateEvent (NULL, TRUE, FALSE, NULL);
+#else
+	pthread_cond_init (&cond->cond, NULL);
+#endif
+}
+
+/*
+ * Wait at most msecs milliseconds for cond to be signalled.
+ * mutex must be locked with internal_lock_mutex(), it is unlocked
+ * while waiting. Spurious wakeups happen, recheck the condition.
+ */
+void 
+thread_cond_timedwait (thread_cond_t *cond, mutex_t *mutex, long msecs)
+{
+#ifdef _WIN32
+	LeaveCriticalSection (&mutex->mutex);
+	WaitForSingleObject (cond->event, msecs);
+	EnterCriticalSection (&mutex->mutex);
+#else
+	struct timeval now;
+	struct timespec until;
+
+	gettimeofday (&now, NULL);
+	until.tv_sec = now.tv_sec + msecs / 1000;
+	until.tv_nsec = now.tv_usec * 1000L + (msecs % 1000) * 1000000L;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+
+	pthread_cond_timedwait (&cond->cond, &mutex->mutex, &until);
+#endif
+}
+
+void 
+thread_cond_broadcast (thread_cond_t *cond)
+{
+#ifdef _WIN32
+	PulseEvent (cond->event);
+#else
+	pthread_cond_broadcast (&cond->cond);
+#endif
+}
+
 void thread_lib_init()
 {
 	info.mutexes = NULL;
@@ -687,6 +749,7 @@ void thread_lib_init()
 
 	info.mutexes = avl_create_nl (compare_mutexes, &info);
 	thread_create_mutex_nl (&info.mutex_mutex);
+	thread_create_mutex_nl (&lockprof_mutex);
 	thread_create_mutex (&library_mutex);	
 }
 
@@ -935,3 +998,532 @@ initialize_memory_checker ()
 #endif
 }
 
+/* slab.c. ajd ***************************************************************************/
+
+slab_cache_t connection_slab, client_slab, source_slab, sockaddr_slab;
+
+static slab_cache_t *slab_caches[SLAB_MAX_CACHES];
+static int slab_num_caches = 0;
+
+/* The magazines of a thread, listed so the stats can add up their counts */
+typedef struct slab_thread_St
+{
+	struct slab_thread_St *next;
+	slab_magazine_t mag[SLAB_MAX_CACHES];
+} slab_thread_t;
+
+static slab_thread_t *slab_live = NULL;		/* Magazines of running threads */
+static slab_thread_t *slab_free_threads = NULL;	/* Given back by threads that exited */
+static mutex_t slab_thread_mutex = {MUTEX_STATE_UNINIT};
+static THREAD_LOCAL slab_thread_t *slab_mine = NULL;
+
+static void
+slab_create (slab_cache_t *cache, const char *name, unsigned int size)
+{
+	memset (cache, 0, sizeof (slab_cache_t));
+
+	cache->name = name;
+	cache->size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+	cache->per_slab = SLAB_BYTES / cache->size;
+	if (cache->per_slab < 1)
+		cache->per_slab = 1;
+
+	/* Big objects (sources) shouldn't be hoarded in magazines */
+	cache->batch = SLAB_MAGAZINE / 2;
+	if (cache->batch > (int) cache->per_slab)
+		cache->batch = cache->per_slab;
+	cache->index = slab_num_caches;
+
+	thread_create_mutex (&cache->mutex);
+
+	slab_caches[slab_num_caches++] = cache;
+}
+
+/*
+ * Set up the object caches, before any connection comes in.
+ * Assert Class: 1
+ */
+void
+slab_init ()
+{
+	thread_create_mutex (&slab_thread_mutex);
+
+	slab_create (&connection_slab, "connection", sizeof (connection_t));
+	slab_create (&client_slab, "client", sizeof (client_t));
+	slab_create (&source_slab, "source", sizeof (source_t));
+	slab_create (&sockaddr_slab, "sockaddr", sizeof (struct sockaddr_in));
+}
+
+#ifndef DEBUG_MEMORY
+static slab_thread_t *
+slab_thread_get ()
+{
+	slab_thread_t *st;
+
+	internal_lock_mutex (&slab_thread_mutex);
+
+	if ((st = slab_free_threads))
+		slab_free_threads = st->next;
+	else
+		st = (slab_thread_t *) nmalloc (sizeof (slab_thread_t));
+
+	memset (st, 0, sizeof (slab_thread_t));
+	st->next = slab_live;
+	slab_live = st;
+
+	internal_unlock_mutex (&slab_thread_mutex);
+
+	slab_mine = st;
+	return st;
+}
+
+/* Carve up a new slab into the depot. Must have cache->mutex. */
+static int
+slab_grow (slab_cache_t *cache)
+{
+	/* Not nmalloc(), slabs are never freed */
+	char *slab = (char *) malloc ((size_t) cache->size * cache->per_slab);
+	unsigned int i;
+
+	if (!slab)
+		return 0;
+
+	for (i = 0; i < cache->per_slab; i++) {
+		void **obj = (void **) (slab + (size_t) i * cache->size);
+		*obj = cache->depot;
+		cache->depot = obj;
+	}
+
+	cache->depot_free += cache->per_slab;
+	cache->objects += cache->per_slab;
+	cache->slabs++;
+	return 1;
+}
+
+/* Give all but keep objects of the magazine back to the depot */
+static void
+slab_flush (slab_cache_t *cache, slab_magazine_t *mag, int keep)
+{
+	internal_lock_mutex (&cache->mutex);
+
+	while (mag->count > keep) {
+		void **obj = (void **) mag->objs[--mag->count];
+		*obj = cache->depot;
+		cache->depot = obj;
+		cache->depot_free++;
+	}
+
+	cache->flushes++;
+	internal_unlock_mutex (&cache->mutex);
+}
+#endif
+
+/*
+ * Get a zeroed object from cache, from the thread's magazine if possible.
+ * With DEBUG_MEMORY this is plain n_malloc(), so leaks still show up.
+ * Assert Class: 1
+ */
+void *
+slab_alloc_c (slab_cache_t *cache, const int lineno, const char *file)
+{
+	void *obj;
+#ifdef DEBUG_MEMORY
+	obj = n_malloc (cache->size, lineno, file);
+#else
+	slab_thread_t *st = slab_mine ? slab_mine : slab_thread_get ();
+	slab_magazine_t *mag = &st->mag[cache->index];
+
+	if (mag->count == 0) {
+		internal_lock_mutex (&cache->mutex);
+
+		while (mag->count < cache->batch) {
+			if (!cache->depot && !slab_grow (cache))
+				break;
+			obj = cache->depot;
+			cache->depot = *(void **) obj;
+			cache->depot_free--;
+			mag->objs[mag->count++] = obj;
+		}
+
+		cache->refills++;
+		internal_unlock_mutex (&cache->mutex);
+
+		if (mag->count == 0) {
+			fprintf (stderr, "OUCH, out of memory!");
+			clean_shutdown (&info);
+			return NULL;
+		}
+	}
+
+	obj = mag->objs[--mag->count];
+	/* Only this thread writes it, the store just keeps readers from tearing it */
+	ice_atomic_store (&mag->in_use, mag->in_use + 1);
+#endif
+	memset (obj, 0, cache->size);
+	return obj;
+}
+
+/*
+ * Put ptr back into the thread's magazine, half of which goes back to
+ * the depot when it is full. Objects may be freed by any thread.
+ * Assert Class: 1
+ */
+void
+slab_free_c (slab_cache_t *cache, void *ptr, const int lineno, const char *file)
+{
+#ifdef DEBUG_MEMORY
+	n_free (ptr, lineno, file);
+#else
+	slab_thread_t *st;
+	slab_magazine_t *mag;
+
+	if (!ptr)
+		return;
+
+	st = slab_mine ? slab_mine : slab_thread_get ();
+	mag = &st->mag[cache->index];
+
+	if (mag->count >= 2 * cache->batch)
+		slab_flush (cache, mag, cache->batch);
+
+	mag->objs[mag->count++] = ptr;
+	ice_atomic_store (&mag->in_use, mag->in_use - 1);
+#endif
+}
+
+/* Called by exiting threads, so their magazines and counts aren't lost */
+void
+slab_thread_release ()
+{
+#ifndef DEBUG_MEMORY
+	slab_thread_t *st = slab_mine, **pp;
+	int i;
+
+	if (!st)
+		return;
+
+	slab_mine = NULL;
+
+	internal_lock_mutex (&slab_thread_mutex);
+
+	for (i = 0; i < slab_num_caches; i++) {
+		slab_magazine_t *mag = &st->mag[i];
+
+		if (mag->count > 0)
+			slab_flush (slab_caches[i], mag, 0);
+
+		internal_lock_mutex (&slab_caches[i]->mutex);
+		slab_caches[i]->in_use += mag->in_use;
+		internal_unlock_mutex (&slab_caches[i]->mutex);
+	}
+
+	for (pp = &slab_live; *pp; pp = &(*pp)->next) {
+		if (*pp == st) {
+			*pp = st->next;
+			break;
+		}
+	}
+	st->next = slab_free_threads;
+	slab_free_threads = st;
+
+	internal_unlock_mutex (&slab_thread_mutex);
+#endif
+}
+
+/* The cache with the given index, NULL past the last one */
+slab_cache_t *
+slab_cache (int index)
+{
+	if (index < 0 || index >= slab_num_caches)
+		return NULL;
+	return slab_caches[index];
+}
+
+/* The objects in use are counted per thread, and only added up here */
+void
+slab_get_stats (slab_cache_t *cache, slab_stats_t *stats)
+{
+	long int in_use;
+#ifndef DEBUG_MEMORY
+	slab_thread_t *st;
+#endif
+
+	internal_lock_mutex (&slab_thread_mutex);
+
+	internal_lock_mutex (&cache->mutex);
+	stats->objects = cache->objects;
+	stats->depot_free = cache->depot_free;
+	stats->bytes = cache->objects * cache->size;
+	stats->refills = cache->refills;
+	stats->flushes = cache->flushes;
+	in_use = cache->in_use;
+	internal_unlock_mutex (&cache->mutex);
+
+#ifndef DEBUG_MEMORY
+	for (st = slab_live; st; st = st->next)
+		in_use += ice_atomic_load (&st->mag[cache->index].in_use);
+#endif
+
+	internal_unlock_mutex (&slab_thread_mutex);
+
+	stats->in_use = in_use > 0 ? (unsigned long int) in_use : 0;
+	if (stats->in_use + stats->depot_free > stats->objects)
+		stats->magazines = 0;
+	else
+		stats->magazines = stats->objects - stats->in_use - stats->depot_free;
+}
+
+
+/* lockprof.c. ajd ****************************************************************************/
+
+typedef struct lockprof_buf_St
+{
+	struct lockprof_buf_St *next;
+	unsigned long int dropped;	/* Locks taken with the table full */
+	lockprof_site_t site[LOCKPROF_SITES];
+} lockprof_buf_t;
+
+static lockprof_buf_t *lockprof_live = NULL;	/* Tables of running threads */
+static lockprof_buf_t *lockprof_free = NULL;	/* Given back by threads that exited */
+static lockprof_buf_t lockprof_retired;		/* Sums of threads that exited */
+static THREAD_LOCAL lockprof_buf_t *lockprof_mine = NULL;
+
+static int
+internal_trylock_mutex (mutex_t *mutex)
+{
+#ifdef _WIN32
+	return TryEnterCriticalSection (&mutex->mutex) ? 1 : 0;
+#else
+	return pthread_mutex_trylock (&mutex->mutex) == 0;
+#endif
+}
+
+static lockprof_buf_t *
+lockprof_buf_get ()
+{
+	lockprof_buf_t *buf;
+
+	internal_lock_mutex (&lockprof_mutex);
+
+	if ((buf = lockprof_free))
+		lockprof_free = buf->next;
+	else
+		buf = (lockprof_buf_t *) nmalloc (sizeof (lockprof_buf_t));
+
+	memset (buf, 0, sizeof (lockprof_buf_t));
+	buf->next = lockprof_live;
+	lockprof_live = buf;
+
+	internal_unlock_mutex (&lockprof_mutex);
+
+	lockprof_mine = buf;
+	return buf;
+}
+
+/* Find or claim the site for file:line in buf. Only the owner claims, others
+   may be reading, so the file pointer is published last. */
+static lockprof_site_t *
+lockprof_find (lockprof_buf_t *buf, const char *file, int line, int claim)
+{
+	unsigned int h = ((unsigned int) line * 2654435761u) ^ (unsigned int) ((unsigned long) file >> 3);
+	unsigned int i;
+
+	for (i = 0; i < LOCKPROF_SITES; i++) {
+		lockprof_site_t *site = &buf->site[(h + i) & (LOCKPROF_SITES - 1)];
+		const char *sfile = ice_atomic_load (&site->file);
+
+		if (!sfile) {
+			if (!claim)
+				return NULL;
+			site->line = line;
+			ice_atomic_store (&site->file, file);
+			return site;
+		}
+
+		if (site->line == line && (sfile == file || strcmp (sfile, file) == 0))
+			return site;
+	}
+
+	return NULL;
+}
+
+static void
+lockprof_lock (mutex_t *mutex, int line, const char *file)
+{
+	lockprof_buf_t *buf = lockprof_mine ? lockprof_mine : lockprof_buf_get ();
+	lockprof_site_t *site = lockprof_find (buf, file, line, 1);
+	long long now, wait = -1;
+
+	if (internal_trylock_mutex (mutex)) {
+		now = get_mono_usec ();
+	} else {
+		long long start = get_mono_usec ();
+
+		internal_lock_mutex (mutex);
+		now = get_mono_usec ();
+		wait = now - start;
+	}
+
+	if (!site) {
+		buf->dropped++;
+		return;
+	}
+
+	if (!site->mutex)
+		site->mutex = mutex;
+	site->acquires++;
+	if (wait >= 0) {
+		site->contended++;
+		site->wait_usec += wait;
+		if (wait > site->max_wait_usec)
+			site->max_wait_usec = wait;
+	}
+
+	mutex->locked_usec = now;
+	mutex->prof_site = site;
+}
+
+/* Called with the mutex still held, by the thread that took it */
+static void
+lockprof_unlock (mutex_t *mutex)
+{
+	lockprof_site_t *site = (lockprof_site_t *) mutex->prof_site;
+	long long hold = get_mono_usec () - mutex->locked_usec;
+
+	mutex->prof_site = NULL;
+
+	site->hold_usec += hold;
+	if (hold > site->max_hold_usec)
+		site->max_hold_usec = hold;
+}
+
+static void
+lockprof_merge (lockprof_site_t *to, const lockprof_site_t *from)
+{
+	if (!to->mutex)
+		to->mutex = from->mutex;
+	to->acquires += from->acquires;
+	to->contended += from->contended;
+	to->wait_usec += from->wait_usec;
+	to->hold_usec += from->hold_usec;
+	if (from->max_wait_usec > to->max_wait_usec)
+		to->max_wait_usec = from->max_wait_usec;
+	if (from->max_hold_usec > to->max_hold_usec)
+		to->max_hold_usec = from->max_hold_usec;
+}
+
+/* Fold the calling thread's table into the retired sums, on thread exit */
+void
+lockprof_thread_release ()
+{
+	lockprof_buf_t *buf = lockprof_mine, **pp;
+	lockprof_site_t *to;
+	int i;
+
+	if (!buf)
+		return;
+
+	lockprof_mine = NULL;
+
+	internal_lock_mutex (&lockprof_mutex);
+
+	for (i = 0; i < LOCKPROF_SITES; i++) {
+		if (!buf->site[i].file)
+			continue;
+		if ((to = lockprof_find (&lockprof_retired, buf->site[i].file, buf->site[i].line, 1)))
+			lockprof_merge (to, &buf->site[i]);
+		else
+			lockprof_retired.dropped += buf->site[i].acquires;
+	}
+	lockprof_retired.dropped += buf->dropped;
+
+	for (pp = &lockprof_live; *pp; pp = &(*pp)->next) {
+		if (*pp == buf) {
+			*pp = buf->next;
+			break;
+		}
+	}
+	buf->next = lockprof_free;
+	lockprof_free = buf;
+
+	internal_unlock_mutex (&lockprof_mutex);
+}
+
+/*
+ * Merge the tables of all threads into *sites, which the caller nfree()s.
+ * Numbers of running threads are read without their owners stopping, so
+ * they may be a lock or two behind. Returns the number of sites.
+ */
+int
+lockprof_collect (lockprof_site_t **sites, unsigned long int *dropped)
+{
+	lockprof_buf_t *buf, all;
+	lockprof_site_t *to;
+	int i, n = 0;
+
+	memset (&all, 0, sizeof (all));
+
+	internal_lock_mutex (&lockprof_mutex);
+
+	for (buf = &lockprof_retired; buf; buf = (buf == &lockprof_retired) ? lockprof_live : buf->next) {
+		for (i = 0; i < LOCKPROF_SITES; i++) {
+			lockprof_site_t copy = buf->site[i];
+
+			if (!(copy.file = ice_atomic_load (&buf->site[i].file)))
+				continue;
+			if ((to = lockprof_find (&all, copy.file, copy.line, 1)))
+				lockprof_merge (to, &copy);
+			else
+				all.dropped += copy.acquires;
+		}
+		all.dropped += buf->dropped;
+	}
+
+	internal_unlock_mutex (&lockprof_mutex);
+
+	*sites = (lockprof_site_t *) nmalloc (sizeof (lockprof_site_t) * LOCKPROF_SITES);
+	for (i = 0; i < LOCKPROF_SITES; i++)
+		if (all.site[i].file)
+			(*sites)[n++] = all.site[i];
+
+	if (dropped)
+		*dropped = all.dropped;
+
+	return n;
+}
+
+static int
+lockprof_compare_wait (const void *a, const void *b)
+{
+	const lockprof_site_t *sa = (const lockprof_site_t *) a, *sb = (const lockprof_site_t *) b;
+
+	if (sa->wait_usec != sb->wait_usec)
+		return sa->wait_usec < sb->wait_usec ? 1 : -1;
+	return sa->hold_usec < sb->hold_usec ? 1 : (sa->hold_usec > sb->hold_usec ? -1 : 0);
+}
+
+/* Write the profile to the log, the sites with the longest waits first */
+void
+lockprof_dump ()
+{
+	lockprof_site_t *sites;
+	unsigned long int dropped;
+	char name[40];
+	int i, n;
+
+	if (!info.lock_profile) {
+		write_log (LOG_DEFAULT, "Lock profile is off, set lock_profile 1 to collect one");
+		return;
+	}
+
+	n = lockprof_collect (&sites, &dropped);
+	qsort (sites, n, sizeof (lockprof_site_t), lockprof_compare_wait);
+
+	write_log (LOG_DEFAULT, "Lock profile, %d call sites, %lu locks not counted:", n, dropped);
+	for (i = 0; i < n; i++)
+		write_log (LOG_DEFAULT, "  %s:%d [%s] %lu locks, %lu contended, waited %lld us (max %lld), held %lld us (max %lld)",
+			   sites[i].file, sites[i].line, mutex_to_string (sites[i].mutex, name), sites[i].acquires, sites[i].contended,
+			   sites[i].wait_usec, sites[i].max_wait_usec, sites[i].hold_usec, sites[i].max_hold_usec);
+
+	nfree (sites);
+}
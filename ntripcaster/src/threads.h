@@ -55,6 +55,21 @@ typedef CRITICAL_SECTION win32_mutex_t;
 typedef pthread_t icethread_t;
 #endif
 
+/* Per thread variables and lock free counters */
+#ifdef _WIN32
+# define THREAD_LOCAL __declspec(thread)
+#else
+# define THREAD_LOCAL __thread
+#endif
+
+#define ice_atomic_load(p) __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define ice_atomic_store(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#define ice_atomic_add(p, v) __atomic_add_fetch ((p), (v), __ATOMIC_RELAXED)
+#define ice_atomic_sub(p, v) __atomic_sub_fetch ((p), (v), __ATOMIC_RELAXED)
+#define ice_atomic_swap(p, v) __atomic_exchange_n ((p), (v), __ATOMIC_ACQ_REL)
+#define ice_atomic_cas(p, old, v) __atomic_compare_exchange_n ((p), (old), (v), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define ice_atomic_fence() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
 typedef struct icemutex_St
 {
 	long int thread_id;
@@ -66,8 +81,19 @@ typedef struct icemutex_St
 	long int mutexid;
 	int lineno;
 	long int id;
+	long long locked_usec;	/* Lock profiler, when it was taken */
+	void *prof_site;	/* Lock profiler, call site holding it */
 } mutex_t;
 
+/* Condition variables, only to be used with internal_lock_mutex() */
+typedef struct icecond_St
+{
+#ifndef _WIN32
+	pthread_cond_t cond;
+#else
+	HANDLE event;
+#endif
+} thread_cond_t;
 
 #define thread_create(n,x,y) thread_create_c (n,x,y,__LINE__,__FILE__);
 #define thread_create_mutex(x) thread_create_mutex_c (x,__LINE__,__FILE__);
@@ -105,6 +131,9 @@ void thread_mutex_destroy (mutex_t *mutex);
 void thread_exit_c(int val, int line, char *file);
 void internal_lock_mutex(mutex_t *mutex);
 void internal_unlock_mutex(mutex_t *mutex);
+void thread_cond_create (thread_cond_t *cond);
+void thread_cond_timedwait (thread_cond_t *cond, mutex_t *mutex, long msecs);
+void thread_cond_broadcast (thread_cond_t *cond);
 
 /*for using un-threadsafe library functions*/
 void thread_library_lock();
@@ -128,6 +157,27 @@ mythread_t *thread_check_created();
 void thread_mem_check (mythread_t *mt);
 void thread_rename(const char *name); /* renames current thread */
 
+/* Lock contention profiler, enabled with lock_profile. Every thread counts
+ * into its own table of call sites, lockprof_collect() merges them. */
+#define LOCKPROF_SITES 128	/* Call sites per thread, a power of two */
+
+typedef struct lockprof_site_St
+{
+	const char *file;
+	int line;
+	mutex_t *mutex;			/* First mutex seen here, for its name */
+	unsigned long int acquires;
+	unsigned long int contended;	/* Trylock failed, had to wait */
+	long long wait_usec;
+	long long max_wait_usec;
+	long long hold_usec;
+	long long max_hold_usec;
+} lockprof_site_t;
+
+void lockprof_thread_release ();
+int lockprof_collect (lockprof_site_t **sites, unsigned long int *dropped);
+void lockprof_dump ();
+
 #endif
 
 
@@ -164,6 +214,61 @@ char *ice_cat (const char *first, const char *second);
 
 void initialize_memory_checker ();
 
+/* Slab caches for the objects every connection needs. Each thread keeps
+ * a magazine of free objects per cache, the shared depot is only locked
+ * when a magazine runs empty or full. Slabs are never given back. */
+#define SLAB_MAX_CACHES 8
+#define SLAB_MAGAZINE 32	/* Objects per thread magazine */
+#define SLAB_BYTES 16384	/* Preferred slab size */
+#define SLAB_ALIGN 16
+
+typedef struct slab_cache_St
+{
+	const char *name;
+	unsigned int size;		/* Object size, aligned */
+	unsigned int per_slab;
+	int batch;			/* Objects moved between magazine and depot at once */
+	int index;			/* Into the thread magazines */
+	mutex_t mutex;			/* Protects the depot */
+	void *depot;			/* Free objects, linked through their first word */
+	unsigned long int depot_free;
+	unsigned long int objects;	/* Objects in all slabs */
+	unsigned long int slabs;
+	long int in_use;		/* Of threads that exited, the rest is in their magazines */
+	unsigned long int refills;	/* Magazines refilled from the depot */
+	unsigned long int flushes;	/* Magazines flushed to the depot */
+} slab_cache_t;
+
+typedef struct slab_magazine_St
+{
+	int count;
+	long int in_use;		/* Allocated minus freed by this thread, may be negative */
+	void *objs[SLAB_MAGAZINE];
+} slab_magazine_t;
+
+typedef struct slab_stats_St
+{
+	unsigned long int objects;
+	unsigned long int in_use;
+	unsigned long int depot_free;
+	unsigned long int magazines;	/* Free objects held by threads */
+	unsigned long int bytes;
+	unsigned long int refills;
+	unsigned long int flushes;
+} slab_stats_t;
+
+extern slab_cache_t connection_slab, client_slab, source_slab, sockaddr_slab;
+
+#define slab_alloc(c) slab_alloc_c (c, __LINE__,__FILE__)
+#define slab_free(c,x) slab_free_c (c, x, __LINE__,__FILE__) ; x=NULL
+
+void slab_init ();
+void *slab_alloc_c (slab_cache_t *cache, const int lineno, const char *file);
+void slab_free_c (slab_cache_t *cache, void *ptr, const int lineno, const char *file);
+void slab_thread_release ();
+slab_cache_t *slab_cache (int index);
+void slab_get_stats (slab_cache_t *cache, slab_stats_t *stats);
+
 #ifdef HAVE_MCHECK_H
 void icecast_mcheck_status (enum mcheck_status STATUS);
 #endif
@@ -76,6 +76,12 @@
 #include <time.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+#include <sys/timeb.h>
+#else
+#include <sys/time.h>
+#endif
+
 #include "avl.h"
 #include "threads.h"
 #include "ntripcaster.h"
@@ -83,10 +89,12 @@
 #include "ntrip_string.h"
 #include "threads.h"
 #include "timer.h"
+#define LOG_MODULE LOG_MOD_TIMER
 #include "log.h"
 #include "sock.h"
 #include "client.h"
 #include "source.h"
+#include "metrics.h"
 
 #ifndef MSG_DONTWAIT
 #define MSG_DONTWAIT 0
@@ -97,6 +105,16 @@ extern int running;
 extern server_info_t info;
 
 void display_stats(statistics_t *stat);
+static void timer_status_line (void *arg, long long expires);
+static void timer_hour (void *arg, long long expires);
+static void timer_minute (void *arg, long long expires);
+static void timer_metrics (void *arg, long long expires);
+static void timer_idle_sweep (void *arg, long long expires);
+
+static stat_shard_t stat_shards[STAT_SHARDS];
+static unsigned int stat_next_shard = 0;
+static statistics_t stat_hourly_base;	/* Shard totals at the last hourly rollover */
+THREAD_LOCAL stat_shard_t *stat_my_shard = NULL;
 
 /* Writes the one line status report to the log and the console if needed */
 void status_write(server_info_t *infostruct)
@@ -112,114 +130,577 @@ void status_write(server_info_t *infostruct)
 
 }
 
+/* The wheel. Level 0 slots hold events due within the next TIMER_SLOTS
+ * ticks, each higher level slot spans TIMER_SLOTS slots of the level
+ * below and is cascaded down when the wheel gets there. */
+static mutex_t timer_mutex = {MUTEX_STATE_UNINIT};
+static thread_cond_t timer_cond;		/* Wakes the calendar thread */
+static thread_cond_t timer_done_cond;	/* Signalled when a callback returns */
+static timer_event_t *timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static long long timer_tick = 0;		/* Next tick to run */
+static long long timer_sleep_tick = -1;	/* Tick the calendar thread sleeps until */
+static unsigned long int timer_pending = 0;
+static timer_event_t *timer_running = NULL;	/* Event whose callback runs now */
+static THREAD_LOCAL int timer_thread = 0;
+
+static timer_event_t status_event, minute_event, hour_event, metrics_event, idle_event;
+static time_t trottime = 0;
+static statistics_t trotstat;
+
+void
+timer_init ()
+{
+	thread_create_mutex (&timer_mutex);
+	thread_cond_create (&timer_cond);
+	thread_cond_create (&timer_done_cond);
+	timer_tick = timer_now () / TIMER_TICK;
+}
+
+/* Milliseconds since the epoch */
+long long
+timer_now ()
+{
+#ifdef _WIN32
+	struct _timeb tb;
+
+	_ftime (&tb);
+	return (long long) tb.time * 1000 + tb.millitm;
+#else
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+void
+timer_event_init (timer_event_t *ev, timer_func_t func, void *arg)
+{
+	ev->next = NULL;
+	ev->pprev = NULL;
+	ev->expires = 0;
+	ev->func = func;
+	ev->arg = arg;
+	ev->pending = 0;
+}
+
+/* Put ev in its slot. Must have timer_mutex. */
+static void
+timer_link (timer_event_t *ev)
+{
+	long long tick = (ev->expires + TIMER_TICK - 1) / TIMER_TICK;
+	long long delta = tick - timer_tick;
+	timer_event_t **slot;
+	int level = 0;
+
+	if (delta < 0) {
+		tick = timer_tick;
+		delta = 0;
+	} else if (delta >= (1LL << (TIMER_SLOT_BITS * TIMER_LEVELS))) {
+		/* Parked in the last level until it comes in range */
+		delta = (1LL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+		tick = timer_tick + delta;
+	}
+
+	while (level < TIMER_LEVELS - 1 && delta >= (1LL << (TIMER_SLOT_BITS * (level + 1))))
+		level++;
+
+	slot = &timer_wheel[level][(tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+
+	ev->next = *slot;
+	if (ev->next)
+		ev->next->pprev = &ev->next;
+	ev->pprev = slot;
+	*slot = ev;
+	ev->pending = 1;
+	timer_pending++;
+}
+
+/* Must have timer_mutex */
+static void
+timer_unlink (timer_event_t *ev)
+{
+	*ev->pprev = ev->next;
+	if (ev->next)
+		ev->next->pprev = ev->pprev;
+	ev->next = NULL;
+	ev->pprev = NULL;
+	ev->pending = 0;
+	timer_pending--;
+}
+
+/*
+ * The first tick from timer_tick on that has something to do, either an
+ * event in level 0 or a higher level slot to cascade. -1 if the wheel is
+ * empty. Must have timer_mutex.
+ */
+static long long
+timer_next_tick ()
+{
+	long long next = -1;
+	int level, i;
+
+	if (timer_pending == 0)
+		return -1;
+
+	for (i = 0; i < TIMER_SLOTS; i++) {
+		if (timer_wheel[0][(timer_tick + i) & (TIMER_SLOTS - 1)]) {
+			next = timer_tick + i;
+			break;
+		}
+	}
+
+	for (level = 1; level < TIMER_LEVELS; level++) {
+		int shift = TIMER_SLOT_BITS * level;
+		long long cur = timer_tick >> shift;
+
+		/* A slot is cascaded when the wheel reaches its first tick */
+		for (i = (timer_tick & ((1LL << shift) - 1)) ? 1 : 0; i <= TIMER_SLOTS; i++) {
+			if (timer_wheel[level][(cur + i) & (TIMER_SLOTS - 1)]) {
+				long long tick = (cur + i) << shift;
+				if (next < 0 || tick < next)
+					next = tick;
+				break;
+			}
+		}
+	}
+
+	return next;
+}
+
+/* Must have timer_mutex, which is released while callbacks run */
+static void
+timer_run_tick (long long tick)
+{
+	timer_event_t **slot;
+	timer_event_t *ev;
+	int level;
+
+	timer_tick = tick;
+
+	for (level = TIMER_LEVELS - 1; level > 0; level--) {
+		int shift = TIMER_SLOT_BITS * level;
+
+		if (tick & ((1LL << shift) - 1))
+			continue;
+
+		slot = &timer_wheel[level][(tick >> shift) & (TIMER_SLOTS - 1)];
+		ev = *slot;
+		*slot = NULL;
+
+		while (ev) {
+			timer_event_t *next = ev->next;
+			timer_pending--;
+			timer_link (ev);
+			ev = next;
+		}
+	}
+
+	slot = &timer_wheel[0][tick & (TIMER_SLOTS - 1)];
+
+	while ((ev = *slot)) {
+		timer_unlink (ev);
+		timer_running = ev;
+		internal_unlock_mutex (&timer_mutex);
+
+		ev->func (ev->arg, ev->expires);
+
+		internal_lock_mutex (&timer_mutex);
+		timer_running = NULL;
+		thread_cond_broadcast (&timer_done_cond);
+	}
+
+	timer_tick = tick + 1;
+}
+
+/* Run everything due up to and including now. Must have timer_mutex. */
+static void
+timer_run (long long now)
+{
+	long long target = now / TIMER_TICK;
+	long long next;
+
+	while ((next = timer_next_tick ()) >= 0 && next <= target)
+		timer_run_tick (next);
+
+	if (timer_tick <= target)
+		timer_tick = target + 1;
+}
+
+/* Schedule ev for expires (milliseconds since the epoch), rescheduling it if pending */
+void
+timer_schedule (timer_event_t *ev, long long expires)
+{
+	long long tick = (expires + TIMER_TICK - 1) / TIMER_TICK;
+
+	internal_lock_mutex (&timer_mutex);
+
+	if (ev->pending)
+		timer_unlink (ev);
+
+	ev->expires = expires;
+	timer_link (ev);
+
+	if (timer_sleep_tick >= 0 && tick < timer_sleep_tick)
+		thread_cond_broadcast (&timer_cond);
+
+	internal_unlock_mutex (&timer_mutex);
+}
+
+void
+timer_schedule_in (timer_event_t *ev, long msecs)
+{
+	timer_schedule (ev, timer_now () + msecs);
+}
+
+/*
+ * Take ev off the wheel. If its callback is running right now, wait for
+ * it to return, so ev can be freed afterwards.
+ * Returns 1 if ev was pending, 0 if it already fired (or never was scheduled).
+ */
+int
+timer_cancel (timer_event_t *ev)
+{
+	int pending;
+
+	internal_lock_mutex (&timer_mutex);
+
+	if ((pending = ev->pending))
+		timer_unlink (ev);
+	else
+		while (timer_running == ev && !timer_thread)
+			thread_cond_timedwait (&timer_done_cond, &timer_mutex, 1000);
+
+	internal_unlock_mutex (&timer_mutex);
+
+	return pending;
+}
+
+/* Make the calendar thread look around, i.e on shutdown */
+void
+timer_wakeup ()
+{
+	internal_lock_mutex (&timer_mutex);
+	thread_cond_broadcast (&timer_cond);
+	internal_unlock_mutex (&timer_mutex);
+}
+
+/*
+ * Milliseconds to wait before retry number attempt (from 0), doubling
+ * from base up to max, with some jitter so retries don't line up.
+ */
+long
+timer_backoff (int attempt, long base, long max)
+{
+	long delay = base;
+
+	while (attempt-- > 0 && delay < max)
+		delay *= 2;
+
+	if (delay > max)
+		delay = max;
+
+	return delay / 2 + (long) (get_mono_usec () % (delay / 2 + 1));
+}
+
 /* Starts up the calendar thread.
  */
 void *startup_timer_thread(void *arg)
 {
-	time_t justone = 0, trottime = 0;
-	statistics_t trotstat;
 	mythread_t *mt;
+	long long now;
 
 	thread_init();
 
 	mt = thread_get_mythread();
+	timer_thread = 1;
 
-	while (thread_alive (mt)) {
-		time_t stime = get_time();
+	now = timer_now ();
+
+	get_running_stats (&trotstat);
+	trottime = get_time ();
+
+	/* Rollovers are due on the exact boundaries */
+	timer_event_init (&status_event, timer_status_line, NULL);
+	timer_schedule (&status_event, now + info.statustime * 1000LL);
+	timer_event_init (&minute_event, timer_minute, NULL);
+	timer_schedule (&minute_event, (now / 60000 + 1) * 60000);
+	timer_event_init (&hour_event, timer_hour, NULL);
+	timer_schedule (&hour_event, (now / 3600000 + 1) * 3600000);
+	timer_event_init (&metrics_event, timer_metrics, NULL);
+	timer_schedule (&metrics_event, now + 1000);
+	timer_event_init (&idle_event, timer_idle_sweep, NULL);
+	timer_schedule (&idle_event, now + 1000);
 
-		timer_handle_status_lines (stime);
+	internal_lock_mutex (&timer_mutex);
 
-		timer_handle_transfer_statistics (stime, &trottime, &justone, &trotstat);
+	while (thread_alive (mt)) {
+		long long next, wait;
+
+		timer_run (timer_now ());
 
 		if (mt->ping == 1)
 			mt->ping = 0;
 
-		my_sleep(400000);
+		/* Sleep until the next thing to do */
+		next = timer_next_tick ();
+		wait = next < 0 ? TIMER_MAX_SLEEP : next * TIMER_TICK - timer_now ();
+		if (wait > TIMER_MAX_SLEEP)
+			wait = TIMER_MAX_SLEEP;
+
+		if (wait > 0 && thread_alive (mt)) {
+			timer_sleep_tick = next;
+			thread_cond_timedwait (&timer_cond, &timer_mutex, (long) wait);
+			timer_sleep_tick = -1;
+		}
 	}
+
+	internal_unlock_mutex (&timer_mutex);
+
+	timer_cancel (&status_event);
+	timer_cancel (&minute_event);
+	timer_cancel (&hour_event);
+	timer_cancel (&metrics_event);
+	timer_cancel (&idle_event);
 	
 	thread_exit(7);
 	return NULL;
 }
 
-void
-timer_handle_status_lines (time_t stime)
+static void
+timer_status_line (void *arg, long long expires)
+{
+	status_write(&info);
+	info.statuslasttime = (time_t) (expires / 1000);
+
+	timer_schedule (&status_event, expires + (info.statustime > 0 ? info.statustime : DEFAULT_STATUSTIME) * 1000LL);
+}
+
+/* Hourly rollover, and the daily one at midnight (UTC) */
+static void
+timer_hour (void *arg, long long expires)
 {
-	if ((stime - info.statuslasttime) >= info.statustime) {
-		info.statuslasttime = stime;
-		status_write(&info);
+	time_t stime = (time_t) (expires / 1000);
+
+	if ((stime % 86400) == 0) {
+		statistics_t stat, hourlystats;
+		
+		take_hourly_stats(&hourlystats);
+		update_daily_statistics(&hourlystats);
+		
+		get_daily_stats(&stat);
+		zero_stats(&info.daily_stats);
+		update_total_statistics(&stat);
+		write_daily_stats(&stat);
+	} else {
+		statistics_t stat;
+		take_hourly_stats(&stat);
+		update_daily_statistics(&stat);
+		write_hourly_stats(&stat);
 	}
+
+	timer_schedule (&hour_event, expires + 3600000);
+}
+
+/* Bandwidth usage over the last minute */
+static void
+timer_minute (void *arg, long long expires)
+{
+	time_t stime = (time_t) (expires / 1000);
+	time_t delta;
+	statistics_t stat;
+	unsigned int total_bytes;
+	double KB_per_sec = 0;
 	
+	get_running_stats(&stat);
+	
+	total_bytes = (stat.read_kilos - trotstat.read_kilos) + (stat.write_kilos - trotstat.write_kilos);
+	delta = stime - trottime;
+	if (delta <= 0) {
+		write_log(LOG_DEFAULT, 
+			"ERROR: Losing track of time.. is it xmas already? [%d - %d == %d <= 0]", 
+			stime, trottime, delta);
+	} else {
+		KB_per_sec = (double)total_bytes / (double)delta;
+
+		if (KB_per_sec < 40000000) {
+			info.bandwidth_usage = KB_per_sec;
+
+		}
+	}
+	
+	trotstat = stat;
+	trottime = stime;
+
+	timer_schedule (&minute_event, expires + 60000);
 }
 
+static void
+timer_metrics (void *arg, long long expires)
+{
+	int interval = info.metrics_interval > 0 ? info.metrics_interval : DEFAULT_METRICS_INTERVAL;
 
-void
-timer_handle_transfer_statistics (time_t stime, time_t *trottime, time_t *justone, statistics_t *trotstat)
+	metrics_timer ((time_t) (expires / 1000));
+
+	timer_schedule (&metrics_event, expires + interval * 1000LL);
+}
+
+/*
+ * A client is dead if data it was sent sat unacknowledged for
+ * client_dead_timeout seconds. The peer has acknowledged write_bytes
+ * minus what is still in the send queue. A peer that still answers
+ * window probes is only slow, and left to client_idle_timeout.
+ */
+static int
+timer_client_dead (connection_t *clicon, time_t now, int timeout)
 {
-	if (get_time() != *justone) {
-		*justone = get_time();
-		
-		if ((stime % 86400) == 0) {
-			statistics_t stat, hourlystats;
-			
-			get_hourly_stats(&hourlystats);
-			zero_stats(&info.hourly_stats);
-			update_daily_statistics(&hourlystats);
-			
-			get_daily_stats(&stat);
-			zero_stats(&info.daily_stats);
-			update_total_statistics(&stat);
-			write_daily_stats(&stat);
-		} else if ((stime % 3600) == 0) {
-			statistics_t stat;
-			get_hourly_stats(&stat);
-			zero_stats(&info.hourly_stats);
-			update_daily_statistics(&stat);
-			write_hourly_stats(&stat);
-		}
-		
-		if ((stime % 60) == 0) {
-			time_t delta;
-			statistics_t stat;
-			unsigned int total_bytes;
-
-			double KB_per_sec = 0;
-			
-			get_running_stats(&stat);
-			
-			if (*trottime == 0) {
-				*trottime = get_time();
-				get_running_stats(trotstat);
-			} else {
-				total_bytes = (stat.read_kilos - trotstat->read_kilos) + (stat.write_kilos - trotstat->write_kilos);
-				delta = get_time() - *trottime;
-				if (delta <= 0) {
-					write_log(LOG_DEFAULT, 
-						"ERROR: Losing track of time.. is it xmas already? [%d - %d == %d <= 0]", 
-						get_time (), *trottime, delta);
-				} else {
-					KB_per_sec = (double)total_bytes / (double)delta;
-
-					if (KB_per_sec < 40000000) {
-						info.bandwidth_usage = KB_per_sec;
-
-					}
+	client_t *client = clicon->food.client;
+	int unacked = sock_unacked (clicon->sock);
+	unsigned long int acked;
+
+	if (unacked < 0)
+		return 0;
+
+	acked = client->write_bytes - unacked;
+
+	if (unacked == 0 || acked != client->acked_bytes) {
+		client->acked_bytes = acked;
+		client->acked_since = now;
+		return 0;
+	}
+
+	if (now - client->acked_since < timeout)
+		return 0;
+
+	{
+		long last_ack = sock_last_ack_msecs (clicon->sock);
+
+		return last_ack < 0 || last_ack >= timeout * 1000L;
+	}
+}
+
+/*
+ * Kick clients that got nothing for client_idle_timeout seconds while
+ * their source kept sending, i.e stalled connections on slow mounts which
+ * take ages to run up enough errors. Also kicks dead peers, see
+ * timer_client_dead().
+ */
+static void
+timer_idle_sweep (void *arg, long long expires)
+{
+	avl_traverser trav = {0};
+	connection_t *scon, *clicon;
+	int i;
+	time_t now = (time_t) (expires / 1000);
+	int timeout = info.client_idle_timeout;
+	int dead = info.client_dead_timeout;
+	int shortest = timeout > 0 && (dead <= 0 || timeout < dead) ? timeout : dead;
+
+	if (shortest > 0) {
+		thread_mutex_lock (&info.source_mutex);
+
+		while ((scon = avl_traverse (info.sources, &trav))) {
+			source_t *source = scon->food.source;
+			unsigned long int source_bytes;
+
+			thread_mutex_lock (&source->mutex);
+
+			/* read_bytes alone is only what's below a kilo */
+			source_bytes = source->stats.read_kilos * 1024 + source->stats.read_bytes;
+
+			for (i = 0; i < source->clients.count; i++) {
+				client_t *client;
+
+				clicon = source->clients.con[i];
+				client = clicon->food.client;
+
+				if (client->alive == CLIENT_DEAD)
+					continue;
+
+				if (dead > 0 && timer_client_dead (clicon, now, dead)) {
+					kick_connection (clicon, "Dead peer (no ACK progress)");
+					continue;
+				}
+
+				if (timeout <= 0)
+					continue;
+
+				if (client->write_bytes != client->idle_bytes || source_bytes == client->idle_source_bytes) {
+					client->idle_bytes = client->write_bytes;
+					client->idle_source_bytes = source_bytes;
+					client->idle_since = now;
+				} else if (now - client->idle_since >= timeout) {
+					kick_connection (clicon, "Client idle timeout");
 				}
-				
-				get_running_stats(trotstat);
-				*trottime = get_time();
 			}
+
+			thread_mutex_unlock (&source->mutex);
 		}
+
+		thread_mutex_unlock (&info.source_mutex);
 	}
+
+	timer_schedule (&idle_event, expires + (shortest > 0 ? shortest * 250LL + 1000 : TIMER_IDLE_RECHECK * 1000LL));
+}
+
+/* Pick a shard for the calling thread, round robin */
+stat_shard_t *stat_assign_shard ()
+{
+	unsigned int shard = ice_atomic_add (&stat_next_shard, 1);
+
+	stat_my_shard = &stat_shards[shard % STAT_SHARDS];
+	return stat_my_shard;
+}
+
+void sum_stat_shards (statistics_t *sum)
+{
+	int i;
+
+	zero_stats (sum);
+
+	for (i = 0; i < STAT_SHARDS; i++) {
+		statistics_t *shard = &stat_shards[i].stats;
+
+		sum->read_bytes += ice_atomic_load (&shard->read_bytes);
+		sum->write_bytes += ice_atomic_load (&shard->write_bytes);
+		sum->client_connections += ice_atomic_load (&shard->client_connections);
+		sum->source_connections += ice_atomic_load (&shard->source_connections);
+		sum->client_connect_time += ice_atomic_load (&shard->client_connect_time);
+		sum->source_connect_time += ice_atomic_load (&shard->source_connect_time);
+	}
+}
+
+/* Subtract the hourly base from the shard totals in stat */
+static void hourly_stats_from_sum (statistics_t *stat)
+{
+	stat->read_bytes -= stat_hourly_base.read_bytes;
+	stat->write_bytes -= stat_hourly_base.write_bytes;
+	stat->client_connections -= stat_hourly_base.client_connections;
+	stat->source_connections -= stat_hourly_base.source_connections;
+	stat->client_connect_time -= stat_hourly_base.client_connect_time;
+	stat->source_connect_time -= stat_hourly_base.source_connect_time;
 }
 
 void get_hourly_stats(statistics_t *stat)
 {
-	stat->read_bytes = info.hourly_stats.read_bytes;
-	stat->write_bytes = info.hourly_stats.write_bytes;
-	stat->client_connections = info.hourly_stats.client_connections;
-	stat->source_connections = info.hourly_stats.source_connections;
-	stat->client_connect_time = info.hourly_stats.client_connect_time;
-	stat->source_connect_time = info.hourly_stats.source_connect_time;
+	thread_mutex_lock(&info.misc_mutex);
+	sum_stat_shards (stat);
+	hourly_stats_from_sum (stat);
+	thread_mutex_unlock(&info.misc_mutex);
+}
+
+/* Get the hourly stats and start a new hour, without losing any counts
+ * that come in meanwhile. */
+void take_hourly_stats(statistics_t *stat)
+{
+	statistics_t sum;
+
+	thread_mutex_lock(&info.misc_mutex);
+	sum_stat_shards (&sum);
+	*stat = sum;
+	hourly_stats_from_sum (stat);
+	stat_hourly_base = sum;
+	thread_mutex_unlock(&info.misc_mutex);
 }
 
 void write_hourly_stats(statistics_t *stat)
@@ -290,11 +771,6 @@ void write_daily_stats(statistics_t *stat)
 }
 		
 void get_current_stats(statistics_t *stat)
-{
-	get_current_stats_proc (stat, 1);
-}
-
-void get_current_stats_proc (statistics_t *stat, int lock)
 {
 	avl_traverser trav = {0};
 	time_t ec = 0, cc = 0;
@@ -302,32 +778,23 @@ void get_current_stats_proc (statistics_t *stat, int lock)
 
 	zero_stats(stat);
 	
-	if (lock)
-		thread_mutex_lock(&info.double_mutex);
 	thread_mutex_lock(&info.source_mutex);
 
 	ec = (time_t)tree_time(info.sources);
 	while ((travcon = avl_traverse(info.sources, &trav))) {
 		thread_mutex_lock(&travcon->food.source->mutex);
-		cc += (time_t)tree_time(travcon->food.source->clients);
+		cc += client_set_time (&travcon->food.source->clients);
 		thread_mutex_unlock(&travcon->food.source->mutex);
 	}
 
 	thread_mutex_unlock(&info.source_mutex);
 	
-	if (lock)
-		thread_mutex_unlock(&info.double_mutex);
 
 	stat->client_connect_time = cc;
 	stat->source_connect_time = ec;
 }
 
 void get_running_stats(statistics_t *stat)
-{
-	get_running_stats_proc (stat, 1);
-}
-
-void get_running_stats_proc (statistics_t *stat, int lock)
 {
 	statistics_t bufstat;
 
@@ -345,7 +812,7 @@ void get_running_stats_proc (statistics_t *stat, int lock)
 	stat->source_connect_time = info.total_stats.source_connect_time;
 	
 // bytes
-	get_current_stats_proc (&bufstat, lock);
+	get_current_stats (&bufstat);
 	add_stats(stat, &bufstat, 0);
 
 // bytes
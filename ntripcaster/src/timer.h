@@ -41,6 +41,61 @@
 #ifndef ICECAST_TIMER_H
 #define ICECAST_TIMER_H
 
+/* Traffic counters are kept in shards, so source threads don't fight over
+ * cache lines. Each thread sticks to one shard, the timer thread sums them
+ * up. The shards only ever grow, hourly stats are the growth since the
+ * last hourly rollover. */
+#define STAT_SHARDS 64
+#define STAT_CACHE_LINE 64
+
+typedef union stat_shard_St
+{
+	statistics_t stats;
+	char pad[(sizeof (statistics_t) + STAT_CACHE_LINE - 1) / STAT_CACHE_LINE * STAT_CACHE_LINE];
+} __attribute__ ((aligned (STAT_CACHE_LINE))) stat_shard_t;
+
+extern THREAD_LOCAL stat_shard_t *stat_my_shard;
+
+#define stats_count(field, n) \
+	ice_atomic_add (&(stat_my_shard ? stat_my_shard : stat_assign_shard ())->stats.field, (n))
+
+stat_shard_t *stat_assign_shard ();
+void sum_stat_shards (statistics_t *sum);
+void take_hourly_stats (statistics_t *stat);
+
+/* Timer wheel, run by the calendar thread. Events belong to the caller,
+ * who has to keep them around until they fired or were cancelled.
+ * Callbacks run in the calendar thread without any locks held and
+ * must not block. They get the deadline they were scheduled for,
+ * which is exact even if the thread woke up late. */
+#define TIMER_TICK 100			/* Milliseconds per wheel tick */
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4			/* 64^4 ticks, about 19 days */
+#define TIMER_MAX_SLEEP 60000		/* Longest sleep without any timer due */
+#define TIMER_IDLE_RECHECK 60		/* Seconds between looks at client_idle_timeout while it is off */
+
+typedef void (*timer_func_t) (void *arg, long long expires);
+
+typedef struct timer_event_St
+{
+	struct timer_event_St *next;
+	struct timer_event_St **pprev;	/* The pointer pointing at us */
+	long long expires;		/* Milliseconds since the epoch */
+	timer_func_t func;
+	void *arg;
+	int pending;			/* Linked into the wheel */
+} timer_event_t;
+
+void timer_init ();
+long long timer_now ();
+void timer_event_init (timer_event_t *ev, timer_func_t func, void *arg);
+void timer_schedule (timer_event_t *ev, long long expires);
+void timer_schedule_in (timer_event_t *ev, long msecs);
+int timer_cancel (timer_event_t *ev);
+void timer_wakeup ();
+long timer_backoff (int attempt, long base, long max);
+
 void *startup_timer_thread(void *arg);
 void status_write(server_info_t *info);
 void get_hourly_stats(statistics_t *stat);
@@ -51,11 +106,7 @@ void update_total_statistics(statistics_t *stat);
 void write_daily_stats(statistics_t *stat);
 void zero_stats(statistics_t *stat);
 void get_current_stats(statistics_t *stat);
-void get_current_stats_proc (statistics_t *stat, int lock);
 void get_running_stats(statistics_t *stat);
-void get_running_stats_proc (statistics_t *stat, int lock);
 void add_stats(statistics_t *target, statistics_t *source, unsigned long int factor);
-void timer_handle_status_lines (time_t stime);
-void timer_handle_transfer_statistics (time_t stime, time_t *trottime, time_t *justone, statistics_t *trotstat);
 #endif
 
@@ -88,9 +88,11 @@
 #include "sock.h"
 #include "source.h"
 #include "client.h"
+#define LOG_MODULE LOG_MOD_UTILITY
 #include "log.h"
 #include "main.h"
 #include "timer.h"
+#include "metrics.h"
 #include "string.h"
 #include "connection.h"
 
@@ -159,7 +161,7 @@ int find_frame_ofs(source_t *source)
 		return 0;
 	}
 
-	cid = source->cid <= 0 ? CHUNKLEN - 1 : source->cid - 1;
+	cid = start_chunk (source);
 	
 	buff = source->chunk[cid].data;
 	
@@ -185,15 +187,21 @@ kick_connection(void *conarg, void *reasonarg)
 		write_log (LOG_DEFAULT, "WARNING: kick_connection called with NULL pointers");
 		return;
 	}
+
+	/* Only the first kick ends the session, clients log it when they are reaped */
+	if (con->type == source_e && con->food.source->connected != SOURCE_KILLED) {
+		session_log (con, reason, 1);
+		metrics_kick (reason);
+	}
 	
 	switch (con->type)
 	{
 		case client_e:
-			write_log (LOG_DEFAULT, 
-				   "Kicking client %d [%s] [%s] [%s] [%s], connected for %s, %lu bytes transfered. %lu clients connected",
-				   con->id, nullcheck_string(con->user), con_host (con), reason, con->food.client->type == listener_e ? "listener" : "relay",
-				   nice_time (get_time () - con->connect_time, timebuf), con->food.client->write_bytes, info.num_clients - 1);
-			con->food.client->alive = CLIENT_DEAD;
+			if (con->food.client->alive != CLIENT_DEAD) {
+				con->food.client->kick_reason = reason;
+				con->food.client->alive = CLIENT_DEAD;
+				client_set_kill (con);
+			}
 
 			return;
 			break;
@@ -201,14 +209,20 @@ kick_connection(void *conarg, void *reasonarg)
 		case source_e:
 			write_log (LOG_DEFAULT, 
 				   "Kicking source %d [%s] [%s] [%s], connected for %s, %lu bytes transfered. %d sources connected",
-				   con->id, con_host (con), reason, con->food.source->type == encoder_e ? "encoder" : "relay",
+				   con->id, con_host (con), reason, con->food.source->type == encoder_e ? "encoder" : con->food.source->type == bus_e ? "mirror" : con->food.source->type == replica_e ? "replica" : "relay",
 				   nice_time (get_time () - con->connect_time, timebuf), con->food.source->stats.read_bytes, info.num_sources - 1);
 			if (con->food.source->connected == SOURCE_UNUSED)
 				close_connection (con, NULL);
 			else
 			{
-				sock_close(con->sock);
+				/* The source thread closes it, unless this is the source thread */
+				if (thread_equal (con->food.source->thread, thread_self ())) {
+					sock_close (con->sock);
+					con->sock = INVALID_SOCKET;
+				} else
+					sock_shutdown (con->sock);
 				con->food.source->connected = SOURCE_KILLED;
+				pending_wakeup ();
 			}
 
 			return;
@@ -239,11 +253,11 @@ free_con (connection_t *con)
 		con->host = NULL;
 	}
 
-	if (con->headervars != NULL)
-		free_con_variables (con);
-		
-	if (con->sin != NULL)
-		nfree (con->sin);
+	if (con->sin != NULL) {
+		if (con->admitted)
+			admit_release (con->sin->sin_addr);
+		slab_free (&sockaddr_slab, con->sin);
+	}
 	
 	if (con->hostname != NULL)
 	{
@@ -270,39 +284,17 @@ close_connection(void *data, void *param)
 	
 	xa_debug (2, "DEBUG: Removing connection %d of type %d", con->id, con->type);
 
-	free_con (con);
-
 	if (con->type == client_e) {
-		source_t *con2 = source_with_client(con);
-
-		if (!con2)
-			xa_debug (2, "DEBUG: Client with NULL source?");
-
-		if (con->food.client->virgin == 0)
-			del_client (con, con2);
-		else
-			util_decrease_total_clients ();
-
-		if (con2)
-		  {
-			  con2->stats.client_connect_time += (unsigned long)((get_time () - con->connect_time) / 60.0);
-			  info.hourly_stats.client_connect_time += (unsigned long)((get_time() - con->connect_time) / 60.0);
-
-			  xa_debug (2, "DEBUG: Removing client %d (%p) from sourcetree of (%p)", con->id, con, con2);
-
-			  if (!avl_delete(con2->clients, con))
-				  xa_debug (2, "DEBUG: Didn't find client in sourcetree!");
-		  } else {
-			  xa_debug (2, "DEBUG: client %d without source?", con->id);
-		  }
-		nfree (con->food.client);
-		nfree (con);
+		unlink_client (con);
+		con->food.client->reap_next = NULL;
+		reap_clients (con);
 		return;
 	}
 
-	else if (con->type == source_e) {
+	free_con (con);
+
+	if (con->type == source_e) {
 		source_t *source = con->food.source;
-		connection_t *clicon;
 
 		if (!source)
 		{
@@ -312,23 +304,23 @@ close_connection(void *data, void *param)
 
 		xa_debug (2, "Removing source %d (%p) from sourcetree of (%p)", con->id, con, info.sources);
 
-		if (source->clients != NULL)
 		{
-			avl_traverser trav = {0};
+			int i;
+
 			write_log(LOG_DEFAULT, "Kicking all %d clients for source %d",
 				  source->num_clients, con->id);
-			while ((clicon = avl_traverse (source->clients, &trav)))
-			{
-					kick_connection (clicon, "Stream ended");
-			}
+			for (i = 0; i < source->clients.count; i++)
+				kick_connection (source->clients.con[i], "Stream ended");
 
-			kick_dead_clients (source);
-			avl_destroy (source->clients, NULL);
+			/* Stragglers only, source_func() reaps the others unlocked */
+			reap_clients (kick_dead_clients (source));
+			client_set_destroy (&source->clients);
 		}
 
+		bus_release (con);
 		dispose_audiocast (&source->audiocast);
 
-		info.hourly_stats.source_connect_time += ((get_time () - con->connect_time) / 60);
+		stats_count (source_connect_time, ((get_time () - con->connect_time) / 60));
 
 		if (con->food.source->connected != SOURCE_UNUSED)
 		{
@@ -342,16 +334,67 @@ close_connection(void *data, void *param)
 			thread_mutex_unlock (&source->mutex);
 		thread_mutex_destroy (&source->mutex);
 
-		nfree(source);
-		nfree(con);
+		slab_free (&source_slab, source);
+		slab_free (&connection_slab, con);
 
 		return;
 	}
 
-	nfree(con); /* Unknown connection */
+	slab_free (&connection_slab, con); /* Unknown connection */
 	return;
 }
 
+/* Take a dead client off its source and the counters, must have the
+   source mutex. The connection itself is left for reap_clients(). */
+void
+unlink_client (connection_t *con)
+{
+	source_t *source = source_with_client (con);
+
+	xa_debug (2, "DEBUG: Unlinking client %d from source %p", con->id, source);
+
+	if (con->food.client->virgin == 0)
+		del_client (con, source);
+	else
+		util_decrease_total_clients (source);
+
+	if (source) {
+		source->stats.client_connect_time += (unsigned long)((get_time () - con->connect_time) / 60.0);
+		stats_count (client_connect_time, (unsigned long)((get_time() - con->connect_time) / 60.0));
+
+		if (!client_set_remove (source, con))
+			xa_debug (2, "DEBUG: Didn't find client %d in the client set!", con->id);
+	} else {
+		xa_debug (2, "DEBUG: client %d without source?", con->id);
+	}
+}
+
+/* Log, close and free a list of unlinked clients, linked through
+   reap_next. Needs no locks, but the sources must still be around. */
+void
+reap_clients (connection_t *reap)
+{
+	connection_t *next;
+	const char *reason;
+	char timebuf[BUFSIZE];
+
+	for (; reap; reap = next) {
+		next = reap->food.client->reap_next;
+		reason = reap->food.client->kick_reason ? reap->food.client->kick_reason : "Client signed off";
+
+		write_log (LOG_DEFAULT, 
+			   "Kicking client %d [%s] [%s] [%s] [%s], connected for %s, %lu bytes transfered. %lu clients connected",
+			   reap->id, nullcheck_string(reap->user), con_host (reap), reason, reap->food.client->type == listener_e ? "listener" : "relay",
+			   nice_time (get_time () - reap->connect_time, timebuf), reap->food.client->write_bytes, info.num_clients);
+		session_log (reap, reason, 1);
+		metrics_kick (reason);
+
+		free_con (reap);
+		slab_free (&client_slab, reap->food.client);
+		slab_free (&connection_slab, reap);
+	}
+}
+
 void
 kick_not_connected (connection_t *con, char *reason)
 {
@@ -361,19 +404,22 @@ kick_not_connected (connection_t *con, char *reason)
 	if (reason)
 		write_log (LOG_DEFAULT, "Kicking %s %d [%s] [%s], connected for %s", type_of_str (con->type, typebuf), con->id, con_host (con), reason, 
 			   nice_time (get_time () - con->connect_time, timebuf));
+
+	session_log (con, reason, 0);
+	metrics_kick (reason);
 	
 	free_con (con);
 
 	if (con->type == source_e)
 	  {
-		  avl_destroy (con->food.source->clients, NULL);
-		  nfree (con->food.source);
+		  client_set_destroy (&con->food.source->clients);
+		  slab_free (&source_slab, con->food.source);
 	  }
 	else if (con->type == client_e)
 	  {
-	    nfree (con->food.client);
+	    slab_free (&client_slab, con->food.client);
 	  }
-	nfree (con);
+	slab_free (&connection_slab, con);
 }
 
 source_t *
@@ -439,12 +485,28 @@ find_source_with_mount (char *mount)
 unsigned long int
 new_id ()
 {
-	unsigned long int ret;
-	thread_mutex_lock (&info.misc_mutex);
-	ret = info.id;
-	info.id++;
-	thread_mutex_unlock (&info.misc_mutex);
-	return ret;
+	return ice_atomic_add (&info.id, 1) - 1;
+}
+
+/* Take one of limit places in *count, without a lock. Returns 0 when
+   they are all taken, util_release() gives the place back. */
+int
+util_reserve (unsigned long int *count, unsigned long int limit)
+{
+	unsigned long int now = ice_atomic_load (count);
+
+	do {
+		if (now >= limit)
+			return 0;
+	} while (!ice_atomic_cas (count, &now, now + 1));
+
+	return 1;
+}
+
+void
+util_release (unsigned long int *count)
+{
+	ice_atomic_sub (count, 1);
 }
 
 void
@@ -466,11 +528,14 @@ kill_threads ()
 
 	thread_mutex_lock (&info.source_mutex);
 	while ((con = avl_traverse (info.sources, &trav))) {
-		sock_close(con->sock);
+		sock_shutdown (con->sock);
 		con->food.source->connected = SOURCE_KILLED;
 	}
 	
 	thread_mutex_unlock (&info.source_mutex);
+
+	pending_wakeup ();
+	timer_wakeup ();
 }
 
 time_t
@@ -508,6 +573,11 @@ print_startup_server_info ()
 			write_log(LOG_DEFAULT, "Listening on port %i...", info.port[i]);
 	}
 
+	for (i = 0; i < MAXLISTEN; i++) {
+		if (sock_valid (info.tls_listen_sock[i]))
+			write_log(LOG_DEFAULT, "Listening on port %i (TLS)...", info.tls_port[i]);
+	}
+
 	if (info.server_name)
 		write_log (LOG_DEFAULT, "Using '%s' as servername...", info.server_name);
 
@@ -554,13 +624,14 @@ hostname_local (char *name)
 	if (new)
 		return 1;
 
-	/* Not in the tree, try to reverse it */
+	/* Not in the tree, ask the resolver. Until it has an answer the name
+	   counts as not local. */
 	{
 		char buf[BUFSIZE], *out;
-		char *res = forward (name, buf);
+		char *res = buf;
 
-		if (!res)
-			return 0; /* Unresolvable */
+		if (!resolv_cached (name, 1, buf, BUFSIZE))
+			return 0; /* Unresolvable, or not yet */
 			
 		thread_mutex_lock (&info.hostname_mutex);
 
@@ -689,29 +760,36 @@ build_request (char *line, request_t *req)
 		
 	} else if ((ice_strncmp (line, "HOST:", 5) == 0) || (ice_strncmp (line, "Host:", 5) == 0))
 	{
-		char hostbuf[BUFSIZE] = "";
+		build_request_host (clean_string (line + 5), req);
+		return;
+	} else {
+		xa_debug (1, "DEBUG: Build request called with invalid line [%s]", line);
+	}
+}
 
-		splitc (NULL, line, ':');
+/* Fill in host and port from the value of a Host: header */
+void
+build_request_host (const char *host, request_t *req)
+{
+	const char *colon;
+	size_t len;
 
-		while (*line == ' ')
-			line++;
+	if (!host || !req)
+	{
+		write_log (LOG_DEFAULT, "ERROR: build_request_host called with NULL pointer");
+		return;
+	}
 
-		ptr = strchr (line, ':');
+	colon = strchr (host, ':');
+	len = colon ? (size_t) (colon - host) : strcspn (host, " ");
+	if (len >= BUFSIZE)
+		len = BUFSIZE - 1;
 
-		if (ptr)
-		{
-			splitc (hostbuf, line, ':');
-			req->port = atoi (line);
-		} else {
-		    if (splitc (hostbuf, line, ' ') == NULL) strncpy (hostbuf, line, BUFSIZE);
-		}
-		
-		strncpy (req->host, hostbuf, BUFSIZE);
+	memcpy (req->host, host, len);
+	req->host[len] = '\0';
 
-		return;
-	} else {
-		xa_debug (1, "DEBUG: Build request called with invalid line [%s]", line);
-	}
+	if (colon)
+		req->port = atoi (colon + 1);
 }
 		
 int
@@ -814,6 +892,36 @@ void init_thread_tree(int line, char *file)
 	thread_setup_default_attributes();
 }
 
+/* Sources waiting in pending_source_signoff() sleep on pending_cond */
+#define PENDING_RECHECK 1000	/* Milliseconds */
+
+static mutex_t pending_mutex = {MUTEX_STATE_UNINIT};
+static thread_cond_t pending_cond;
+
+void
+pending_init ()
+{
+	thread_create_mutex (&pending_mutex);
+	thread_cond_create (&pending_cond);
+}
+
+void
+pending_wakeup ()
+{
+	internal_lock_mutex (&pending_mutex);
+	thread_cond_broadcast (&pending_cond);
+	internal_unlock_mutex (&pending_mutex);
+}
+
+static void
+pending_expired (void *arg, long long expires)
+{
+	internal_lock_mutex (&pending_mutex);
+	*(int *) arg = 1;
+	thread_cond_broadcast (&pending_cond);
+	internal_unlock_mutex (&pending_mutex);
+}
+
 void
 pending_connection (connection_t *con)
 {
@@ -825,9 +933,20 @@ pending_connection (connection_t *con)
 int
 pending_source_signoff (connection_t *con)
 {
-	time_t start = get_time ();
-	while ((running == SERVER_RUNNING) && con->food.source->connected == SOURCE_PENDING && ((get_time () - start) < info.client_timeout))
-		my_sleep(90000);
+	timer_event_t expiry;
+	int expired = 0;
+
+	timer_event_init (&expiry, pending_expired, &expired);
+	timer_schedule_in (&expiry, info.client_timeout * 1000L);
+
+	/* The recheck only matters if a kick slips in between check and wait */
+	internal_lock_mutex (&pending_mutex);
+	while ((running == SERVER_RUNNING) && con->food.source->connected == SOURCE_PENDING && !expired)
+		thread_cond_timedwait (&pending_cond, &pending_mutex, PENDING_RECHECK);
+	internal_unlock_mutex (&pending_mutex);
+
+	timer_cancel (&expiry);
+
 	if (con->food.source->connected == SOURCE_PENDING)
 		return 1;
 	return 0;
@@ -1108,25 +1227,21 @@ dispose_audiocast (audiocast_t *au)
 int
 count_clients() {
 
-	connection_t *clicon, *sourcecon;
-	avl_traverser trav = {0}, sourcetrav = {0};
+	connection_t *sourcecon;
+	avl_traverser sourcetrav = {0};
 	int num = 0;
 
-	thread_mutex_lock (&info.double_mutex);
 	thread_mutex_lock (&info.source_mutex);
 
 	while ((sourcecon = avl_traverse (info.sources, &sourcetrav)))
 	{
-		zero_trav (&trav);
 		thread_mutex_lock (&sourcecon->food.source->mutex);
-
-		while ((clicon = avl_traverse (sourcecon->food.source->clients, &trav))) num++;
+		num += sourcecon->food.source->clients.count;
 	
 		thread_mutex_unlock (&sourcecon->food.source->mutex);
 	}
 
 	thread_mutex_unlock (&info.source_mutex);
-	thread_mutex_unlock (&info.double_mutex);
 
 	return num;
 }
@@ -1153,6 +1268,38 @@ set_element configfile_settings[] =
 	{ "rp_email", string_e, "Resposible person email", NULL},
   { "server_url", string_e, "URL for this NtripCaster server", NULL},
 	{ "logdir", string_e, "Directory for log files", NULL},
+	{ "console_debug_level", integer_e, "Debug level for console output", NULL},
+	{ "logfile_debug_level", integer_e, "Debug level for the logfile", NULL},
+	{ "debug_modules", string_e, "Per module debug levels, i.e sock:4,source:3", NULL},
+	{ "session_logfile", string_e, "Binary session log to write to", NULL},
+	{ "metrics", integer_e, "Serve prometheus metrics on /metrics", NULL},
+	{ "metrics_interval", integer_e, "Seconds between metrics snapshots", NULL},
+	{ "client_timeout", integer_e, "Seconds to keep the mount of a lost source", NULL},
+	{ "login_timeout", integer_e, "Seconds to send the request headers in", NULL},
+	{ "client_idle_timeout", integer_e, "Seconds before a stalled client is kicked", NULL},
+	{ "client_dead_timeout", integer_e, "Seconds before a client that acknowledges nothing is kicked", NULL},
+	{ "lock_profile", integer_e, "Profile mutex contention per call site", NULL},
+	{ "reverse_lookups", integer_e, "Resolve the hostnames of connections", NULL},
+	{ "dns_cache_size", integer_e, "Resolver cache entries", NULL},
+	{ "dns_cache_ttl", integer_e, "Seconds to cache a resolved name", NULL},
+	{ "dns_negative_ttl", integer_e, "Seconds to cache a failed lookup", NULL},
+	{ "socket_client", string_e, "Client socket options, i.e nodelay:1,notsent_lowat:16384", NULL},
+	{ "socket_source", string_e, "Source socket options", NULL},
+	{ "socket_relay", string_e, "Relay socket options", NULL},
+	{ "tls_certificate", string_e, "PEM certificate chain for the TLS ports", NULL},
+	{ "tls_key", string_e, "PEM private key for the TLS ports", NULL},
+	{ "tls_ciphers", string_e, "OpenSSL cipher list for TLS 1.2", NULL},
+	{ "tls_ktls", integer_e, "Use kernel TLS where available", NULL},
+	{ "max_connections_per_ip", integer_e, "Open connections allowed from one address", NULL},
+	{ "connect_rate", integer_e, "Connects per minute allowed from one address", NULL},
+	{ "connect_burst", integer_e, "Connects allowed at once from one address", NULL},
+	{ "connect_ban_time", integer_e, "Seconds to ban an address that keeps connecting", NULL},
+	{ "workers", integer_e, "Processes to share the ports and mounts between", NULL},
+	{ "replication_password", string_e, "Password for edge casters replicating mounts from here", NULL},
+	{ "replicate_from", string_e, "host:port of the caster to replicate mounts from", NULL},
+	{ "replicate_password", string_e, "Password to replicate with", NULL},
+	{ "replicate_mounts", string_e, "Mounts to replicate, comma separated or *", NULL},
+	{ "io_uring", integer_e, "Batch the fan-out sends through io_uring", NULL},
 	{ (char *) NULL, 0, (char *) NULL, NULL }
 };
 
@@ -1171,6 +1318,38 @@ setup_config_file_settings()
 	configfile_settings[x++].setting = &info.rp_email;
 	configfile_settings[x++].setting = &info.server_url;
 	configfile_settings[x++].setting = &info.logdir;
+	configfile_settings[x++].setting = &info.consoledebuglevel;
+	configfile_settings[x++].setting = &info.logfiledebuglevel;
+	configfile_settings[x++].setting = &info.debug_modules;
+	configfile_settings[x++].setting = &info.sessionlogfilename;
+	configfile_settings[x++].setting = &info.metrics;
+	configfile_settings[x++].setting = &info.metrics_interval;
+	configfile_settings[x++].setting = &info.client_timeout;
+	configfile_settings[x++].setting = &info.login_timeout;
+	configfile_settings[x++].setting = &info.client_idle_timeout;
+	configfile_settings[x++].setting = &info.client_dead_timeout;
+	configfile_settings[x++].setting = &info.lock_profile;
+	configfile_settings[x++].setting = &info.reverse_lookups;
+	configfile_settings[x++].setting = &info.dns_cache_size;
+	configfile_settings[x++].setting = &info.dns_cache_ttl;
+	configfile_settings[x++].setting = &info.dns_negative_ttl;
+	configfile_settings[x++].setting = &info.socket_policy[SOCK_ROLE_CLIENT];
+	configfile_settings[x++].setting = &info.socket_policy[SOCK_ROLE_SOURCE];
+	configfile_settings[x++].setting = &info.socket_policy[SOCK_ROLE_RELAY];
+	configfile_settings[x++].setting = &info.tls_certificate;
+	configfile_settings[x++].setting = &info.tls_key;
+	configfile_settings[x++].setting = &info.tls_ciphers;
+	configfile_settings[x++].setting = &info.tls_ktls;
+	configfile_settings[x++].setting = &info.max_connections_per_ip;
+	configfile_settings[x++].setting = &info.connect_rate;
+	configfile_settings[x++].setting = &info.connect_burst;
+	configfile_settings[x++].setting = &info.connect_ban_time;
+	configfile_settings[x++].setting = &info.workers;
+	configfile_settings[x++].setting = &info.replication_password;
+	configfile_settings[x++].setting = &info.replicate_from;
+	configfile_settings[x++].setting = &info.replicate_password;
+	configfile_settings[x++].setting = &info.replicate_mounts;
+	configfile_settings[x++].setting = &info.io_uring;
 }
 
 set_element *
@@ -1220,6 +1399,7 @@ parse_config_file(char *file)
 
 	for (i = 0; i < MAXLISTEN; i++) {
 		info.port[i] = 0;
+		info.tls_port[i] = 0;
 	}
 
 	while (fd_read_line (cf, line, BUFSIZE) > 0)
@@ -1252,6 +1432,15 @@ parse_config_file(char *file)
 				info.port[i] = p;
 			continue;
 		}		
+
+		if (ice_strncmp(word, "tls_port", 8) == 0) {
+			int p = atoi(line);
+			for (i = 0; i < MAXLISTEN; i++)
+				if (info.tls_port[i] == 0) break;
+			if (i < MAXLISTEN)
+				info.tls_port[i] = p;
+			continue;
+		}
 		
 		if (!se) {
 			write_log(LOG_DEFAULT, "Unknown setting %s on line %d", word, lineno);
@@ -1269,6 +1458,9 @@ parse_config_file(char *file)
 		}
 	}
 	fd_close(cf);
+
+	log_update_module_levels ();
+	sock_update_policies ();
 	return 0;
 }
 
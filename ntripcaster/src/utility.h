@@ -63,12 +63,16 @@ void kick_connection(void *conarg, void *reasonarg);
 void kick_everything();
 void kick_not_connected (connection_t *con, char *reason);
 void close_connection(void *data, void *param);
+void unlink_client (connection_t *con);
+void reap_clients (connection_t *reap);
 void close_socket(sock_t sock);
 void threaded_detach ();
 int server_detach();
 connection_t *find_source_with_mount (char *mount);
 void kill_threads ();
 unsigned long int new_id ();
+int util_reserve (unsigned long int *count, unsigned long int limit);
+void util_release (unsigned long int *count);
 time_t tree_time(avl_tree *tree);
 void write_icecast_header ();
 void print_startup_server_info ();
@@ -78,12 +82,15 @@ void clear_source_stats (void *data, void *param);
 void clear_client_stats (void *data, void *param);
 int hostname_local (char *name);
 void build_request (char *line, request_t *req);
+void build_request_host (const char *host, request_t *req);
 int mount_exists (char *mount);
 void zero_request (request_t *req);
 void generate_request (char *line, request_t *req);
 void generate_http_request (char *line, request_t *req);
 void init_thread_tree (int line, char *file);
 char *next_mount_point();
+void pending_init ();
+void pending_wakeup ();
 void pending_connection (connection_t *con);
 int pending_source_signoff (connection_t *con);
 int open_for_reading (const char *filename);